@@ -88,7 +88,11 @@ float PCF(Sampler _sampler, vec4 _shadowCoord, float _bias, vec2 _texelSize)
 
 void main()
 {
+#if INSTANCED
+	vec3 color = v_color0.xyz;
+#else
 	vec3 color = u_color.xyz;
+#endif
 
 	vec3 v  = v_view;
 	vec3 vd = -normalize(v);
@@ -0,0 +1,29 @@
+/*
+ * Decoding of the packed mesh vertex formats (see MeshVertexFormat).
+ * u_meshDecode[0].xyz and u_meshDecode[1].xyz are the scale and offset of
+ * the stored positions, u_meshDecode[0].w is 1 for octahedral normals.
+ */
+
+uniform vec4 u_meshDecode[2];
+
+vec3 decodePosition(vec3 _position)
+{
+	return _position * u_meshDecode[0].xyz + u_meshDecode[1].xyz;
+}
+
+vec3 decodeNormal(vec4 _normal)
+{
+	if (u_meshDecode[0].w > 0.5)
+	{
+		vec2 e = _normal.xy * 2.0 - 1.0;
+		vec3 n = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y) );
+		if (n.z < 0.0)
+		{
+			vec2 s = step(vec2(0.0, 0.0), n.xy) * 2.0 - 1.0;
+			n.xy = (1.0 - abs(n.yx) ) * s;
+		}
+		return normalize(n);
+	}
+
+	return _normal.xyz * 2.0 - 1.0;
+}
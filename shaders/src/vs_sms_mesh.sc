@@ -7,18 +7,20 @@ $output v_view, v_normal, v_shadowcoord
  */
 
 #include "../common/common.sh"
+#include "mesh_decode.sh"
 
 uniform mat4 u_lightMtx;
 
 void main()
 {
-	gl_Position = mul(u_modelViewProj, vec4(a_position, 1.0) );
+	vec3 position = decodePosition(a_position);
+	gl_Position = mul(u_modelViewProj, vec4(position, 1.0) );
 
-	vec4 normal = a_normal * 2.0 - 1.0;
-	v_normal = normalize(normal.xyz); 
-	v_view = mul(u_modelView, vec4(a_position, 1.0)).xyz;
+	vec3 normal = decodeNormal(a_normal);
+	v_normal = normalize(normal); 
+	v_view = mul(u_modelView, vec4(position, 1.0)).xyz;
 
 	const float shadowMapOffset = 0.001;
-	vec3 posOffset = a_position + normal.xyz * shadowMapOffset;
+	vec3 posOffset = position + normal * shadowMapOffset;
 	v_shadowcoord = mul(u_lightMtx, vec4(posOffset, 1.0) );
 }
@@ -0,0 +1,37 @@
+$input a_position, a_normal, i_data0, i_data1, i_data2, i_data3, i_data4
+$output v_view, v_normal, v_shadowcoord, v_color0
+
+/*
+ * Copyright 2013-2014 Dario Manesku. All rights reserved.
+ * License: http://www.opensource.org/licenses/BSD-2-Clause
+ */
+
+#include "../common/common.sh"
+#include "mesh_decode.sh"
+
+uniform mat4 u_lightMtx;
+
+void main()
+{
+	mat4 model;
+	model[0] = i_data0;
+	model[1] = i_data1;
+	model[2] = i_data2;
+	model[3] = i_data3;
+
+	vec4 worldPos = instMul(model, vec4(decodePosition(a_position), 1.0) );
+	gl_Position = mul(u_viewProj, worldPos);
+
+	vec3 normal = decodeNormal(a_normal);
+	vec3 worldNormal = normalize(instMul(model, vec4(normal, 0.0) ).xyz);
+	v_normal = worldNormal;
+	v_view = mul(u_view, worldPos).xyz;
+
+	// u_lightMtx is the plain shadow matrix, the model transform comes from
+	// the instance data
+	const float shadowMapOffset = 0.001;
+	vec4 posOffset = worldPos + vec4(worldNormal * shadowMapOffset, 0.0);
+	v_shadowcoord = mul(u_lightMtx, posOffset);
+
+	v_color0 = i_data4;
+}
@@ -0,0 +1,32 @@
+$input a_position, a_normal, a_indices
+$output v_view, v_normal, v_shadowcoord
+
+/*
+ * Copyright 2013-2014 Dario Manesku. All rights reserved.
+ * License: http://www.opensource.org/licenses/BSD-2-Clause
+ */
+
+#include "../common/common.sh"
+#include "mesh_decode.sh"
+
+uniform mat4 u_lightMtx;
+
+void main()
+{
+	// rigid skinning: every vertex is attached to a single bone
+	mat4 model = u_model[int(a_indices.x)];
+
+	vec4 worldPos = mul(model, vec4(decodePosition(a_position), 1.0) );
+	gl_Position = mul(u_viewProj, worldPos);
+
+	vec3 normal = decodeNormal(a_normal);
+	vec3 worldNormal = normalize(mul(model, vec4(normal, 0.0) ).xyz);
+	v_normal = worldNormal;
+	v_view = mul(u_view, worldPos).xyz;
+
+	// u_lightMtx is the plain shadow matrix, the model transform comes from
+	// the bone matrices
+	const float shadowMapOffset = 0.001;
+	vec4 posOffset = worldPos + vec4(worldNormal * shadowMapOffset, 0.0);
+	v_shadowcoord = mul(u_lightMtx, posOffset);
+}
@@ -7,9 +7,11 @@ $output v_position
  */
 
 #include "../common/common.sh"
+#include "mesh_decode.sh"
 
 void main()
 {
-	gl_Position = mul(u_modelViewProj, vec4(a_position, 1.0) );
+	vec3 position = decodePosition(a_position);
+	gl_Position = mul(u_modelViewProj, vec4(position, 1.0) );
 	v_position = gl_Position;
 }
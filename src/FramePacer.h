@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <bx/timer.h>
+
+#include "Timer.h"
+
+// Waits for the remainder of the frame budget: the thread sleeps while
+// more than mSpinTime remains and spins for the rest, as sleeping alone is
+// too coarse to hit the target. Also keeps a history of frame times from
+// which the percentiles in the Timer are computed.
+struct FramePacer {
+	static const int cHistorySize = 256;
+
+	// spin instead of sleeping for the final part of the frame (seconds)
+	double mSpinTime = 0.001;
+
+	int64_t mFrameStart = 0;
+
+	float mHistory[cHistorySize];
+	int mHistoryIndex = 0;
+	int mHistoryCount = 0;
+
+	void Start() {
+		mFrameStart = bx::getHPCounter();
+	}
+
+	// Waits until timer.mTargetFrameTime passed since the start of the
+	// frame (does nothing if it is 0) and starts the next frame.
+	void Wait(Timer& timer) {
+		const double freq = double(bx::getHPFrequency());
+		int64_t now = bx::getHPCounter();
+
+		if (timer.mTargetFrameTime > 0.0f) {
+			int64_t target = mFrameStart + int64_t(timer.mTargetFrameTime * freq);
+			int64_t spin_ticks = int64_t(mSpinTime * freq);
+
+			if (target - now > spin_ticks) {
+				usleep(useconds_t((target - now - spin_ticks) * 1.0e6 / freq));
+			}
+
+			now = bx::getHPCounter();
+			while (now < target) {
+				now = bx::getHPCounter();
+			}
+		}
+
+		AddFrameTime(timer, float((now - mFrameStart) / freq));
+		mFrameStart = now;
+	}
+
+	void AddFrameTime(Timer& timer, float frame_time) {
+		mHistory[mHistoryIndex] = frame_time;
+		mHistoryIndex = (mHistoryIndex + 1) % cHistorySize;
+		mHistoryCount = std::min(mHistoryCount + 1, cHistorySize);
+
+		float sorted[cHistorySize];
+		std::copy(mHistory, mHistory + mHistoryCount, sorted);
+
+		timer.mFrameTimeP50 = Percentile(sorted, mHistoryCount, 0.50f);
+		timer.mFrameTimeP95 = Percentile(sorted, mHistoryCount, 0.95f);
+		timer.mFrameTimeP99 = Percentile(sorted, mHistoryCount, 0.99f);
+	}
+
+	// Partially sorts values such that the requested percentile can be
+	// read.
+	static float Percentile(float* values, int count, float percentile) {
+		int index = std::min(int(percentile * count), count - 1);
+		std::nth_element(values, values + index, values + count);
+		return values[index];
+	}
+};
@@ -23,3 +23,12 @@ extern ReadSerializer* gReadSerializer;
 
 struct GuiInputState;
 extern GuiInputState* gGuiInputState;
+
+struct JobSystem;
+extern JobSystem* gJobSystem;
+
+struct Profiler;
+extern Profiler* gProfiler;
+
+struct RewindBuffer;
+extern RewindBuffer* gRewindBuffer;
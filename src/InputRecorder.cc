@@ -0,0 +1,262 @@
+#include "InputRecorder.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+#include <bx/timer.h>
+
+#include "RuntimeModuleManager.h"
+
+static const char cLogMagic[4] = { 'P', 'T', 'I', 'R' };
+
+template <typename T>
+static void WriteValue(std::ofstream& stream, const T& value) {
+	stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static bool ReadValue(std::ifstream& stream, T& value) {
+	stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+	return stream.gcount() == sizeof(T);
+}
+
+bool InputRecorder::StartRecording(const char* filename, RuntimeModuleManager& module_manager) {
+	mOutStream.open(filename, std::ofstream::binary | std::ofstream::trunc);
+	if (!mOutStream) {
+		gLog ("Error: could not open input log %s for writing", filename);
+		return false;
+	}
+
+	mOutStream.write(cLogMagic, sizeof(cLogMagic));
+	WriteValue(mOutStream, uint32_t(cVersion));
+	WriteValue(mOutStream, uint32_t(GuiInputState::cMaxKeys));
+
+	WriteSerializer serializer;
+	serializer.Open(&mInitialState);
+	for (int i = 0; i < module_manager.mModules.size(); i++) {
+		RuntimeModule* module = module_manager.mModules[i];
+		if (module->handle && module->api.capture) {
+			module->api.capture(module->state, &serializer);
+		}
+	}
+	serializer.Close();
+
+	WriteValue(mOutStream, uint32_t(mInitialState.index.size()));
+	WriteValue(mOutStream, uint64_t(mInitialState.payload.size()));
+	mOutStream.write(reinterpret_cast<const char*>(mInitialState.index.data()),
+			mInitialState.index.size() * sizeof(SnapshotIndexEntry));
+	mOutStream.write(mInitialState.payload.data(), mInitialState.payload.size());
+
+	memset(mKeyStates, 0, sizeof(mKeyStates));
+	mNumFrames = 0;
+
+	gLog ("Recording input to %s", filename);
+	return true;
+}
+
+void InputRecorder::RecordFrame(const GuiInputState& input, float frame_time) {
+	uint8_t flags = 0;
+	if (input.focused) {
+		flags |= FlagFocused;
+	}
+	if (memcmp(mKeyStates, input.keyStates, sizeof(mKeyStates)) != 0) {
+		flags |= FlagKeysChanged;
+	}
+
+	WriteValue(mOutStream, frame_time);
+	WriteValue(mOutStream, input.mousedX);
+	WriteValue(mOutStream, input.mousedY);
+	WriteValue(mOutStream, input.mouseX);
+	WriteValue(mOutStream, input.mouseY);
+	WriteValue(mOutStream, input.mouseScroll);
+	WriteValue(mOutStream, input.mouseButton);
+	WriteValue(mOutStream, input.key);
+	WriteValue(mOutStream, flags);
+
+	if (flags & FlagKeysChanged) {
+		memcpy(mKeyStates, input.keyStates, sizeof(mKeyStates));
+		WriteValue(mOutStream, mKeyStates);
+	}
+
+	mNumFrames++;
+}
+
+void InputRecorder::StopRecording() {
+	if (!IsRecording()) {
+		return;
+	}
+
+	mOutStream.close();
+	gLog ("Recorded %d frames of input", mNumFrames);
+}
+
+bool InputRecorder::StartReplay(const char* filename, RuntimeModuleManager& module_manager) {
+	mInStream.open(filename, std::ifstream::binary);
+	if (!mInStream) {
+		gLog ("Error: could not open input log %s", filename);
+		return false;
+	}
+
+	char magic[4];
+	uint32_t version = 0;
+	uint32_t max_keys = 0;
+	mInStream.read(magic, sizeof(magic));
+	if (mInStream.gcount() != sizeof(magic)
+			|| memcmp(magic, cLogMagic, sizeof(magic)) != 0
+			|| !ReadValue(mInStream, version)
+			|| !ReadValue(mInStream, max_keys)) {
+		gLog ("Error: %s is not an input log", filename);
+		mInStream.close();
+		return false;
+	}
+
+	if (version != cVersion || max_keys != GuiInputState::cMaxKeys) {
+		gLog ("Error: input log %s has version %d (%d keys), expected %d (%d keys)",
+				filename, version, max_keys, cVersion, GuiInputState::cMaxKeys);
+		mInStream.close();
+		return false;
+	}
+
+	uint32_t num_entries = 0;
+	uint64_t payload_size = 0;
+	bool valid = ReadValue(mInStream, num_entries)
+		&& ReadValue(mInStream, payload_size);
+	if (valid) {
+		mInitialState.index.resize(num_entries);
+		mInitialState.payload.resize(payload_size);
+		uint64_t index_size = num_entries * sizeof(SnapshotIndexEntry);
+		mInStream.read(reinterpret_cast<char*>(mInitialState.index.data()), index_size);
+		valid = uint64_t(mInStream.gcount()) == index_size;
+		mInStream.read(mInitialState.payload.data(), payload_size);
+		valid = valid && uint64_t(mInStream.gcount()) == payload_size;
+	}
+
+	for (uint32_t i = 0; valid && i < num_entries; i++) {
+		const SnapshotIndexEntry& entry = mInitialState.index[i];
+		valid = entry.offset <= payload_size && entry.size <= payload_size - entry.offset;
+	}
+
+	if (!valid) {
+		gLog ("Error: could not read the initial state of input log %s", filename);
+		mInStream.close();
+		return false;
+	}
+
+	ReadSerializer serializer;
+	serializer.Open(mInitialState);
+	for (int i = 0; i < module_manager.mModules.size(); i++) {
+		RuntimeModule* module = module_manager.mModules[i];
+		if (module->handle && module->api.restore) {
+			module->api.restore(module->state, &serializer);
+		}
+	}
+	serializer.Close();
+
+	memset(mKeyStates, 0, sizeof(mKeyStates));
+	mNumFrames = 0;
+
+	gLog ("Replaying input from %s", filename);
+	return true;
+}
+
+bool InputRecorder::ReplayFrame(GuiInputState& input, float& frame_time) {
+	if (!IsReplaying()) {
+		return false;
+	}
+
+	uint8_t flags = 0;
+	bool result = ReadValue(mInStream, frame_time)
+		&& ReadValue(mInStream, input.mousedX)
+		&& ReadValue(mInStream, input.mousedY)
+		&& ReadValue(mInStream, input.mouseX)
+		&& ReadValue(mInStream, input.mouseY)
+		&& ReadValue(mInStream, input.mouseScroll)
+		&& ReadValue(mInStream, input.mouseButton)
+		&& ReadValue(mInStream, input.key)
+		&& ReadValue(mInStream, flags);
+
+	if (result && (flags & FlagKeysChanged)) {
+		result = ReadValue(mInStream, mKeyStates);
+	}
+
+	if (!result) {
+		return false;
+	}
+
+	input.focused = (flags & FlagFocused) != 0;
+	memcpy(input.keyStates, mKeyStates, sizeof(mKeyStates));
+
+	mNumFrames++;
+	return true;
+}
+
+void InputRecorder::StopReplay() {
+	if (!IsReplaying()) {
+		return;
+	}
+
+	mInStream.close();
+	gLog ("Replayed %d frames of input", mNumFrames);
+}
+
+void ReplayStatistics::AddFrame(const RuntimeModuleManager& module_manager, float frame_time) {
+	mFrameTimes.push_back(frame_time);
+
+	const double to_seconds = 1.0 / double(bx::getHPFrequency());
+	for (int i = 0; i < module_manager.mModules.size(); i++) {
+		const RuntimeModule* module = module_manager.mModules[i];
+
+		int index = std::find(mModuleNames.begin(), mModuleNames.end(), module->name)
+			- mModuleNames.begin();
+		if (index == mModuleNames.size()) {
+			mModuleNames.push_back(module->name);
+			mModuleStepTimes.push_back(std::vector<float>());
+			mModuleSimulateTimes.push_back(std::vector<float>());
+		}
+
+		mModuleStepTimes[index].push_back(float(module->step_ticks * to_seconds));
+		mModuleSimulateTimes[index].push_back(float(module->simulate_ticks * to_seconds));
+	}
+}
+
+static void PrintTimes(const char* name, std::vector<float> times) {
+	if (times.size() == 0) {
+		return;
+	}
+
+	double sum = 0.;
+	for (int i = 0; i < times.size(); i++) {
+		sum += times[i];
+	}
+
+	std::sort(times.begin(), times.end());
+	int count = times.size();
+
+	gLog ("  %-40s mean %7.3f p50 %7.3f p95 %7.3f p99 %7.3f max %7.3f (ms)",
+			name,
+			sum / count * 1000.,
+			times[std::min(int(0.50f * count), count - 1)] * 1000.f,
+			times[std::min(int(0.95f * count), count - 1)] * 1000.f,
+			times[std::min(int(0.99f * count), count - 1)] * 1000.f,
+			times[count - 1] * 1000.f);
+}
+
+void ReplayStatistics::Print() {
+	double total = 0.;
+	for (int i = 0; i < mFrameTimes.size(); i++) {
+		total += mFrameTimes[i];
+	}
+
+	gLog ("Replay of %d frames took %.3f s", int(mFrameTimes.size()), total);
+	PrintTimes("Frame", mFrameTimes);
+	for (int i = 0; i < mModuleNames.size(); i++) {
+		PrintTimes((mModuleNames[i] + " step").c_str(), mModuleStepTimes[i]);
+		// modules without simulate() only have zero durations
+		const std::vector<float>& simulate_times = mModuleSimulateTimes[i];
+		if (std::find_if(simulate_times.begin(), simulate_times.end(),
+					[](float time) { return time > 0.f; }) != simulate_times.end()) {
+			PrintTimes((mModuleNames[i] + " simulate").c_str(), simulate_times);
+		}
+	}
+}
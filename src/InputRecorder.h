@@ -0,0 +1,79 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "Utils.h"
+#include "Serializer.h"
+
+struct RuntimeModuleManager;
+
+// Records the input state and the frame time of every frame into a binary
+// log such that a session can be replayed deterministically, e.g. as a
+// headless benchmark:
+//
+//   protot --record session.log
+//   protot --replay session.log
+//
+// Recordings and replays do not read the state file. The log starts with
+// the simulation state of the modules (module_api::capture) at the start
+// of the recording, which gets restored when the replay starts:
+//
+//   uint32 num_entries
+//   uint64 payload_size
+//   SnapshotIndexEntry[num_entries]
+//   char payload[payload_size]
+//
+// Every frame is then stored as
+//
+//   float frame_time
+//   int32 mousedX, mousedY, mouseX, mouseY, mouseScroll
+//   uint8 mouseButton, key, flags
+//   uint64 keyStates[GuiInputState::cMaxKeys / 64]  (only if FlagKeysChanged)
+//
+// Key states are only written when they differ from the previous frame.
+struct InputRecorder {
+	static const uint32_t cVersion = 2;
+
+	enum FrameFlags {
+		FlagFocused = 1 << 0,
+		FlagKeysChanged = 1 << 1
+	};
+
+	std::ofstream mOutStream;
+	std::ifstream mInStream;
+	int mNumFrames = 0;
+
+	// key states of the last written or read frame
+	uint64_t mKeyStates[GuiInputState::cMaxKeys / 64] = { 0 };
+
+	// simulation state at the start of the log
+	Snapshot mInitialState;
+
+	bool IsRecording() const { return mOutStream.is_open(); }
+	bool IsReplaying() const { return mInStream.is_open(); }
+
+	bool StartRecording(const char* filename, RuntimeModuleManager& module_manager);
+	void RecordFrame(const GuiInputState& input, float frame_time);
+	void StopRecording();
+
+	bool StartReplay(const char* filename, RuntimeModuleManager& module_manager);
+	// returns false once the end of the log was reached
+	bool ReplayFrame(GuiInputState& input, float& frame_time);
+	void StopReplay();
+};
+
+// Collects the duration of every frame and of the step and the simulation
+// steps of every module during a replay and prints a summary at the end.
+struct ReplayStatistics {
+	std::vector<float> mFrameTimes;
+	std::vector<std::string> mModuleNames;
+	std::vector<std::vector<float> > mModuleStepTimes;
+	std::vector<std::vector<float> > mModuleSimulateTimes;
+
+	void AddFrame(const RuntimeModuleManager& module_manager, float frame_time);
+	void Print();
+};
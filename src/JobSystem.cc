@@ -0,0 +1,258 @@
+#include "JobSystem.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <bx/os.h>
+
+#include "Globals.h"
+#include "Profiler.h"
+
+// index of the calling thread into the worker queues, 0 is the main thread
+static thread_local int sThreadIndex = 0;
+
+struct WorkerThreadData {
+	JobSystem* jobSystem;
+	int threadIndex;
+};
+
+static int32_t WorkerThreadFn(void* user_data) {
+	WorkerThreadData* thread_data = static_cast<WorkerThreadData*>(user_data);
+	JobSystem* job_system = thread_data->jobSystem;
+	int thread_index = thread_data->threadIndex;
+	delete thread_data;
+
+	return job_system->WorkerLoop(thread_index);
+}
+
+void JobSystem::Init(int num_workers) {
+	if (num_workers < 0) {
+		num_workers = std::max((int) sysconf(_SC_NPROCESSORS_ONLN) - 1, 0);
+	}
+
+	gLog ("Initializing job system with %d worker threads", num_workers);
+
+	mNumThreads = num_workers + 1;
+	mQueues = new WorkerQueue[mNumThreads];
+	mJobs = new Job[mNumThreads * cMaxJobsPerThread];
+	for (int i = 0; i < mNumThreads * cMaxJobsPerThread; i++) {
+		mJobs[i].unfinished = 0;
+		mJobs[i].inUse = false;
+	}
+	mNumAllocatedJobs = new uint32_t[mNumThreads];
+	for (int i = 0; i < mNumThreads; i++) {
+		mNumAllocatedJobs[i] = 0;
+	}
+
+	mQuit = false;
+	sThreadIndex = 0;
+
+	mThreads = new bx::Thread[num_workers];
+	for (int i = 0; i < num_workers; i++) {
+		WorkerThreadData* thread_data = new WorkerThreadData;
+		thread_data->jobSystem = this;
+		thread_data->threadIndex = i + 1;
+		mThreads[i].init(WorkerThreadFn, thread_data, 0, "JobWorker");
+	}
+}
+
+void JobSystem::Shutdown() {
+	WaitIdle();
+
+	mQuit = true;
+	mWorkSemaphore.post(mNumThreads);
+	for (int i = 0; i < mNumThreads - 1; i++) {
+		mThreads[i].shutdown();
+	}
+
+	delete[] mThreads;
+	mThreads = nullptr;
+	delete[] mQueues;
+	mQueues = nullptr;
+	delete[] mJobs;
+	mJobs = nullptr;
+	delete[] mNumAllocatedJobs;
+	mNumAllocatedJobs = nullptr;
+	mNumThreads = 0;
+}
+
+int JobSystem::GetThreadIndex() {
+	return sThreadIndex;
+}
+
+Job* JobSystem::CreateJob(JobFunction function, void* data, Job* parent) {
+	int thread_index = sThreadIndex;
+
+	// Jobs are taken from a per thread ring buffer. Only the calling thread
+	// allocates from it so no synchronization is needed. Slots whose job is
+	// still pending get skipped: with nested jobs these may be ancestors of
+	// the calling job that can only finish after it returned. If all slots
+	// are in use, help executing jobs until one gets free.
+	Job* job = nullptr;
+	while (job == nullptr) {
+		for (int i = 0; i < cMaxJobsPerThread && job == nullptr; i++) {
+			uint32_t index = mNumAllocatedJobs[thread_index]++ & (cMaxJobsPerThread - 1);
+			Job* slot = &mJobs[thread_index * cMaxJobsPerThread + index];
+			if (!slot->inUse) {
+				job = slot;
+			}
+		}
+
+		if (job == nullptr) {
+			Job* next_job = GetJob(thread_index);
+			if (next_job != nullptr) {
+				Execute(next_job);
+			} else {
+				bx::yield();
+			}
+		}
+	}
+
+	job->function = function;
+	job->data = data;
+	job->parent = parent;
+	job->unfinished = 1;
+	job->dependencies = 1;
+	job->numContinuations = 0;
+	job->inUse = true;
+
+	if (parent != nullptr) {
+		parent->unfinished++;
+	}
+
+	return job;
+}
+
+void JobSystem::AddDependency(Job* job, Job* dependency) {
+	assert (dependency->numContinuations < Job::cMaxContinuations);
+
+	job->dependencies++;
+	dependency->continuations[dependency->numContinuations++] = job;
+}
+
+void JobSystem::Run(Job* job) {
+	mNumPendingJobs++;
+
+	if (--job->dependencies > 0) {
+		return;
+	}
+
+	WorkerQueue& queue = mQueues[sThreadIndex];
+	{
+		bx::MutexScope lock(queue.mutex);
+		queue.jobs.push_back(job);
+	}
+
+	mWorkSemaphore.post();
+}
+
+Job* JobSystem::GetJob(int thread_index) {
+	// take the most recent job of our own queue
+	{
+		WorkerQueue& queue = mQueues[thread_index];
+		bx::MutexScope lock(queue.mutex);
+		if (!queue.jobs.empty()) {
+			Job* job = queue.jobs.back();
+			queue.jobs.pop_back();
+			return job;
+		}
+	}
+
+	// otherwise steal the oldest job of another queue
+	for (int i = 1; i < mNumThreads; i++) {
+		WorkerQueue& queue = mQueues[(thread_index + i) % mNumThreads];
+		bx::MutexScope lock(queue.mutex);
+		if (!queue.jobs.empty()) {
+			Job* job = queue.jobs.front();
+			queue.jobs.pop_front();
+			return job;
+		}
+	}
+
+	return nullptr;
+}
+
+void JobSystem::Execute(Job* job) {
+	if (job->function != nullptr) {
+		job->function(job, job->data);
+	}
+
+	Finish(job);
+}
+
+void JobSystem::Finish(Job* job) {
+	if (--job->unfinished > 0) {
+		return;
+	}
+
+	// read everything we need before the job may get reused
+	Job* parent = job->parent;
+	int num_continuations = job->numContinuations;
+	Job* continuations[Job::cMaxContinuations];
+	for (int i = 0; i < num_continuations; i++) {
+		continuations[i] = job->continuations[i];
+	}
+	job->inUse = false;
+
+	for (int i = 0; i < num_continuations; i++) {
+		Job* continuation = continuations[i];
+		if (--continuation->dependencies == 0) {
+			WorkerQueue& queue = mQueues[sThreadIndex];
+			{
+				bx::MutexScope lock(queue.mutex);
+				queue.jobs.push_back(continuation);
+			}
+			mWorkSemaphore.post();
+		}
+	}
+
+	if (parent != nullptr) {
+		Finish(parent);
+	}
+
+	mNumPendingJobs--;
+}
+
+void JobSystem::Wait(Job* job) {
+	while (job->unfinished > 0) {
+		Job* next_job = GetJob(sThreadIndex);
+		if (next_job != nullptr) {
+			Execute(next_job);
+		} else {
+			bx::yield();
+		}
+	}
+}
+
+void JobSystem::WaitIdle() {
+	while (mNumPendingJobs > 0) {
+		Job* next_job = GetJob(sThreadIndex);
+		if (next_job != nullptr) {
+			Execute(next_job);
+		} else {
+			bx::yield();
+		}
+	}
+}
+
+int32_t JobSystem::WorkerLoop(int thread_index) {
+	sThreadIndex = thread_index;
+
+	if (gProfiler != nullptr) {
+		char name[32];
+		snprintf(name, sizeof(name), "JobWorker %d", thread_index);
+		gProfiler->SetThreadName(name);
+	}
+
+	while (!mQuit) {
+		Job* job = GetJob(thread_index);
+		if (job != nullptr) {
+			Execute(job);
+		} else {
+			mWorkSemaphore.wait();
+		}
+	}
+
+	return 0;
+}
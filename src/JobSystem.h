@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <bx/thread.h>
+#include <bx/mutex.h>
+#include <bx/semaphore.h>
+
+// Work-stealing job system. Every thread (the main thread has index 0)
+// owns a deque of runnable jobs: the owner pushes and pops at the back,
+// other threads steal from the front.
+//
+// The job system lives in the host executable so that it survives module
+// reloads. Jobs may run code of modules, therefore the module manager
+// waits until all jobs are done before it unloads any module.
+//
+// Usage:
+//
+//   Job* root = gJobSystem->CreateJob(nullptr, nullptr);
+//   Job* a = gJobSystem->CreateJob(FunctionA, data_a, root);
+//   Job* b = gJobSystem->CreateJob(FunctionB, data_b, root);
+//   gJobSystem->AddDependency(b, a); // b runs after a finished
+//   gJobSystem->Run(a);
+//   gJobSystem->Run(b);
+//   gJobSystem->Run(root);
+//   gJobSystem->Wait(root);          // a and b are children of root
+//
+// Jobs may only be created and run from the main thread and from jobs.
+
+typedef void (*JobFunction)(struct Job* job, void* data);
+
+struct Job {
+	static const int cMaxContinuations = 8;
+	static const int cPayloadSize = 64;
+
+	JobFunction function;
+	void* data;
+	Job* parent;
+
+	// the job itself and its unfinished children
+	std::atomic<int> unfinished;
+	// unfinished dependencies plus one until Run() was called
+	std::atomic<int> dependencies;
+	// cleared once the job finished and its slot can be reused
+	std::atomic<bool> inUse;
+
+	Job* continuations[cMaxContinuations];
+	int numContinuations;
+
+	// storage for small job data such that no extra allocation is needed
+	alignas(16) char payload[cPayloadSize];
+};
+
+struct JobSystem {
+	// number of jobs of the ring buffer of each thread, slots of finished
+	// jobs get reused. Must be a power of two.
+	static const int cMaxJobsPerThread = 4096;
+	// ParallelFor() uses larger chunks rather than more jobs than this such
+	// that its root job is not reused while the chunks get created
+	static const int cMaxParallelForChunks = cMaxJobsPerThread / 4;
+
+	struct WorkerQueue {
+		bx::Mutex mutex;
+		std::deque<Job*> jobs;
+	};
+
+	int mNumThreads = 0;
+	bx::Thread* mThreads = nullptr;
+	WorkerQueue* mQueues = nullptr;
+
+	Job* mJobs = nullptr;
+	uint32_t* mNumAllocatedJobs = nullptr;
+
+	bx::Semaphore mWorkSemaphore;
+	std::atomic<bool> mQuit { false };
+	std::atomic<int> mNumPendingJobs { 0 };
+
+	// num_workers < 0 uses one worker per additional hardware thread
+	void Init(int num_workers = -1);
+	void Shutdown();
+
+	int GetThreadIndex();
+
+	Job* CreateJob(JobFunction function, void* data, Job* parent = nullptr);
+
+	// job gets scheduled once dependency has finished. Has to be called
+	// before Run() gets called for either of the two jobs.
+	void AddDependency(Job* job, Job* dependency);
+
+	// schedules the job once all its dependencies are finished
+	void Run(Job* job);
+
+	// executes other jobs until job and all its children are finished
+	void Wait(Job* job);
+
+	// executes jobs until no more jobs are pending
+	void WaitIdle();
+
+	template <typename Function>
+	void ParallelFor(int begin, int end, int grain_size, const Function& function);
+
+	int32_t WorkerLoop(int thread_index);
+	Job* GetJob(int thread_index);
+	void Execute(Job* job);
+	void Finish(Job* job);
+};
+
+template <typename Function>
+struct ParallelForRange {
+	int begin;
+	int end;
+	const Function* function;
+};
+
+template <typename Function>
+static void ParallelForJob(Job* job, void* data) {
+	const ParallelForRange<Function>* range =
+		static_cast<const ParallelForRange<Function>*>(data);
+
+	for (int i = range->begin; i < range->end; i++) {
+		(*range->function)(i);
+	}
+}
+
+// Calls function(i) for all i in [begin, end) in chunks of grain_size
+// indices (or larger ones for more than cMaxParallelForChunks chunks) and
+// returns when all calls are done.
+template <typename Function>
+void JobSystem::ParallelFor(int begin, int end, int grain_size, const Function& function) {
+	static_assert (sizeof(ParallelForRange<Function>) <= Job::cPayloadSize,
+			"ParallelForRange does not fit into the job payload");
+
+	if (end <= begin) {
+		return;
+	}
+
+	grain_size = std::max(grain_size, 1);
+	if ((end - begin + grain_size - 1) / grain_size > cMaxParallelForChunks) {
+		grain_size = (end - begin + cMaxParallelForChunks - 1) / cMaxParallelForChunks;
+	}
+
+	Job* root = CreateJob(nullptr, nullptr);
+	for (int chunk_begin = begin; chunk_begin < end; chunk_begin += grain_size) {
+		Job* job = CreateJob(ParallelForJob<Function>, nullptr, root);
+
+		ParallelForRange<Function>* range =
+			new (job->payload) ParallelForRange<Function>();
+		range->begin = chunk_begin;
+		range->end = std::min(chunk_begin + grain_size, end);
+		range->function = &function;
+		job->data = range;
+
+		Run(job);
+	}
+
+	Run(root);
+	Wait(root);
+}
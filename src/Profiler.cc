@@ -0,0 +1,219 @@
+#include "Profiler.h"
+
+#include <stdio.h>
+#include <fstream>
+#include <algorithm>
+
+#include <bx/timer.h>
+
+static thread_local Profiler::ThreadBuffer* sThreadBuffer = nullptr;
+
+Profiler::Profiler() {
+	// marker 0 is used by scopes that were created without a profiler
+	mMarkerNames.push_back("unknown");
+}
+
+Profiler::~Profiler() {
+	for (int i = 0; i < mThreadBuffers.size(); i++) {
+		delete mThreadBuffers[i];
+	}
+}
+
+uint32_t Profiler::RegisterMarker(const char* name) {
+	bx::MutexScope lock(mMutex);
+
+	for (uint32_t i = 0; i < mMarkerNames.size(); i++) {
+		if (mMarkerNames[i] == name) {
+			return i;
+		}
+	}
+
+	mMarkerNames.push_back(name);
+	return mMarkerNames.size() - 1;
+}
+
+const char* Profiler::GetMarkerName(uint32_t marker) {
+	bx::MutexScope lock(mMutex);
+
+	if (marker >= mMarkerNames.size()) {
+		return "unknown";
+	}
+
+	return mMarkerNames[marker].c_str();
+}
+
+Profiler::ThreadBuffer* Profiler::GetThreadBuffer() {
+	if (sThreadBuffer == nullptr) {
+		bx::MutexScope lock(mMutex);
+
+		sThreadBuffer = new ThreadBuffer();
+		sThreadBuffer->threadIndex = mThreadBuffers.size();
+
+		char name[32];
+		snprintf(name, sizeof(name), "Thread %d", sThreadBuffer->threadIndex);
+		sThreadBuffer->name = name;
+
+		mThreadBuffers.push_back(sThreadBuffer);
+	}
+
+	return sThreadBuffer;
+}
+
+void Profiler::SetThreadName(const char* name) {
+	ThreadBuffer* buffer = GetThreadBuffer();
+
+	bx::MutexScope lock(mMutex);
+	buffer->name = name;
+}
+
+std::string Profiler::GetThreadName(int thread_index) {
+	bx::MutexScope lock(mMutex);
+
+	if (thread_index < 0 || thread_index >= mThreadBuffers.size()) {
+		return "unknown";
+	}
+
+	return mThreadBuffers[thread_index]->name;
+}
+
+static inline void PushEvent(Profiler::ThreadBuffer* buffer, uint32_t marker, uint32_t begin) {
+	uint32_t head = buffer->head.load(std::memory_order_relaxed);
+	uint32_t tail = buffer->tail.load(std::memory_order_acquire);
+
+	if (head - tail >= Profiler::cRingBufferSize) {
+		buffer->numDropped++;
+		return;
+	}
+
+	Profiler::Event& event = buffer->events[head & (Profiler::cRingBufferSize - 1)];
+	event.time = bx::getHPCounter();
+	event.marker = marker;
+	event.begin = begin;
+
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void Profiler::BeginZone(uint32_t marker) {
+	PushEvent(GetThreadBuffer(), marker, 1);
+}
+
+void Profiler::EndZone(uint32_t marker) {
+	PushEvent(GetThreadBuffer(), marker, 0);
+}
+
+void Profiler::Collect(ThreadBuffer* buffer) {
+	uint32_t tail = buffer->tail.load(std::memory_order_relaxed);
+	uint32_t head = buffer->head.load(std::memory_order_acquire);
+
+	for (; tail != head; tail++) {
+		const Event& event = buffer->events[tail & (cRingBufferSize - 1)];
+
+		if (event.begin) {
+			buffer->stack.push_back(event);
+			continue;
+		}
+
+		// an end event without begin event (e.g. the begin was dropped)
+		// must not close the zone of another marker
+		int open_index = int(buffer->stack.size()) - 1;
+		while (open_index >= 0 && buffer->stack[open_index].marker != event.marker) {
+			open_index--;
+		}
+		if (open_index < 0) {
+			continue;
+		}
+
+		// the end events of the zones above were dropped
+		buffer->stack.resize(open_index + 1);
+
+		Zone zone;
+		zone.marker = buffer->stack.back().marker;
+		zone.threadIndex = buffer->threadIndex;
+		zone.depth = buffer->stack.size() - 1;
+		zone.start = buffer->stack.back().time;
+		zone.end = event.time;
+		mZones.push_back(zone);
+
+		buffer->stack.pop_back();
+	}
+
+	buffer->tail.store(tail, std::memory_order_release);
+}
+
+void Profiler::EndFrame() {
+	int64_t now = bx::getHPCounter();
+
+	if (mFrameStart != 0) {
+		Frame frame;
+		frame.start = mFrameStart;
+		frame.end = now;
+		mFrames.push_back(frame);
+	}
+	mFrameStart = now;
+
+	std::vector<ThreadBuffer*> thread_buffers;
+	{
+		bx::MutexScope lock(mMutex);
+		thread_buffers = mThreadBuffers;
+	}
+
+	for (int i = 0; i < thread_buffers.size(); i++) {
+		Collect(thread_buffers[i]);
+	}
+
+	// only keep the zones of the last frames
+	while (mFrames.size() > cMaxFrames) {
+		mFrames.pop_front();
+	}
+
+	if (mFrames.size() > 0) {
+		while (mZones.size() > 0 && mZones.front().end < mFrames.front().start) {
+			mZones.pop_front();
+		}
+	}
+}
+
+bool Profiler::WriteChromeTrace(const char* filename) {
+	std::ofstream stream(filename, std::ofstream::trunc);
+	if (!stream) {
+		gLog ("Error: could not write profiler trace to %s", filename);
+		return false;
+	}
+
+	const double to_us = 1.0e6 / double(bx::getHPFrequency());
+	int64_t time_offset = mZones.size() > 0 ? mZones.front().start : 0;
+	for (int i = 0; i < mZones.size(); i++) {
+		time_offset = std::min(time_offset, mZones[i].start);
+	}
+
+	stream << "{\"traceEvents\":[" << std::endl;
+
+	bool first = true;
+	{
+		bx::MutexScope lock(mMutex);
+		for (int i = 0; i < mThreadBuffers.size(); i++) {
+			stream << (first ? "" : ",\n")
+				<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" 
+				<< mThreadBuffers[i]->threadIndex
+				<< ",\"args\":{\"name\":\"" << mThreadBuffers[i]->name << "\"}}";
+			first = false;
+		}
+	}
+
+	for (int i = 0; i < mZones.size(); i++) {
+		const Zone& zone = mZones[i];
+		stream << (first ? "" : ",\n") 
+			<< "{\"name\":\"" << GetMarkerName(zone.marker) << "\""
+			<< ",\"ph\":\"X\",\"pid\":0,\"tid\":" << zone.threadIndex
+			<< ",\"ts\":" << (zone.start - time_offset) * to_us
+			<< ",\"dur\":" << (zone.end - zone.start) * to_us
+			<< "}";
+		first = false;
+	}
+
+	stream << std::endl << "]}" << std::endl;
+
+	gLog ("Wrote %d profiler zones to %s", (int) mZones.size(), filename);
+
+	return true;
+}
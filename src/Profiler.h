@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <bx/mutex.h>
+
+#include "Globals.h"
+
+// Hierarchical CPU profiler. Scopes are recorded as begin/end events with
+// bx::getHPCounter() timestamps into a lock-free ring buffer of the
+// calling thread. Once per frame the main thread drains all ring buffers
+// and assembles the events into zones that can be shown as a flame graph
+// or exported as a Chrome trace (chrome://tracing).
+//
+// Marker names are interned as their strings may live in a module that
+// gets unloaded.
+//
+// Usage:
+//
+//   void Renderer::paintGL() {
+//     PROFILE_SCOPE("paintGL");
+//     ...
+//   }
+
+struct Profiler {
+	static const int cRingBufferSize = 16384;
+	static const int cMaxFrames = 300;
+
+	struct Event {
+		int64_t time;
+		uint32_t marker;
+		uint32_t begin;
+	};
+
+	// Single producer (the owning thread), single consumer (the thread
+	// that calls EndFrame()) ring buffer
+	struct ThreadBuffer {
+		int threadIndex;
+		std::string name;
+		Event events[cRingBufferSize];
+		std::atomic<uint32_t> head { 0 };
+		std::atomic<uint32_t> tail { 0 };
+		uint32_t numDropped = 0;
+
+		// open zones, only accessed by the consumer
+		std::vector<Event> stack;
+	};
+
+	struct Zone {
+		uint32_t marker;
+		int threadIndex;
+		int depth;
+		int64_t start;
+		int64_t end;
+	};
+
+	struct Frame {
+		int64_t start;
+		int64_t end;
+	};
+
+	bx::Mutex mMutex;
+	// deque so that references to the names stay valid
+	std::deque<std::string> mMarkerNames;
+	std::vector<ThreadBuffer*> mThreadBuffers;
+
+	int64_t mFrameStart = 0;
+	std::deque<Frame> mFrames;
+	std::deque<Zone> mZones;
+
+	Profiler();
+	~Profiler();
+
+	uint32_t RegisterMarker(const char* name);
+	const char* GetMarkerName(uint32_t marker);
+
+	void SetThreadName(const char* name);
+	std::string GetThreadName(int thread_index);
+
+	void BeginZone(uint32_t marker);
+	void EndZone(uint32_t marker);
+
+	// collects the zones of all threads, has to be called from the main
+	// thread at the end of every frame
+	void EndFrame();
+
+	bool WriteChromeTrace(const char* filename);
+
+	ThreadBuffer* GetThreadBuffer();
+	void Collect(ThreadBuffer* buffer);
+};
+
+struct ProfileScope {
+	uint32_t mMarker;
+
+	ProfileScope(uint32_t marker) : mMarker(marker) {
+		if (gProfiler != nullptr) {
+			gProfiler->BeginZone(mMarker);
+		}
+	}
+
+	~ProfileScope() {
+		if (gProfiler != nullptr) {
+			gProfiler->EndZone(mMarker);
+		}
+	}
+};
+
+#define PROFILE_CONCAT_(a, b) a ## b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#define PROFILE_SCOPE(name) \
+	static const uint32_t PROFILE_CONCAT(profile_marker_, __LINE__) = \
+		gProfiler != nullptr ? gProfiler->RegisterMarker(name) : 0; \
+	ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__) \
+		(PROFILE_CONCAT(profile_marker_, __LINE__))
@@ -0,0 +1,325 @@
+#include "RewindBuffer.h"
+
+#include <algorithm>
+
+#include <bx/timer.h>
+
+#include "RuntimeModuleManager.h"
+#include "Profiler.h"
+
+// Zero runs shorter than this are stored as part of the literals.
+static const uint32_t cMinZeroRun = 8;
+
+// Run-length encodes the zero bytes of data ^ reference (reference may be
+// nullptr) as a sequence of (uint32 zeros, uint32 literals, literal bytes).
+// Every sequence but the first starts with at least cMinZeroRun zeros, so
+// dest has to hold at least 2 * size + 16 bytes.
+static uint64_t EncodeXorRle(const char* data, const char* reference, uint64_t size, char* dest) {
+	char* out = dest;
+	uint64_t i = 0;
+
+	while (i < size) {
+		uint64_t zero_start = i;
+		while (i < size && data[i] == (reference ? reference[i] : 0)) {
+			i++;
+		}
+		uint32_t zeros = i - zero_start;
+
+		// literals end at the next zero run that is long enough
+		uint64_t literal_start = i;
+		uint64_t literal_end = i;
+		while (i < size) {
+			if (data[i] != (reference ? reference[i] : 0)) {
+				i++;
+				literal_end = i;
+				continue;
+			}
+
+			uint64_t run_start = i;
+			while (i < size && i - run_start < cMinZeroRun
+					&& data[i] == (reference ? reference[i] : 0)) {
+				i++;
+			}
+			if (i - run_start == cMinZeroRun || i == size) {
+				break;
+			}
+			literal_end = i;
+		}
+		i = literal_end;
+		uint32_t literals = literal_end - literal_start;
+
+		memcpy(out, &zeros, sizeof(uint32_t));
+		memcpy(out + sizeof(uint32_t), &literals, sizeof(uint32_t));
+		out += 2 * sizeof(uint32_t);
+
+		for (uint32_t j = 0; j < literals; j++) {
+			out[j] = data[literal_start + j]
+				^ (reference ? reference[literal_start + j] : 0);
+		}
+		out += literals;
+	}
+
+	return out - dest;
+}
+
+// XORs the encoded bytes into dest
+static bool DecodeXorRle(const char* data, uint64_t data_size, char* dest, uint64_t size) {
+	const char* end = data + data_size;
+	uint64_t i = 0;
+
+	while (data < end) {
+		uint32_t zeros, literals;
+		if (end - data < 2 * sizeof(uint32_t)) {
+			return false;
+		}
+		memcpy(&zeros, data, sizeof(uint32_t));
+		memcpy(&literals, data + sizeof(uint32_t), sizeof(uint32_t));
+		data += 2 * sizeof(uint32_t);
+
+		if (i + zeros + literals > size || end - data < literals) {
+			return false;
+		}
+
+		i += zeros;
+		for (uint32_t j = 0; j < literals; j++) {
+			dest[i + j] ^= data[j];
+		}
+		i += literals;
+		data += literals;
+	}
+
+	return true;
+}
+
+void RewindBuffer::Init(uint64_t capacity, int max_frames) {
+	mData.resize(capacity);
+	mRecords.resize(max_frames);
+	mWriteOffset = 0;
+	mUsedBytes = 0;
+	mFirstRecord = 0;
+	mNumRecords = 0;
+	mFramesSinceKeyframe = 0;
+	mPrevious.Clear();
+}
+
+void RewindBuffer::DropOldestRecord() {
+	mUsedBytes -= GetRecord(0).size;
+	mFirstRecord = (mFirstRecord + 1) % mRecords.size();
+	mNumRecords--;
+
+	// deltas without their keyframe cannot be decoded anymore
+	while (mNumRecords > 0 && !GetRecord(0).keyframe) {
+		mUsedBytes -= GetRecord(0).size;
+		mFirstRecord = (mFirstRecord + 1) % mRecords.size();
+		mNumRecords--;
+	}
+}
+
+bool RewindBuffer::Store(const FrameRecord& record) {
+	if (record.size > mData.size()) {
+		return false;
+	}
+
+	uint64_t offset = mWriteOffset;
+	if (offset + record.size > mData.size()) {
+		offset = 0;
+	}
+
+	// Drop the frames whose data gets overwritten. After a wrap these are
+	// not necessarily the oldest ones, but as frames can only be dropped
+	// from the front, all frames up to the newest overwritten one go.
+	while (mNumRecords > 0) {
+		int newest_overlap = -1;
+		for (int i = 0; i < mNumRecords; i++) {
+			const FrameRecord& stored = GetRecord(i);
+			if (stored.offset < offset + record.size
+					&& stored.offset + stored.size > offset) {
+				newest_overlap = i;
+			}
+		}
+
+		if (newest_overlap < 0 && mNumRecords < (int) mRecords.size()) {
+			break;
+		}
+
+		int num_dropped = std::max(newest_overlap + 1, 1);
+		int num_remaining = mNumRecords - num_dropped;
+		while (mNumRecords > num_remaining) {
+			DropOldestRecord();
+		}
+	}
+
+	if (!record.keyframe && mNumRecords == 0) {
+		return false;
+	}
+
+	memcpy(&mData[offset], mEncoded.data(), record.size);
+
+	FrameRecord& stored = mRecords[(mFirstRecord + mNumRecords) % mRecords.size()];
+	stored = record;
+	stored.offset = offset;
+	mNumRecords++;
+
+	mWriteOffset = offset + record.size;
+	mUsedBytes += record.size;
+
+	return true;
+}
+
+// Encodes mCurrent into mEncoded. Keyframes: uint32 number of index
+// entries, the index and the encoded payload. Deltas: payload encoded
+// against the previous frame.
+uint64_t RewindBuffer::EncodeFrame(bool keyframe) {
+	const uint64_t index_size = mCurrent.index.size() * sizeof(SnapshotIndexEntry);
+	const uint64_t payload_size = mCurrent.payload.size();
+
+	uint64_t max_size = sizeof(uint32_t) + index_size + 2 * payload_size + 16;
+	if (mEncoded.size() < max_size) {
+		mEncoded.resize(max_size);
+	}
+
+	char* out = mEncoded.data();
+	if (keyframe) {
+		uint32_t num_entries = mCurrent.index.size();
+		memcpy(out, &num_entries, sizeof(uint32_t));
+		memcpy(out + sizeof(uint32_t), mCurrent.index.data(), index_size);
+		out += sizeof(uint32_t) + index_size;
+		out += EncodeXorRle(mCurrent.payload.data(), nullptr, payload_size, out);
+	} else {
+		out += EncodeXorRle(mCurrent.payload.data(), mPrevious.payload.data(),
+				payload_size, out);
+	}
+
+	return out - mEncoded.data();
+}
+
+void RewindBuffer::Capture(RuntimeModuleManager& module_manager) {
+	if (mRecords.size() == 0) {
+		return;
+	}
+
+	PROFILE_SCOPE("RewindCapture");
+	int64_t start = bx::getHPCounter();
+
+	WriteSerializer serializer;
+	serializer.Open(&mCurrent);
+	for (int i = 0; i < module_manager.mModules.size(); i++) {
+		RuntimeModule* module = module_manager.mModules[i];
+		if (module->handle && module->api.capture) {
+			module->api.capture(module->state, &serializer);
+		}
+	}
+	serializer.Close();
+
+	const uint64_t index_size = mCurrent.index.size() * sizeof(SnapshotIndexEntry);
+	const uint64_t payload_size = mCurrent.payload.size();
+
+	FrameRecord record;
+	record.frame = mNextFrame;
+	record.payloadSize = payload_size;
+	record.keyframe = mNumRecords == 0
+		|| mFramesSinceKeyframe >= cKeyframeInterval
+		|| mPrevious.index.size() != mCurrent.index.size()
+		|| mPrevious.payload.size() != payload_size
+		|| memcmp(mPrevious.index.data(), mCurrent.index.data(), index_size) != 0;
+
+	record.size = EncodeFrame(record.keyframe);
+	record.offset = 0;
+
+	// a delta that had to evict its own keyframe is stored as keyframe
+	bool stored = Store(record);
+	if (!stored && !record.keyframe) {
+		record.keyframe = true;
+		record.size = EncodeFrame(true);
+		stored = Store(record);
+	}
+
+	if (stored) {
+		mNextFrame++;
+		mFramesSinceKeyframe = record.keyframe ? 1 : mFramesSinceKeyframe + 1;
+		mLastFrameSize = record.size;
+		std::swap(mCurrent, mPrevious);
+	} else {
+		// frame is lost, the next one has to be a keyframe
+		mFramesSinceKeyframe = cKeyframeInterval;
+	}
+
+	mLastCaptureTime = double(bx::getHPCounter() - start) / double(bx::getHPFrequency());
+	mAverageCaptureTime = mAverageCaptureTime * 0.95 + mLastCaptureTime * 0.05;
+}
+
+bool RewindBuffer::Decode(int frame, Snapshot& snapshot) {
+	int record_index = frame - GetFirstFrame();
+	if (mNumRecords == 0 || record_index < 0 || record_index >= mNumRecords) {
+		return false;
+	}
+
+	int keyframe_index = record_index;
+	while (!GetRecord(keyframe_index).keyframe) {
+		keyframe_index--;
+	}
+
+	const FrameRecord& keyframe = GetRecord(keyframe_index);
+	const char* data = &mData[keyframe.offset];
+
+	uint32_t num_entries;
+	memcpy(&num_entries, data, sizeof(uint32_t));
+	uint64_t index_size = num_entries * sizeof(SnapshotIndexEntry);
+	snapshot.index.resize(num_entries);
+	memcpy(snapshot.index.data(), data + sizeof(uint32_t), index_size);
+
+	snapshot.payload.assign(keyframe.payloadSize, 0);
+	uint64_t header_size = sizeof(uint32_t) + index_size;
+	if (!DecodeXorRle(data + header_size, keyframe.size - header_size,
+				snapshot.payload.data(), keyframe.payloadSize)) {
+		return false;
+	}
+
+	for (int i = keyframe_index + 1; i <= record_index; i++) {
+		const FrameRecord& delta = GetRecord(i);
+		if (!DecodeXorRle(&mData[delta.offset], delta.size,
+					snapshot.payload.data(), delta.payloadSize)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool RewindBuffer::ApplyRequestedRestore(RuntimeModuleManager& module_manager) {
+	if (mRequestedFrame < 0) {
+		return false;
+	}
+
+	int frame = mRequestedFrame;
+	mRequestedFrame = -1;
+
+	if (!Decode(frame, mRestored)) {
+		gLog ("Error: could not restore frame %d", frame);
+		return false;
+	}
+
+	ReadSerializer serializer;
+	serializer.Open(mRestored);
+	for (int i = 0; i < module_manager.mModules.size(); i++) {
+		RuntimeModule* module = module_manager.mModules[i];
+		if (module->handle && module->api.restore) {
+			module->api.restore(module->state, &serializer);
+		}
+	}
+	serializer.Close();
+
+	// drop the frames after the restored one, recording continues from it
+	int record_index = frame - GetFirstFrame();
+	for (int i = record_index + 1; i < mNumRecords; i++) {
+		mUsedBytes -= GetRecord(i).size;
+	}
+	mNumRecords = record_index + 1;
+	mWriteOffset = GetRecord(record_index).offset + GetRecord(record_index).size;
+	mNextFrame = frame + 1;
+	// start a new delta chain at the restored frame
+	mFramesSinceKeyframe = cKeyframeInterval;
+	std::swap(mPrevious, mRestored);
+
+	return true;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "Serializer.h"
+
+struct RuntimeModuleManager;
+
+// Bounded history of the simulation state of the modules for scrubbing
+// back in time. Every frame the modules write their state through
+// module_api::capture into a Snapshot which is stored in a ring buffer of
+// fixed size. Frames are stored as XOR delta against the previous frame
+// and run-length encoded, so unchanged bytes are nearly free. Every
+// cKeyframeInterval frames, and whenever the layout of the snapshot
+// changes, a complete keyframe is stored instead. The oldest frames get
+// dropped once the buffer is full.
+//
+// All buffers are sized up front or keep their capacity, so capturing
+// does not allocate once the snapshots stopped growing.
+struct RewindBuffer {
+	static const int cKeyframeInterval = 60;
+
+	struct FrameRecord {
+		int frame;
+		bool keyframe;
+		// location of the encoded frame in mData
+		uint64_t offset;
+		uint64_t size;
+		// size of the snapshot payload
+		uint64_t payloadSize;
+	};
+
+	std::vector<char> mData;
+	uint64_t mWriteOffset = 0;
+	uint64_t mUsedBytes = 0;
+
+	// ring of frame records, the oldest one is always a keyframe
+	std::vector<FrameRecord> mRecords;
+	int mFirstRecord = 0;
+	int mNumRecords = 0;
+
+	int mNextFrame = 0;
+	int mFramesSinceKeyframe = 0;
+
+	Snapshot mCurrent;
+	Snapshot mPrevious;
+	Snapshot mRestored;
+	std::vector<char> mEncoded;
+
+	// frame that gets restored at the start of the next frame or -1
+	int mRequestedFrame = -1;
+
+	// statistics
+	double mLastCaptureTime = 0.;
+	double mAverageCaptureTime = 0.;
+	uint64_t mLastFrameSize = 0;
+
+	void Init(uint64_t capacity, int max_frames);
+
+	// captures the state of all modules, has to be called between frames
+	void Capture(RuntimeModuleManager& module_manager);
+
+	// restores the requested frame, has to be called between frames.
+	// Returns true if a frame was restored.
+	bool ApplyRequestedRestore(RuntimeModuleManager& module_manager);
+
+	void RequestRestore(int frame) {
+		mRequestedFrame = frame;
+	}
+
+	int GetFirstFrame() const {
+		return mNumRecords > 0 ? GetRecord(0).frame : mNextFrame;
+	}
+
+	int GetLastFrame() const {
+		return mNumRecords > 0 ? GetRecord(mNumRecords - 1).frame : mNextFrame - 1;
+	}
+
+	uint64_t GetCapacity() const {
+		return mData.size();
+	}
+
+	const FrameRecord& GetRecord(int i) const {
+		return mRecords[(mFirstRecord + i) % mRecords.size()];
+	}
+
+	FrameRecord& GetRecord(int i) {
+		return mRecords[(mFirstRecord + i) % mRecords.size()];
+	}
+
+	void DropOldestRecord();
+	uint64_t EncodeFrame(bool keyframe);
+	bool Store(const FrameRecord& record);
+	bool Decode(int frame, Snapshot& snapshot);
+};
@@ -1,9 +1,32 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct module_state;
 
+/**
+ * Shared resources that a module reads or writes in step().
+ */
+enum module_resource {
+    MODULE_RESOURCE_ENTITIES = 1 << 0,       // render entities of gRenderer
+    MODULE_RESOURCE_CAMERAS = 1 << 1,        // cameras and lights of gRenderer
+    MODULE_RESOURCE_DEBUG_COMMANDS = 1 << 2, // debug drawing of gRenderer
+    MODULE_RESOURCE_INPUT = 1 << 3,          // gGuiInputState and GLFW input
+    MODULE_RESOURCE_GUI = 1 << 4,            // the current ImGui frame
+    MODULE_RESOURCE_TIMER = 1 << 5,          // gTimer
+    MODULE_RESOURCE_ALL = 0xffffffff
+};
+
+enum module_step_flags {
+    /// step() only accesses the declared resources and may run
+    /// concurrently with modules it does not conflict with
+    MODULE_STEP_CONCURRENT = 1 << 0,
+    /// step() uses GLFW, ImGui or bgfx and has to run on the main thread
+    MODULE_STEP_MAIN_THREAD = 1 << 1
+};
+
 struct module_api {
     /**
      * @return a fresh module state
@@ -30,8 +53,107 @@ struct module_api {
      * @return true if the program should continue
      */
     bool (*step)(struct module_state *state, float dt);
+
+    /**
+     * Size and layout hash of struct module_state (see MODULE_STATE). If
+     * both match the running version of the module the state is handed
+     * over in memory: suspend() gets called instead of unload() on the old
+     * code and resume() instead of reload() on the new code. A hash of 0
+     * disables the handover.
+     */
+    size_t state_size;
+    uint64_t state_layout_hash;
+
+    /**
+     * Called instead of unload() when the state is kept in memory.
+     */
+    void (*suspend)(struct module_state *state);
+
+    /**
+     * Called instead of reload() with the state of the previous version.
+     */
+    void (*resume)(struct module_state *state);
+
+    /**
+     * Optional. Called zero or more times per frame with the fixed
+     * simulation time step before step() gets called.
+     */
+    void (*simulate)(struct module_state *state, float dt);
+
+    /**
+     * Resources (see module_resource) read and written by step() and
+     * module_step_flags. Modules without MODULE_STEP_CONCURRENT are
+     * treated as writing all resources on the main thread.
+     */
+    uint32_t step_reads;
+    uint32_t step_writes;
+    uint32_t step_flags;
+
+    /**
+     * Optional. Write the simulation state to and restore it from the
+     * rewind buffer (see RewindBuffer.h). Called between frames.
+     */
+    void (*capture)(struct module_state *state, void* write_serializer);
+    void (*restore)(struct module_state *state, void* read_serializer);
+};
+
+// Hash of the module_state definition that is evaluated at compile time.
+// The string is split recursively to keep the constexpr recursion depth
+// logarithmic in the length of the definition.
+constexpr uint64_t module_hash_combine(uint64_t a, uint64_t b) {
+    return a ^ (b + 0x9e3779b97f4a7c15ull + (a << 6) + (a >> 2));
+}
+
+constexpr uint64_t module_layout_hash(const char* str, size_t len) {
+    return len == 0 ? 14695981039346656037ull
+        : len == 1 ? (14695981039346656037ull ^ (unsigned char) str[0]) * 1099511628211ull
+        : module_hash_combine(
+                module_layout_hash(str, len / 2),
+                module_layout_hash(str + len / 2, len - len / 2));
+}
+
+// Hash of the size and alignment of the types, see MODULE_STATE_DEPENDS.
+template <typename... T>
+struct module_types_hash {
+    static constexpr uint64_t value = 0;
 };
 
+template <typename T, typename... Rest>
+struct module_types_hash<T, Rest...> {
+    static constexpr uint64_t value = module_hash_combine(
+            module_hash_combine(sizeof(T), alignof(T)),
+            module_types_hash<Rest...>::value);
+};
+
+/**
+ * Lists the types of the objects that the module state refers to. Their
+ * size and alignment are part of module_state_layout_hash such that the
+ * state is not handed over when one of them changes. Reordering members
+ * of the same size is not detected. Has to precede MODULE_STATE and is
+ * left empty if the state only holds values, e.g.:
+ *
+ *   MODULE_STATE_DEPENDS(CharacterEntity);
+ */
+#define MODULE_STATE_DEPENDS(...) \
+    static const uint64_t module_state_depends_hash = module_hash_combine( \
+        module_layout_hash(#__VA_ARGS__, sizeof(#__VA_ARGS__) - 1), \
+        module_types_hash<__VA_ARGS__>::value)
+
+/**
+ * Defines struct module_state and module_state_layout_hash, e.g.:
+ *
+ *   MODULE_STATE_DEPENDS(CharacterEntity);
+ *   MODULE_STATE({
+ *     float camera_theta;
+ *     CharacterEntity* character = nullptr;
+ *   });
+ */
+#define MODULE_STATE(...) \
+    struct module_state __VA_ARGS__; \
+    static const uint64_t module_state_layout_hash = module_hash_combine( \
+        module_layout_hash(#__VA_ARGS__, sizeof(#__VA_ARGS__) - 1), \
+        module_state_depends_hash)
+
 extern "C" {
 extern const struct module_api MODULE_API;
 }
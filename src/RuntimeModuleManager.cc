@@ -3,29 +3,86 @@
 
 #define _BSD_SOURCE // usleep()
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <dlfcn.h>
 
 #include "RuntimeModule.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 
 #include "Globals.h"
 #include "Serializer.h"
+#include "JobSystem.h"
+#include "Profiler.h"
+
+#include <bx/timer.h>
 
 using namespace std;
 const char* state_file = "state.ser";
 
-void RuntimeModuleManager::RegisterModule(const char* name) {
+RuntimeModule* RuntimeModuleManager::RegisterModule(
+		const char* name,
+		const std::vector<RuntimeModule*>& dependencies) {
 	RuntimeModule* module = new RuntimeModule();
 	module->name = name;
+
+	// Dependencies have to be registered first. This way the order of
+	// mModules is a valid load order and its reverse a valid unload order.
+	for (int i = 0; i < dependencies.size(); i++) {
+		assert (std::find(mModules.begin(), mModules.end(), dependencies[i])
+				!= mModules.end());
+	}
+	module->dependencies = dependencies;
+
+	if (mInotifyFd == -1) {
+		StartWatcher();
+	}
+
+	if (!mStagingThread.isRunning()) {
+		StartStaging();
+	}
+
+	if (!mFlushThread.isRunning()) {
+		StartFlusher();
+	}
+
+	// watch the directory of the module as the library may get replaced
+	// by a new file instead of being rewritten in place
+	std::string directory = ".";
+	size_t separator = module->name.find_last_of('/');
+	if (separator != std::string::npos) {
+		directory = module->name.substr(0, separator);
+	}
+
+	module->watch_descriptor = inotify_add_watch(mInotifyFd,
+			directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (module->watch_descriptor == -1) {
+		gLog ("Error: could not watch directory %s of module %s",
+				directory.c_str(), name);
+	}
+
+	if (gProfiler != nullptr) {
+		std::string module_name = module->name.substr(module->name.find_last_of('/') + 1);
+		module->profile_marker = gProfiler->RegisterMarker(("step " + module_name).c_str());
+		module->simulate_profile_marker = gProfiler->RegisterMarker(("simulate " + module_name).c_str());
+	}
+
 	mModules.push_back(module);
+
+	return module;
 }
 
 void RuntimeModuleManager::UnregisterModules() {
+	StopWatcher();
+	StopStaging();
 	UnloadModules();
+	StopFlusher();
 
 	for (int i = 0; i < mModules.size(); i++) {
 		if (mModules[i]->handle) {
@@ -39,125 +96,766 @@ void RuntimeModuleManager::UnregisterModules() {
 	}
 }
 
-void RuntimeModuleManager::LoadModule(RuntimeModule* module) {
-	struct stat attr;
+static int32_t WatcherThreadFn(void* user_data) {
+	RuntimeModuleManager* manager = static_cast<RuntimeModuleManager*>(user_data);
+	return manager->WatcherLoop();
+}
 
-	bool stat_result = stat(module->name.c_str(), &attr);
-	if (glfwGetKey(gWindow, GLFW_KEY_F11) == GLFW_PRESS) {
-		std::cerr << "Module " << module->name << " id = " << module->id 
-			<< " mtime " << ctime((time_t *) &module->mtime) << std::endl;
-	} 
-
-	if ( stat_result == 0 && 
-			(module->id != attr.st_ino || module->mtime != attr.st_mtime)
-			) {
-		std::cout << "Opening module " << module->name 
-			<< " (size = " << attr.st_size << ")" << std::endl;
-		void *handle = dlopen(module->name.c_str(), RTLD_NOW | RTLD_GLOBAL);
-		if (handle) {
-			module->handle = handle;
-			module->id = attr.st_ino;
-			module->mtime = attr.st_mtime;
-			module->mtimensec = attr.st_mtim.tv_nsec;
-			const struct module_api *api = (module_api*) dlsym(module->handle, "MODULE_API");
-			if (api != NULL) {
-				module->api = *api;
-				if (module->state == NULL) {
-					std::cout << "Initializing module " << module->name << std::endl;
-					module->state = module->api.init();
-				}
-				std::cout << "Reloading module " << module->name << std::endl;
-				module->api.reload(module->state, gReadSerializer);
-			} else {
-				std::cerr << "Error: could not find API for module " << module->name << std::endl;
-				dlclose(module->handle);
-				module->handle = NULL;
-				module->id = 0;
+void RuntimeModuleManager::StartWatcher() {
+	mInotifyFd = inotify_init1(IN_CLOEXEC);
+	if (mInotifyFd == -1) {
+		gLog ("Error: could not initialize inotify, module reloading disabled");
+		return;
+	}
+
+	mWatcherQuit = false;
+	mWatcherThread.init(WatcherThreadFn, this, 0, "ModuleWatcher");
+}
+
+void RuntimeModuleManager::StopWatcher() {
+	if (mInotifyFd == -1) {
+		return;
+	}
+
+	mWatcherQuit = true;
+	mWatcherThread.shutdown();
+
+	close(mInotifyFd);
+	mInotifyFd = -1;
+}
+
+int32_t RuntimeModuleManager::WatcherLoop() {
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	struct pollfd fds;
+	fds.fd = mInotifyFd;
+	fds.events = POLLIN;
+
+	while (!mWatcherQuit) {
+		// use a timeout so that we notice when we have to quit
+		int poll_result = poll(&fds, 1, 100);
+		if (poll_result <= 0 || !(fds.revents & POLLIN)) {
+			continue;
+		}
+
+		ssize_t length = read(mInotifyFd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			continue;
+		}
+
+		bx::MutexScope lock(mWatcherMutex);
+		for (char* ptr = buffer; ptr < buffer + length; ) {
+			const struct inotify_event* event =
+				reinterpret_cast<const struct inotify_event*>(ptr);
+
+			if (event->len > 0) {
+				WatchEvent watch_event;
+				watch_event.watch_descriptor = event->wd;
+				watch_event.filename = event->name;
+				mWatcherEvents.push_back(watch_event);
 			}
-		} else {
-			std::cerr << "Error: could not load module " << module->name << std::endl;
-			std::cerr << dlerror() << std::endl;
-			module->handle = NULL;
-			module->id = 0;
-			abort();
+
+			ptr += sizeof(struct inotify_event) + event->len;
 		}
+
+		mWatcherSignaled = true;
 	}
+
+	return 0;
 }
 
-void RuntimeModuleManager::Update(float dt) {
-	for (int i = mModules.size() - 1; i >= 0; i--) {
-		if (mModules[i]->handle) {
-			mModules[i]->api.step(mModules[i]->state, dt);
+static bool CopyFile(const std::string& source, const std::string& destination) {
+	std::ifstream source_file(source.c_str(), std::ios::binary);
+	std::ofstream destination_file(destination.c_str(), std::ios::binary | std::ios::trunc);
+
+	if (!source_file || !destination_file) {
+		return false;
+	}
+
+	destination_file << source_file.rdbuf();
+	destination_file.close();
+
+	return !destination_file.fail();
+}
+
+static bool FilesEqual(const std::string& path_a, const std::string& path_b) {
+	std::ifstream file_a(path_a.c_str(), std::ios::binary);
+	std::ifstream file_b(path_b.c_str(), std::ios::binary);
+
+	if (!file_a || !file_b) {
+		return false;
+	}
+
+	char buffer_a[4096];
+	char buffer_b[4096];
+	while (file_a && file_b) {
+		file_a.read(buffer_a, sizeof(buffer_a));
+		file_b.read(buffer_b, sizeof(buffer_b));
+
+		if (file_a.gcount() != file_b.gcount()
+				|| memcmp(buffer_a, buffer_b, file_a.gcount()) != 0) {
+			return false;
 		}
 	}
+
+	return file_a.eof() && file_b.eof();
 }
 
-bool RuntimeModuleManager::CheckModulesChanged() {
+static std::string GetStagingDirectory(const std::string& module_name) {
+	std::string directory = ".";
+	size_t separator = module_name.find_last_of('/');
+	if (separator != std::string::npos) {
+		directory = module_name.substr(0, separator);
+	}
+
+	// The copies are not placed in e.g. /tmp as it may be mounted noexec.
+	// Files in sub directories do not trigger the inotify watch of the
+	// module directory.
+	return directory + "/.staging";
+}
+
+static int32_t StagingThreadFn(void* user_data) {
+	RuntimeModuleManager* manager = static_cast<RuntimeModuleManager*>(user_data);
+	return manager->StagingLoop();
+}
+
+void RuntimeModuleManager::StartStaging() {
+	mStagingQuit = false;
+	mStagingThread.init(StagingThreadFn, this, 0, "ModuleStaging");
+}
+
+void RuntimeModuleManager::StopStaging() {
+	if (!mStagingThread.isRunning()) {
+		return;
+	}
+
+	mStagingQuit = true;
+	mStagingSemaphore.post();
+	mStagingThread.shutdown();
+
+	// discard a batch that was staged but not yet swapped
+	if (mStagingDone) {
+		for (int i = 0; i < mStagedModules.size(); i++) {
+			if (mStagedModules[i].handle) {
+				dlclose(mStagedModules[i].handle);
+			}
+			if (mStagedModules[i].copied) {
+				unlink(mStagedModules[i].path.c_str());
+			}
+		}
+		mStagedModules.clear();
+		mStagingDone = false;
+		mStagingBusy = false;
+	}
+}
+
+static int32_t FlushThreadFn(void* user_data) {
+	RuntimeModuleManager* manager = static_cast<RuntimeModuleManager*>(user_data);
+	return manager->FlushLoop();
+}
+
+void RuntimeModuleManager::StartFlusher() {
+	mFlushQuit = false;
+	mFlushThread.init(FlushThreadFn, this, 0, "SnapshotFlush");
+}
+
+void RuntimeModuleManager::StopFlusher() {
+	if (!mFlushThread.isRunning()) {
+		return;
+	}
+
+	WaitForFlush();
+
+	mFlushQuit = true;
+	mFlushSemaphore.post();
+	mFlushThread.shutdown();
+}
+
+int32_t RuntimeModuleManager::FlushLoop() {
+	if (gProfiler != nullptr) {
+		gProfiler->SetThreadName("SnapshotFlush");
+	}
+
+	while (true) {
+		mFlushSemaphore.wait();
+
+		if (mFlushQuit) {
+			break;
+		}
+
+		{
+			PROFILE_SCOPE("FlushSnapshot");
+			mPersistedSnapshot.Merge(*mFlushedSnapshot);
+			mPersistedSnapshot.Write(state_file);
+		}
+
+		mFlushDoneSemaphore.post();
+	}
+
+	return 0;
+}
+
+Snapshot* RuntimeModuleManager::BeginSnapshot() {
+	Snapshot* snapshot = &mSnapshots[mSnapshotIndex];
+	mSnapshotIndex = (mSnapshotIndex + 1) % 2;
+
+	// the snapshot of the reload before the last one may still be written
+	if (mFlushPending && mFlushedSnapshot == snapshot) {
+		WaitForFlush();
+	}
+
+	return snapshot;
+}
+
+void RuntimeModuleManager::FlushSnapshot(Snapshot* snapshot) {
+	if (!mFlushToDisk || !mFlushThread.isRunning()) {
+		return;
+	}
+
+	WaitForFlush();
+
+	mFlushedSnapshot = snapshot;
+	mFlushPending = true;
+	mFlushSemaphore.post();
+}
+
+void RuntimeModuleManager::WaitForFlush() {
+	if (mFlushPending) {
+		PROFILE_SCOPE("WaitForFlush");
+		mFlushDoneSemaphore.wait();
+		mFlushPending = false;
+	}
+}
+
+int32_t RuntimeModuleManager::StagingLoop() {
+	if (gProfiler != nullptr) {
+		gProfiler->SetThreadName("ModuleStaging");
+	}
+
+	while (true) {
+		mStagingSemaphore.wait();
+
+		if (mStagingQuit) {
+			break;
+		}
+
+		PROFILE_SCOPE("StageModules");
+
+		for (int i = 0; i < mStagedModules.size(); i++) {
+			StagedModule& staged = mStagedModules[i];
+			if (!StageModule(staged)) {
+				break;
+			}
+
+			// Deferred modules cannot be opened before the swap and
+			// therefore cannot report their state layout. Their state is
+			// only kept if the library itself did not change.
+			if (staged.deferred) {
+				staged.identical = FilesEqual(staged.module->path, staged.path);
+			}
+
+			if (!staged.deferred && !OpenStagedModule(staged)) {
+				break;
+			}
+		}
+
+		mStagingDone = true;
+	}
+
+	return 0;
+}
+
+bool RuntimeModuleManager::StageModule(StagedModule& staged) {
+	RuntimeModule* module = staged.module;
 	struct stat attr;
 
-	double current_time = gGetTimeSinceStart();
-	mNumUpdatesSinceLastModuleChange++;
+	if (stat(module->name.c_str(), &attr) != 0) {
+		gLog ("Error: could not stat module %s", module->name.c_str());
+		return false;
+	}
+
+	staged.id = attr.st_ino;
+	staged.mtime = attr.st_mtime;
+	staged.mtimensec = attr.st_mtim.tv_nsec;
+
+	std::string directory = GetStagingDirectory(module->name);
+	mkdir(directory.c_str(), 0755);
+
+	// Every copy gets its own file name and therefore the loader cannot
+	// return an already opened version of the library.
+	std::string filename = module->name.substr(module->name.find_last_of('/') + 1);
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%d.%d", getpid(), mStagingVersion++);
+	staged.path = directory + "/" + filename + suffix;
+
+	if (!CopyFile(module->name, staged.path)) {
+		gLog ("Error: could not copy module %s to %s", 
+				module->name.c_str(), staged.path.c_str());
+		unlink(staged.path.c_str());
+		return false;
+	}
+
+	staged.copied = true;
+
+	std::cout << "Staged module " << module->name 
+		<< " (size = " << attr.st_size << ") as " << staged.path << std::endl;
+
+	return true;
+}
+
+bool RuntimeModuleManager::OpenStagedModule(StagedModule& staged) {
+	// Modules are opened with RTLD_LOCAL: the new version of a library
+	// would otherwise resolve its own symbols against the still loaded
+	// old version. Dependent modules find their dependencies through
+	// their DT_NEEDED entries.
+	void *handle = dlopen(staged.path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (handle == nullptr) {
+		std::cerr << "Error: could not load module " << staged.module->name << std::endl;
+		std::cerr << dlerror() << std::endl;
+		return false;
+	}
+
+	const struct module_api *api = (module_api*) dlsym(handle, "MODULE_API");
+	if (api == nullptr) {
+		std::cerr << "Error: could not find API for module " << staged.module->name << std::endl;
+		dlclose(handle);
+		return false;
+	}
+
+	staged.handle = handle;
+	staged.api = *api;
+
+	return true;
+}
+
+void RuntimeModuleManager::ActivateModule(StagedModule& staged) {
+	RuntimeModule* module = staged.module;
+
+	std::cout << "Opening module " << module->name << std::endl;
+	module->handle = staged.handle;
+	module->api = staged.api;
+	module->path = staged.path;
+	module->id = staged.id;
+	module->mtime = staged.mtime;
+	module->mtimensec = staged.mtimensec;
 
+	if (staged.handover) {
+		std::cout << "Resuming module " << module->name << std::endl;
+		module->api.resume(module->state);
+		return;
+	}
+
+	if (module->state == NULL) {
+		std::cout << "Initializing module " << module->name << std::endl;
+		module->state = module->api.init();
+	}
+	std::cout << "Reloading module " << module->name << std::endl;
+	module->api.reload(module->state, gReadSerializer);
+}
+
+bool RuntimeModuleManager::CanHandOverState(const StagedModule& staged) {
+	const RuntimeModule* module = staged.module;
+	const module_api& old_api = module->api;
+
+	if (module->handle == nullptr 
+			|| module->state == nullptr
+			|| old_api.state_layout_hash == 0
+			|| old_api.suspend == nullptr) {
+		return false;
+	}
+
+	if (staged.deferred) {
+		if (!staged.identical) {
+			return false;
+		}
+	} else {
+		const module_api& new_api = staged.api;
+		if (new_api.state_layout_hash != old_api.state_layout_hash
+				|| new_api.state_size != old_api.state_size
+				|| new_api.resume == nullptr) {
+			return false;
+		}
+	}
+
+	// The state may refer to data of its dependencies, so it can only be
+	// kept if the state of all reloaded dependencies is kept as well.
+	for (int i = 0; i < module->dependencies.size(); i++) {
+		for (int j = 0; j < mStagedModules.size(); j++) {
+			if (mStagedModules[j].module == module->dependencies[i]
+					&& !mStagedModules[j].handover) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+void RuntimeModuleManager::LoadModule(RuntimeModule* module) {
+	StagedModule staged;
+	staged.module = module;
+
+	if (!StageModule(staged) || !OpenStagedModule(staged)) {
+		if (staged.copied) {
+			unlink(staged.path.c_str());
+		}
+		abort();
+	}
+
+	ActivateModule(staged);
+}
+
+void RuntimeModuleManager::BeginFrame() {
+	for (int i = 0; i < mModules.size(); i++) {
+		mModules[i]->simulate_ticks = 0;
+	}
+}
+
+void RuntimeModuleManager::Simulate(float dt) {
+	// dependencies get simulated before the modules that use them
 	for (int i = 0; i < mModules.size(); i++) {
 		RuntimeModule* module = mModules[i];
-		bool stat_result = stat(module->name.c_str(), &attr);
+		if (module->handle && module->api.simulate) {
+			ProfileScope profile_scope(module->simulate_profile_marker);
+			int64_t start = bx::getHPCounter();
+			module->api.simulate(module->state, dt);
+			module->simulate_ticks += bx::getHPCounter() - start;
+		}
+	}
+}
 
-		if (stat_result != 0) {
-			gLog ("Error: could not stat module %s", module->name.c_str());
-			abort();
+struct StepJobData {
+	RuntimeModule* module;
+	float dt;
+};
+
+static void StepModule(RuntimeModule* module, float dt) {
+	ProfileScope profile_scope(module->profile_marker);
+	int64_t start = bx::getHPCounter();
+	module->api.step(module->state, dt);
+	module->step_ticks = bx::getHPCounter() - start;
+}
+
+static void StepModuleJob(Job* job, void* data) {
+	StepJobData* step_data = static_cast<StepJobData*>(data);
+	StepModule(step_data->module, step_data->dt);
+}
+
+static bool ModuleStepsConflict(const module_api& api_a, const module_api& api_b) {
+	uint32_t reads_a = api_a.step_reads;
+	uint32_t writes_a = api_a.step_writes;
+	if (!(api_a.step_flags & MODULE_STEP_CONCURRENT)) {
+		writes_a = MODULE_RESOURCE_ALL;
+	}
+
+	uint32_t reads_b = api_b.step_reads;
+	uint32_t writes_b = api_b.step_writes;
+	if (!(api_b.step_flags & MODULE_STEP_CONCURRENT)) {
+		writes_b = MODULE_RESOURCE_ALL;
+	}
+
+	return (writes_a & (reads_b | writes_b)) || (reads_a & writes_b);
+}
+
+static bool ModuleStepOnMainThread(const module_api& api) {
+	return !(api.step_flags & MODULE_STEP_CONCURRENT)
+		|| (api.step_flags & MODULE_STEP_MAIN_THREAD);
+}
+
+void RuntimeModuleManager::Update(float dt) {
+	// modules get stepped in reverse order of registration
+	std::vector<RuntimeModule*> modules;
+	for (int i = mModules.size() - 1; i >= 0; i--) {
+		if (mModules[i]->handle) {
+			modules.push_back(mModules[i]);
 		}
-		
-		if (    module->id != attr.st_ino 
-				 || module->mtime != attr.st_mtime
-				 || module->fsize != attr.st_size
-				 || module->fsize == 0 
-			 ) {
-			module->id = attr.st_ino;
-			module->mtime = attr.st_mtime;
-			module->mtimensec = attr.st_mtim.tv_nsec;
-			module->fsize = attr.st_size;
-			mNumUpdatesSinceLastModuleChange = 0;
+	}
 
-			gLog ("Detected file change of %s: new size %d",
-					module->name.c_str(), attr.st_size);
+	if (gJobSystem == nullptr) {
+		for (int i = 0; i < modules.size(); i++) {
+			StepModule(modules[i], dt);
 		}
+		return;
 	}
 
-	// We have to delay the actual reload trigger to make
-	// sure all writes to the dynamic libraries are complete.
-	if (mNumUpdatesSinceLastModuleChange == 5) {
-		gLog ("Triggering reload");
+	// Build the task graph of this frame: a module depends on all modules
+	// before it that access a resource it writes or that write a resource
+	// it accesses. Modules bound to the main thread get a job without a
+	// function that is run once the main thread stepped the module.
+	Job* root = gJobSystem->CreateJob(nullptr, nullptr);
+	std::vector<Job*> jobs(modules.size());
+
+	for (int i = 0; i < modules.size(); i++) {
+		bool main_thread = ModuleStepOnMainThread(modules[i]->api);
+		jobs[i] = gJobSystem->CreateJob(
+				main_thread ? nullptr : StepModuleJob, nullptr, root);
+
+		StepJobData* step_data = new (jobs[i]->payload) StepJobData();
+		step_data->module = modules[i];
+		step_data->dt = dt;
+		jobs[i]->data = step_data;
+
+		for (int j = 0; j < i; j++) {
+			if (ModuleStepsConflict(modules[i]->api, modules[j]->api)) {
+				gJobSystem->AddDependency(jobs[i], jobs[j]);
+			}
+		}
+	}
+
+	for (int i = 0; i < modules.size(); i++) {
+		if (!ModuleStepOnMainThread(modules[i]->api)) {
+			gJobSystem->Run(jobs[i]);
+		}
+	}
+
+	for (int i = 0; i < modules.size(); i++) {
+		if (!ModuleStepOnMainThread(modules[i]->api)) {
+			continue;
+		}
+
+		for (int j = 0; j < i; j++) {
+			if (ModuleStepsConflict(modules[i]->api, modules[j]->api)) {
+				gJobSystem->Wait(jobs[j]);
+			}
+		}
+
+		StepModule(modules[i], dt);
+		gJobSystem->Run(jobs[i]);
+	}
+
+	gJobSystem->Run(root);
+	gJobSystem->Wait(root);
+}
+
+bool RuntimeModuleManager::CheckModulesChanged() {
+	if (mWatcherSignaled.exchange(false)) {
+		std::vector<WatchEvent> events;
+		{
+			bx::MutexScope lock(mWatcherMutex);
+			events.swap(mWatcherEvents);
+		}
+
+		for (int i = 0; i < events.size(); i++) {
+			for (int j = 0; j < mModules.size(); j++) {
+				RuntimeModule* module = mModules[j];
+				const std::string& name = module->name;
 
-		return true;
+				// compare the file name of the event with the file name of
+				// the module
+				const std::string& filename = events[i].filename;
+				if (module->watch_descriptor == events[i].watch_descriptor
+						&& name.size() >= filename.size()
+						&& name.compare(name.size() - filename.size(),
+							filename.size(), filename) == 0
+						&& (name.size() == filename.size() 
+							|| name[name.size() - filename.size() - 1] == '/')
+					 ) {
+					gLog ("Detected file change of %s", name.c_str());
+					module->changed = true;
+				}
+			}
+		}
 	}
 
+	for (int i = 0; i < mModules.size(); i++) {
+		if (mModules[i]->changed) {
+			return true;
+		}
+	}
 
 	return false;
 }
 
+void RuntimeModuleManager::UnloadModule(RuntimeModule* module) {
+	if (module->handle) {
+		gLog("Unloading module %s", module->name.c_str());
+		module->api.unload(module->state, gWriteSerializer);
+		module->state = nullptr;
+		dlclose(module->handle);
+		module->handle = 0;
+		module->id = 0;
+
+		unlink(module->path.c_str());
+		module->path = "";
+	}
+}
+
+void RuntimeModuleManager::SuspendModule(RuntimeModule* module) {
+	if (module->handle) {
+		gLog("Suspending module %s", module->name.c_str());
+		module->api.suspend(module->state);
+		dlclose(module->handle);
+		module->handle = 0;
+		module->id = 0;
+
+		unlink(module->path.c_str());
+		module->path = "";
+	}
+}
+
 void RuntimeModuleManager::UnloadModules() {
-	gWriteSerializer->Open(state_file);
+	// jobs may still execute code of the modules
+	if (gJobSystem != nullptr) {
+		gJobSystem->WaitIdle();
+	}
+
+	Snapshot* snapshot = BeginSnapshot();
+	gWriteSerializer->Open(snapshot);
 
 	for (int i = mModules.size() - 1; i >= 0 ; i--) {
-		if (mModules[i]->handle) {
-			gLog("Unloading module %s", mModules[i]->name.c_str());
-			mModules[i]->api.unload(mModules[i]->state, gWriteSerializer);
-			mModules[i]->state = nullptr;
-			dlclose(mModules[i]->handle);
-			mModules[i]->handle = 0;
-			mModules[i]->id = 0;
-		}
+		UnloadModule(mModules[i]);
 	}
 
-	std::cout << "Writing state to file " << state_file << std::endl;
 	gWriteSerializer->Close();
+
+	if (mFlushToDisk) {
+		std::cout << "Writing state to file " << state_file << std::endl;
+		FlushSnapshot(snapshot);
+		WaitForFlush();
+	}
 }
 
 void RuntimeModuleManager::LoadModules() {
-	std::cout << "Reading state from file " << state_file << std::endl;
-	gReadSerializer->Open(state_file);
+	if (mReadStateFile) {
+		std::cout << "Reading state from file " << state_file << std::endl;
+		gReadSerializer->Open(state_file);
+	}
 	for (int i = 0; i < mModules.size(); i++) {
 		LoadModule(mModules[i]);
+		mModules[i]->changed = false;
 	}
+
+	// later flushes of partial reloads get merged into the state read
+	// from the file
+	WaitForFlush();
+	gReadSerializer->CopyTo(mPersistedSnapshot);
 	gReadSerializer->Close();
 }
+
+void RuntimeModuleManager::StageChangedModules() {
+	// Changes that happen while a batch is staged get picked up once the
+	// batch was swapped.
+	if (mStagingBusy) {
+		return;
+	}
+
+	// Collect the changed modules and all modules that (transitively)
+	// depend on them. Dependencies are registered before their dependents
+	// so a single pass in registration order visits them first.
+	std::vector<RuntimeModule*> reload_modules;
+	for (int i = 0; i < mModules.size(); i++) {
+		RuntimeModule* module = mModules[i];
+		bool reload = module->changed;
+		bool deferred = false;
+
+		for (int j = 0; j < module->dependencies.size(); j++) {
+			if (std::find(reload_modules.begin(), reload_modules.end(),
+					module->dependencies[j]) != reload_modules.end()) {
+				reload = true;
+				deferred = true;
+			}
+		}
+
+		if (reload) {
+			reload_modules.push_back(module);
+
+			StagedModule staged;
+			staged.module = module;
+			staged.deferred = deferred;
+			mStagedModules.push_back(staged);
+
+			module->changed = false;
+		}
+	}
+
+	if (reload_modules.size() == 0) {
+		return;
+	}
+
+	gLog ("Triggering reload");
+	mStagingBusy = true;
+	mStagingSemaphore.post();
+}
+
+bool RuntimeModuleManager::SwapStagedModules() {
+	if (!mStagingDone) {
+		return false;
+	}
+
+	PROFILE_SCOPE("SwapStagedModules");
+
+	bool staging_failed = false;
+	for (int i = 0; i < mStagedModules.size(); i++) {
+		const StagedModule& staged = mStagedModules[i];
+		if (!staged.copied || (!staged.deferred && staged.handle == nullptr)) {
+			gLog ("Error: staging of module %s failed, keeping the current version",
+					staged.module->name.c_str());
+			staging_failed = true;
+		}
+	}
+
+	if (staging_failed) {
+		for (int i = 0; i < mStagedModules.size(); i++) {
+			if (mStagedModules[i].handle) {
+				dlclose(mStagedModules[i].handle);
+			}
+			if (mStagedModules[i].copied) {
+				unlink(mStagedModules[i].path.c_str());
+			}
+		}
+	} else {
+		// jobs may still execute code of the modules
+		if (gJobSystem != nullptr) {
+			gJobSystem->WaitIdle();
+		}
+
+		// dependencies come first in the batch so their decision is known
+		// when the dependent modules are checked
+		bool serialize = false;
+		for (int i = 0; i < mStagedModules.size(); i++) {
+			mStagedModules[i].handover = CanHandOverState(mStagedModules[i]);
+			serialize = serialize || !mStagedModules[i].handover;
+		}
+
+		Snapshot* snapshot = nullptr;
+		if (serialize) {
+			snapshot = BeginSnapshot();
+			gWriteSerializer->Open(snapshot);
+		}
+		for (int i = mStagedModules.size() - 1; i >= 0; i--) {
+			if (mStagedModules[i].handover) {
+				SuspendModule(mStagedModules[i].module);
+			} else {
+				UnloadModule(mStagedModules[i].module);
+			}
+		}
+		if (serialize) {
+			gWriteSerializer->Close();
+			gReadSerializer->Open(*snapshot);
+		}
+		for (int i = 0; i < mStagedModules.size(); i++) {
+			StagedModule& staged = mStagedModules[i];
+
+			// The old version is already gone at this point so a failure
+			// leaves the module unloaded until the next successful build. A
+			// state that was kept in memory is lost in that case.
+			if (staged.deferred && !OpenStagedModule(staged)) {
+				unlink(staged.path.c_str());
+				staged.module->state = nullptr;
+				continue;
+			}
+
+			ActivateModule(staged);
+		}
+		if (serialize) {
+			gReadSerializer->Close();
+			FlushSnapshot(snapshot);
+		}
+	}
+
+	mStagedModules.clear();
+	mStagingDone = false;
+	mStagingBusy = false;
+
+	return !staging_failed;
+}
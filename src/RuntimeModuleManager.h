@@ -2,8 +2,14 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
+
+#include <bx/thread.h>
+#include <bx/mutex.h>
+#include <bx/semaphore.h>
 
 #include "RuntimeModule.h"
+#include "Serializer.h"
 
 struct RuntimeModule;
 
@@ -14,7 +20,28 @@ struct RuntimeModule {
 	void *data = nullptr;
 	int mtime = 0;
 	int mtimensec = 0;
-	off_t fsize = 0;
+
+	/// inotify watch descriptor of the directory containing the module
+	int watch_descriptor = -1;
+	/// set when the library was completely written or a reload was requested
+	bool changed = false;
+
+	/// path of the versioned copy of the library that is currently loaded
+	std::string path = "";
+
+	/// profiler marker of the step of this module
+	uint32_t profile_marker = 0;
+	/// profiler marker of the simulation steps of this module
+	uint32_t simulate_profile_marker = 0;
+	/// duration of the last step in bx::getHPCounter() ticks
+	int64_t step_ticks = 0;
+	/// duration of all simulation steps of the current frame in
+	/// bx::getHPCounter() ticks, reset by BeginFrame()
+	int64_t simulate_ticks = 0;
+
+	/// modules this module links against. Reloading a module also reloads
+	/// all modules that depend on it.
+	std::vector<RuntimeModule*> dependencies;
 
 	struct module_api api;
 	struct module_state *state = nullptr;
@@ -22,14 +49,109 @@ struct RuntimeModule {
 
 struct RuntimeModuleManager {
 	std::vector<RuntimeModule*> mModules;
-	int mNumUpdatesSinceLastModuleChange = 0;
 
-	void RegisterModule(const char* name);
+	// Module file watcher. A background thread blocks on the inotify file
+	// descriptor and collects the files that were closed after writing or
+	// moved into one of the module directories. The main loop only checks
+	// mWatcherSignaled and therefore does not perform any syscalls.
+	struct WatchEvent {
+		int watch_descriptor;
+		std::string filename;
+	};
+
+	int mInotifyFd = -1;
+	bx::Thread mWatcherThread;
+	bx::Mutex mWatcherMutex;
+	std::vector<WatchEvent> mWatcherEvents;
+	std::atomic<bool> mWatcherSignaled { false };
+	std::atomic<bool> mWatcherQuit { false };
+
+	// Module staging. Changed libraries are copied to a unique versioned
+	// path and opened on a worker thread. The main loop only swaps the
+	// module pointers and calls unload/reload at a frame boundary. Modules
+	// that depend on another module of the same batch have to be opened
+	// after the swap on the main thread, as otherwise the loader would
+	// resolve them against the old version of the dependency.
+	struct StagedModule {
+		RuntimeModule* module = nullptr;
+		std::string path = "";
+		void* handle = nullptr;
+		struct module_api api;
+		ino_t id = 0;
+		int mtime = 0;
+		int mtimensec = 0;
+		bool copied = false;
+		bool deferred = false;
+		// deferred modules only: the staged copy equals the running copy
+		bool identical = false;
+		// state is kept in memory instead of being serialized
+		bool handover = false;
+	};
+
+	int mStagingVersion = 0;
+	bx::Thread mStagingThread;
+	bx::Semaphore mStagingSemaphore;
+	// only accessed by the staging thread while mStagingBusy is set and
+	// mStagingDone is not yet set
+	std::vector<StagedModule> mStagedModules;
+	std::atomic<bool> mStagingBusy { false };
+	std::atomic<bool> mStagingDone { false };
+	std::atomic<bool> mStagingQuit { false };
+
+	// Reload snapshots. Modules serialize their state into one of two
+	// in-memory snapshots that the reloaded modules directly read from.
+	// A background thread then merges it into mPersistedSnapshot and writes
+	// that to the state file while the next reload already uses the other
+	// snapshot.
+	Snapshot mSnapshots[2];
+	int mSnapshotIndex = 0;
+	// only accessed by the flush thread while mFlushPending is set
+	Snapshot mPersistedSnapshot;
+	Snapshot* mFlushedSnapshot = nullptr;
+	bool mFlushPending = false;
+	// disables writing the state file, e.g. for replays
+	bool mFlushToDisk = true;
+	// disables reading the state file in LoadModules() such that the
+	// modules start from their defaults, e.g. for recordings and replays
+	bool mReadStateFile = true;
+	bx::Thread mFlushThread;
+	bx::Semaphore mFlushSemaphore;
+	bx::Semaphore mFlushDoneSemaphore;
+	std::atomic<bool> mFlushQuit { false };
+
+	RuntimeModule* RegisterModule(
+			const char* name,
+			const std::vector<RuntimeModule*>& dependencies = std::vector<RuntimeModule*>());
 	void UnregisterModules();
 
+	void StartWatcher();
+	void StopWatcher();
+	int32_t WatcherLoop();
+
+	void StartStaging();
+	void StopStaging();
+	int32_t StagingLoop();
+	bool StageModule(StagedModule& staged);
+	bool OpenStagedModule(StagedModule& staged);
+	void ActivateModule(StagedModule& staged);
+	bool CanHandOverState(const StagedModule& staged);
+
+	void StartFlusher();
+	void StopFlusher();
+	int32_t FlushLoop();
+	Snapshot* BeginSnapshot();
+	void FlushSnapshot(Snapshot* snapshot);
+	void WaitForFlush();
+
 	void LoadModule(RuntimeModule* module);
 	bool CheckModulesChanged();
+	void UnloadModule(RuntimeModule* module);
+	void SuspendModule(RuntimeModule* module);
 	void UnloadModules();
 	void LoadModules();
+	void StageChangedModules();
+	bool SwapStagedModules();
+	void BeginFrame();
+	void Simulate(float dt);
 	void Update(float dt);
 };
@@ -1,34 +1,213 @@
 #pragma once
 
 #include "SimpleMath/SimpleMath.h"
+#include "SimpleMath/SimpleMathGL.h"
 #include <iostream>
 #include <fstream>
-#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
 #include <cstring>
+#include <cassert>
+#include <cstddef>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+// Module state is serialized into an in-memory Snapshot which can be
+// written to a file with the following format (native byte order):
+//
+//   SnapshotHeader
+//   SnapshotIndexEntry[header.num_entries]  (sorted by key hash)
+//   payloads, each aligned to cSnapshotAlignment bytes
+//
+// Keys are only stored as their 64 bit FNV-1a hash. Use SERIALIZER_KEY()
+// for string literals such that the hash gets computed at compile time:
+//
+//   SerializeBool (*serializer, SERIALIZER_KEY("protot.Module.flag"), flag);
+
+static const uint32_t cSnapshotVersion = 2;
+static const uint64_t cSnapshotAlignment = 16;
+
+struct SnapshotHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t reserved;
+};
+
+struct SnapshotIndexEntry {
+	uint64_t hash;
+	uint64_t offset;
+	uint64_t size;
+};
+
+constexpr uint64_t SerializerKeyHash(const char* str, uint64_t hash = 0xcbf29ce484222325ull) {
+	return *str == 0 ? hash
+		: SerializerKeyHash(str + 1, (hash ^ uint64_t(uint8_t(*str))) * 0x100000001b3ull);
+}
+
+struct SerializerKey {
+	uint64_t hash;
+	const char* name;
+
+	constexpr SerializerKey(uint64_t hash, const char* name) : hash(hash), name(name) {}
+
+	// for keys that are assembled at runtime
+	explicit SerializerKey(const std::string& name) :
+		hash(SerializerKeyHash(name.c_str())),
+		name(nullptr)
+	{}
+};
+
+#define SERIALIZER_KEY(name) \
+	SerializerKey(std::integral_constant<uint64_t, SerializerKeyHash(name)>::value, name)
+
+inline bool operator<(const SnapshotIndexEntry& entry, uint64_t hash) {
+	return entry.hash < hash;
+}
+
+// In-memory snapshot. The payload is a growable arena whose memory is
+// kept by Clear() such that taking a snapshot does not allocate once the
+// arena is large enough. Offsets in the index are relative to the start
+// of the payload.
+struct Snapshot {
+	std::vector<SnapshotIndexEntry> index;
+	std::vector<char> payload;
+
+	void Clear() {
+		index.clear();
+		payload.clear();
+	}
+
+	// Adds a zero initialized value of the given size and returns its
+	// data. The pointer is valid until the next value gets added.
+	char* Add(uint64_t hash, size_t size) {
+		SnapshotIndexEntry entry;
+		entry.hash = hash;
+		entry.offset = (payload.size() + cSnapshotAlignment - 1) & ~(cSnapshotAlignment - 1);
+		entry.size = size;
+		index.push_back(entry);
+
+		payload.resize(entry.offset + size, 0);
+		return payload.data() + entry.offset;
+	}
+
+	void Add(uint64_t hash, const char* data, size_t size) {
+		char* dest = Add(hash, size);
+		if (size > 0) {
+			memcpy(dest, data, size);
+		}
+	}
+
+	void Sort() {
+		std::stable_sort(index.begin(), index.end(),
+				[](const SnapshotIndexEntry& a, const SnapshotIndexEntry& b) {
+					return a.hash < b.hash;
+				});
+
+		for (int i = 1; i < index.size(); i++) {
+			if (index[i].hash == index[i - 1].hash) {
+				std::cerr << "Warning: duplicate serializer key hash "
+					<< std::hex << index[i].hash << std::dec << std::endl;
+			}
+		}
+	}
+
+	// Adds the values of the sorted snapshot newer. Values that exist in
+	// both snapshots are taken from newer.
+	void Merge(const Snapshot& newer) {
+		Snapshot merged;
+		merged.index.reserve(index.size() + newer.index.size());
+		merged.payload.reserve(payload.size() + newer.payload.size());
+
+		int i = 0;
+		int j = 0;
+		while (i < index.size() || j < newer.index.size()) {
+			if (j == newer.index.size()
+					|| (i < index.size() && index[i].hash < newer.index[j].hash)) {
+				merged.Add(index[i].hash, payload.data() + index[i].offset, index[i].size);
+				i++;
+			} else {
+				if (i < index.size() && index[i].hash == newer.index[j].hash) {
+					i++;
+				}
+				merged.Add(newer.index[j].hash,
+						newer.payload.data() + newer.index[j].offset, newer.index[j].size);
+				j++;
+			}
+		}
+
+		std::swap(index, merged.index);
+		std::swap(payload, merged.payload);
+	}
+
+	bool Write(const char* filename) const {
+		SnapshotHeader header;
+		memcpy(header.magic, "PTSS", sizeof(header.magic));
+		header.version = cSnapshotVersion;
+		header.num_entries = index.size();
+		header.reserved = 0;
+
+		// payload offsets in the file are relative to the start of the file
+		uint64_t payload_offset = sizeof(SnapshotHeader) + index.size() * sizeof(SnapshotIndexEntry);
+		payload_offset = (payload_offset + cSnapshotAlignment - 1) & ~(cSnapshotAlignment - 1);
+		std::vector<SnapshotIndexEntry> file_index (index);
+		for (int i = 0; i < file_index.size(); i++) {
+			file_index[i].offset += payload_offset;
+		}
+
+		std::ofstream stream(filename, std::ofstream::binary | std::ofstream::trunc);
+		if (!stream) {
+			std::cerr << "Error: could not write " << filename << std::endl;
+			return false;
+		}
+
+		static const char padding[cSnapshotAlignment] = { 0 };
+		stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		if (file_index.size() > 0) {
+			stream.write(reinterpret_cast<const char*>(&file_index[0]),
+					file_index.size() * sizeof(SnapshotIndexEntry));
+		}
+		stream.write(padding, payload_offset - sizeof(SnapshotHeader)
+				- file_index.size() * sizeof(SnapshotIndexEntry));
+		if (payload.size() > 0) {
+			stream.write(&payload[0], payload.size());
+		}
+
+		return stream.good();
+	}
+};
+
 struct WriteSerializer {
 	enum { IsReading = 0 };
 	enum { IsWriting = 1 };
 
-	std::ofstream stream;
-
-	bool SerializeData (const std::string &key, const char *data, size_t size) {
-		size_t key_length = key.size();
-		stream.write (reinterpret_cast<char*>(&key_length), sizeof (size_t));
-		stream << key;
-		stream.write (reinterpret_cast<char*>(&size), sizeof(size_t));
-		stream.write (data, size);
+	Snapshot* snapshot = nullptr;
 
+	bool SerializeData (const SerializerKey &key, const char *data, size_t size) {
+		assert (snapshot != nullptr);
+		snapshot->Add(key.hash, data, size);
 		return true;
 	}
 
-	void Open(const char* filename) {
-		stream.open(filename, std::ofstream::trunc);
+	// returns the memory for a value of the given size that has to be
+	// filled before the next value gets serialized
+	char* ReserveData (const SerializerKey &key, size_t size) {
+		assert (snapshot != nullptr);
+		return snapshot->Add(key.hash, size);
+	}
+
+	void Open(Snapshot* snapshot) {
+		this->snapshot = snapshot;
+		snapshot->Clear();
 	}
 
 	void Close() {
-		stream.close();
+		snapshot->Sort();
+		snapshot = nullptr;
 	}
 };
 
@@ -36,98 +215,308 @@ struct ReadSerializer {
 	enum { IsReading = 1 };
 	enum { IsWriting = 0 };
 
-	struct Block {
-		size_t size;
-		void *pdata;
-
-		Block() : size(0), pdata(nullptr) {}
-		Block(const Block& other) :
-			size(other.size),
-			pdata(other.pdata)
-		{}
-		Block& operator=(const Block& other) {
-			if (this != &other) {
-				size = other.size;
-				pdata = other.pdata;
-			}
-			return *this;
+	// returns the serialized value in the mapping or nullptr if there is
+	// no value for the key
+	const char* FindData (const SerializerKey &key, size_t *size) const {
+		const SnapshotIndexEntry* end = index + num_entries;
+		const SnapshotIndexEntry* entry = std::lower_bound(index, end, key.hash);
+		if (entry == end || entry->hash != key.hash) {
+			return nullptr;
 		}
-	};
 
-	bool SerializeData (const std::string &key, char *data, size_t size) {
-		std::unordered_map<std::string, Block>::iterator iter;
-		iter = blocks.find(key);
-		if (iter == blocks.end()) {
+		*size = entry->size;
+		return payload_data + entry->offset;
+	}
+
+	bool SerializeData (const SerializerKey &key, char *data, size_t size) {
+		size_t entry_size = 0;
+		const char* entry_data = FindData(key, &entry_size);
+		if (entry_data == nullptr) {
 			return false;
 		}
 
-//		std::cout << "found block for " << key << ", size: " << iter->second.size << std::endl;
-		assert (size == iter->second.size);
-//		std::cout << "copying from " << iter->second.pdata << " to " << (void*) data << std::endl; 
-//		std::cout << "copying from " << blocks[key].pdata << " to " << (void*) data << std::endl; 
-		assert (blocks[key].size == size);
-		memcpy (data, blocks[key].pdata, size);
+		if (entry_size != size) {
+			std::cerr << "Warning: size of serialized value "
+				<< (key.name != nullptr ? key.name : "") << " changed from "
+				<< entry_size << " to " << size << " bytes, ignoring it" << std::endl;
+			return false;
+		}
+
+		memcpy (data, entry_data, size);
 		return true;
 	}
 
+	// Reads from a sorted in-memory snapshot that has to stay unchanged
+	// until Close() is called.
+	void Open(const Snapshot& snapshot) {
+		Close();
+
+		index = snapshot.index.data();
+		num_entries = snapshot.index.size();
+		payload_data = snapshot.payload.data();
+	}
+
+	// The snapshot gets mapped into memory and the values are copied
+	// directly from the mapping until Close() is called.
 	void Open(const char* filename) {
+		Close();
+
+		int fd = open(filename, O_RDONLY);
 		// early out if file does not (yet) exist
+		if (fd == -1) {
+			return;
+		}
+
 		struct stat fstat;
-		if (stat(filename, &fstat) == -1) {
+		if (::fstat(fd, &fstat) == -1 || fstat.st_size == 0) {
+			close(fd);
+			return;
+		}
+
+		void* mapping = mmap(nullptr, fstat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) {
+			std::cerr << "Error: could not map " << filename << std::endl;
 			return;
 		}
 
-		std::ifstream stream(filename, std::ios::binary);
+		mapped_data = static_cast<char*>(mapping);
+		mapped_size = fstat.st_size;
 
-		size_t key_size;
-		size_t block_size;
+		if (!Validate()) {
+			std::cerr << "Warning: ignoring invalid or outdated snapshot "
+				<< filename << std::endl;
+			Close();
+		}
+	}
+
+	bool Validate() {
+		if (mapped_size < sizeof(SnapshotHeader)) {
+			return false;
+		}
 
-		while (!stream.eof()) {
-			// read key size
-			stream.read(reinterpret_cast<char*>(&key_size), sizeof(size_t));
-//			std::cout << "read key size " << key_size << std::endl;
-			assert (key_size < 1000);
-			// read key
-			std::string key (key_size, 0);
-			stream.read(&key[0], key_size);
+		const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(mapped_data);
+		if (memcmp(header->magic, "PTSS", sizeof(header->magic)) != 0
+				|| header->version != cSnapshotVersion
+				|| header->num_entries > (mapped_size - sizeof(SnapshotHeader)) / sizeof(SnapshotIndexEntry)) {
+			return false;
+		}
 
-			// create block
-			blocks[key] = Block();
-			Block *block = &blocks[key];
+		index = reinterpret_cast<const SnapshotIndexEntry*>(mapped_data + sizeof(SnapshotHeader));
+		num_entries = header->num_entries;
+		payload_data = mapped_data;
 
-			// read block size
-			stream.read(reinterpret_cast<char*>(&block->size), sizeof(size_t));
-//			std::cout << "read block " << key << ", size = " << block->size << std::endl;
-			block->pdata = new char[block->size + 1];
-//			std::cout << "block addr = " << block->pdata << std::endl;
-			stream.read(reinterpret_cast<char*>(block->pdata), block->size);
+		for (uint32_t i = 0; i < num_entries; i++) {
+			if (index[i].offset > mapped_size
+					|| index[i].size > mapped_size - index[i].offset
+					|| (i > 0 && index[i].hash < index[i - 1].hash)) {
+				return false;
+			}
 		}
 
-		stream.close();
-}
+		return true;
+	}
+
+	// copies all values into snapshot
+	void CopyTo(Snapshot& snapshot) const {
+		snapshot.Clear();
+		for (uint32_t i = 0; i < num_entries; i++) {
+			snapshot.Add(index[i].hash, payload_data + index[i].offset, index[i].size);
+		}
+	}
 
 	void Close() {
+		index = nullptr;
+		num_entries = 0;
+		payload_data = nullptr;
+
+		if (mapped_data != nullptr) {
+			munmap(mapped_data, mapped_size);
+			mapped_data = nullptr;
+			mapped_size = 0;
+		}
 	}
 
-	std::unordered_map<std::string, Block> blocks;
+	ReadSerializer() {}
+	ReadSerializer(const ReadSerializer&) = delete;
+	ReadSerializer& operator=(const ReadSerializer&) = delete;
+
+	~ReadSerializer() {
+		Close();
+	}
+
+	char* mapped_data = nullptr;
+	size_t mapped_size = 0;
+
+	const SnapshotIndexEntry* index = nullptr;
+	uint32_t num_entries = 0;
+	// base of the payload offsets in the index
+	const char* payload_data = nullptr;
 };
 
 template <typename Serializer>
-bool SerializeBool (Serializer &serializer, const std::string &key, bool& value) {
+bool SerializeBool (Serializer &serializer, const SerializerKey &key, bool& value) {
 	return serializer.SerializeData(key, reinterpret_cast<char*>(&value), sizeof(bool));
 }
 
 template <typename Serializer>
-bool SerializeInt (Serializer &serializer, const std::string &key, int& value) {
+bool SerializeInt (Serializer &serializer, const SerializerKey &key, int& value) {
 	return serializer.SerializeData(key, reinterpret_cast<char*>(&value), sizeof(int));
 }
 
 template <typename Serializer>
-bool SerializedUint16 (Serializer &serializer, const std::string &key, uint16_t& value) {
+bool SerializedUint16 (Serializer &serializer, const SerializerKey &key, uint16_t& value) {
 	return serializer.SerializeData(key, reinterpret_cast<char*>(&value), sizeof(uint16_t));
 }
 
 template <typename Serializer>
-bool SerializeVec3 (Serializer &serializer, const std::string &key, SimpleMath::Vector3f& value) {
+bool SerializeVec3 (Serializer &serializer, const SerializerKey &key, SimpleMath::Vector3f& value) {
 	return serializer.SerializeData(key, reinterpret_cast<char*>(&value), sizeof(SimpleMath::Vector3f));
 }
+
+// Arrays of trivially copyable values are serialized as a single block.
+// When reading, the serialized number of values has to match count.
+template <typename Serializer, typename T>
+bool SerializeArray (Serializer &serializer, const SerializerKey &key, T* values, size_t count) {
+	static_assert (std::is_trivially_copyable<T>::value, "T has to be trivially copyable");
+	return serializer.SerializeData(key, reinterpret_cast<char*>(values), count * sizeof(T));
+}
+
+// Vectors of trivially copyable values are serialized as a single block
+// and get resized to the serialized number of values when reading.
+template <typename T>
+bool SerializeVector (WriteSerializer &serializer, const SerializerKey &key, std::vector<T>& values) {
+	static_assert (std::is_trivially_copyable<T>::value, "T has to be trivially copyable");
+	return serializer.SerializeData(key, reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+template <typename T>
+bool SerializeVector (ReadSerializer &serializer, const SerializerKey &key, std::vector<T>& values) {
+	static_assert (std::is_trivially_copyable<T>::value, "T has to be trivially copyable");
+	size_t size = 0;
+	const char* data = serializer.FindData(key, &size);
+	if (data == nullptr || size % sizeof(T) != 0) {
+		return false;
+	}
+
+	values.resize(size / sizeof(T));
+	memcpy (values.data(), data, size);
+	return true;
+}
+
+// Describes a member of a struct that gets serialized with
+// SerializeStructs(), e.g.:
+//
+//   static const SerializerField cCameraFields[] = {
+//     SERIALIZER_FIELD(Camera, eye),
+//     SERIALIZER_FIELD(Camera, poi)
+//   };
+struct SerializerField {
+	uint64_t name_hash;
+	size_t offset;
+	size_t size;
+};
+
+#define SERIALIZER_FIELD(type, member) \
+	SerializerField { SerializerKeyHash(#member), offsetof(type, member), sizeof(type::member) }
+
+// The description is part of the key such that values that were written
+// with a different set of fields are ignored.
+template <size_t N>
+SerializerKey SerializerFieldsKey (const SerializerKey &key, const SerializerField (&fields)[N]) {
+	uint64_t hash = key.hash;
+	for (size_t i = 0; i < N; i++) {
+		hash = (hash ^ fields[i].name_hash) * 0x100000001b3ull;
+		hash = (hash ^ fields[i].size) * 0x100000001b3ull;
+	}
+	return SerializerKey(hash, key.name);
+}
+
+template <size_t N>
+size_t SerializerFieldsStride (const SerializerField (&fields)[N]) {
+	size_t stride = 0;
+	for (size_t i = 0; i < N; i++) {
+		stride += fields[i].size;
+	}
+	return stride;
+}
+
+// Returns the number of fields starting at first that are adjacent in the
+// struct and can therefore be copied at once, size receives their size.
+template <size_t N>
+size_t SerializerFieldsRun (const SerializerField (&fields)[N], size_t first, size_t* size) {
+	size_t last = first;
+	*size = fields[first].size;
+	while (last + 1 < N && fields[last + 1].offset == fields[first].offset + *size) {
+		last++;
+		*size += fields[last].size;
+	}
+	return last - first + 1;
+}
+
+// Packs the described fields of all values into a single block that is
+// written directly into the snapshot. When reading, the first
+// min(count, serialized count) values get restored.
+template <typename T, size_t N>
+bool SerializeStructs (WriteSerializer &serializer, const SerializerKey &key, T* values, size_t count, const SerializerField (&fields)[N]) {
+	size_t stride = SerializerFieldsStride(fields);
+	char* dest = serializer.ReserveData(SerializerFieldsKey(key, fields), count * stride);
+
+	for (size_t i = 0; i < count; i++) {
+		const char* value = reinterpret_cast<const char*>(&values[i]);
+		for (size_t j = 0; j < N; ) {
+			size_t size = 0;
+			size_t num_fields = SerializerFieldsRun(fields, j, &size);
+			memcpy (dest, value + fields[j].offset, size);
+			dest += size;
+			j += num_fields;
+		}
+	}
+
+	return true;
+}
+
+template <typename T, size_t N>
+bool SerializeStructs (ReadSerializer &serializer, const SerializerKey &key, T* values, size_t count, const SerializerField (&fields)[N]) {
+	size_t stride = SerializerFieldsStride(fields);
+	size_t size = 0;
+	const char* src = serializer.FindData(SerializerFieldsKey(key, fields), &size);
+	if (src == nullptr || stride == 0 || size % stride != 0) {
+		return false;
+	}
+
+	count = std::min(count, size / stride);
+	for (size_t i = 0; i < count; i++) {
+		char* value = reinterpret_cast<char*>(&values[i]);
+		for (size_t j = 0; j < N; ) {
+			size_t size = 0;
+			size_t num_fields = SerializerFieldsRun(fields, j, &size);
+			memcpy (value + fields[j].offset, src, size);
+			src += size;
+			j += num_fields;
+		}
+	}
+
+	return true;
+}
+
+// Vectors of structs get resized to the serialized number of values when
+// reading. Values that are added by the resize are default constructed
+// before the described fields get restored.
+template <typename T, size_t N>
+bool SerializeStructs (WriteSerializer &serializer, const SerializerKey &key, std::vector<T>& values, const SerializerField (&fields)[N]) {
+	return SerializeStructs(serializer, key, values.data(), values.size(), fields);
+}
+
+template <typename T, size_t N>
+bool SerializeStructs (ReadSerializer &serializer, const SerializerKey &key, std::vector<T>& values, const SerializerField (&fields)[N]) {
+	size_t stride = SerializerFieldsStride(fields);
+	size_t size = 0;
+	if (serializer.FindData(SerializerFieldsKey(key, fields), &size) == nullptr
+			|| stride == 0 || size % stride != 0) {
+		return false;
+	}
+
+	values.resize(size / stride);
+	return SerializeStructs(serializer, key, values.data(), values.size(), fields);
+}
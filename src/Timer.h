@@ -5,4 +5,21 @@ struct Timer {
 	float mFrameTime = 0.0f;
 	float mDeltaTime = 0.0f;
 	bool mPaused = false;
+
+	// frame pacing (0 disables pacing) and the percentiles of the
+	// recent frame times
+	float mTargetFrameTime = 1.0f / 60.0f;
+	float mFrameTimeP50 = 0.0f;
+	float mFrameTimeP95 = 0.0f;
+	float mFrameTimeP99 = 0.0f;
+
+	// fixed time step simulation
+	float mSimulationTimeStep = 1.0f / 60.0f;
+	float mSimulationAccumulator = 0.0f;
+	// interpolation weight between the previous and the current simulation
+	// state that is used for rendering
+	float mSimulationAlpha = 0.0f;
+	// limits the number of simulation steps per frame so that a slow frame
+	// does not cause even slower frames
+	int mMaxSimulationSteps = 5;
 };
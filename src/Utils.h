@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdarg>
+#include <cstdio>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,14 +17,44 @@ struct GuiInputState {
 	uint8_t mouseButton;
 	int32_t mouseScroll;
 	char key;
+	bool focused;
+
+	// pressed state of the keys indexed by their GLFW key code. Modules
+	// read the keys from here instead of polling GLFW such that the input
+	// can be recorded and replayed.
+	static const int cMaxKeys = 512;
+	uint64_t keyStates[cMaxKeys / 64];
 
 	GuiInputState() :
+		mousedX(0),
+		mousedY(0),
 		mouseX(0),
 		mouseY(0),
 		mouseButton(0),
 		mouseScroll(0),
-		key(0) {
+		key(0),
+		focused(false) {
+			memset(keyStates, 0, sizeof(keyStates));
+		}
+
+	bool IsKeyPressed(int key_code) const {
+		if (key_code < 0 || key_code >= cMaxKeys) {
+			return false;
+		}
+		return (keyStates[key_code / 64] >> (key_code % 64)) & 1;
+	}
+
+	void SetKeyPressed(int key_code, bool pressed) {
+		if (key_code < 0 || key_code >= cMaxKeys) {
+			return;
 		}
+		uint64_t mask = uint64_t(1) << (key_code % 64);
+		if (pressed) {
+			keyStates[key_code / 64] |= mask;
+		} else {
+			keyStates[key_code / 64] &= ~mask;
+		}
+	}
 };
 
 inline void gGetFileModTime (const char* filename, int *sec, int *nsec) {
@@ -7,12 +7,18 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <iostream>
 
 #include "bgfx/platform.h"
 #include "bx/timer.h"
 #include "Timer.h"
+#include "FramePacer.h"
+#include "InputRecorder.h"
+#include "JobSystem.h"
+#include "Profiler.h"
+#include "RewindBuffer.h"
 #include "RuntimeModuleManager.h"
 #include "imgui/imgui.h"
 
@@ -26,6 +32,9 @@ RuntimeModuleManager* gModuleManager = nullptr;
 WriteSerializer* gWriteSerializer = nullptr;
 ReadSerializer* gReadSerializer = nullptr;
 GuiInputState* gGuiInputState = nullptr;
+JobSystem* gJobSystem = nullptr;
+Profiler* gProfiler = nullptr;
+RewindBuffer* gRewindBuffer = nullptr;
 double gTimeAtStart = 0;
 
 double mouse_scroll_x = 0.;
@@ -73,7 +82,8 @@ void mouse_scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
 }
 
 void handle_mouse () {
-	if (!glfwGetWindowAttrib(gWindow, GLFW_FOCUSED)) {
+	gGuiInputState->focused = glfwGetWindowAttrib(gWindow, GLFW_FOCUSED);
+	if (!gGuiInputState->focused) {
 		return;
 	}
 
@@ -97,43 +107,89 @@ void handle_mouse () {
 		+ (glfwGetMouseButton(gWindow, 2) << 2);
 }
 
-int main(void)
+void handle_keyboard () {
+	for (int key = GLFW_KEY_SPACE; key <= GLFW_KEY_LAST; key++) {
+		gGuiInputState->SetKeyPressed(key,
+				glfwGetKey(gWindow, key) == GLFW_PRESS);
+	}
+}
+
+static void print_usage(const char* program_name) {
+	std::cout << "Usage: " << program_name << " [options]" << std::endl
+		<< "Options:" << std::endl
+		<< "  --headless   run without a window using the Noop renderer" << std::endl
+		<< "  --frames N   quit after N frames" << std::endl
+		<< "  --record F   record the input and frame times to file F" << std::endl
+		<< "  --replay F   replay the input log F headless and as fast as" << std::endl
+		<< "               possible and print the frame and module timings" << std::endl;
+}
+
+int main(int argc, char* argv[])
 {
 	gTimeAtStart = gGetCurrentTime();
 	std::cout << "Time at start: " << gTimeAtStart << std::endl;
 
+	bool headless = false;
+	int max_frames = -1;
+	const char* record_filename = nullptr;
+	const char* replay_filename = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+		} else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			max_frames = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_filename = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay_filename = argv[++i];
+			headless = true;
+		} else {
+			print_usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+	}
+
 	WriteSerializer out_serializer;
 	ReadSerializer in_serializer;
 
-	// Initialize GLFW
-	glfwSetErrorCallback(error_callback);
-	glfwInit();
+	int width = 800;
+	int height = 600;
+
+	if (!headless) {
+		// Initialize GLFW
+		glfwSetErrorCallback(error_callback);
+		glfwInit();
 
-	glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_API);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_SAMPLES, 16);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_ANY_PROFILE);
+		glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_API);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_SAMPLES, 16);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_ANY_PROFILE);
 
-	gWindow = glfwCreateWindow(800, 600, "ProtoT", NULL, NULL);
-	glfwMakeContextCurrent(gWindow);
-	int width, height;
-	glfwGetWindowSize(gWindow, &width, &height);
+		gWindow = glfwCreateWindow(width, height, "ProtoT", NULL, NULL);
+		glfwMakeContextCurrent(gWindow);
+		glfwGetWindowSize(gWindow, &width, &height);
 
-	glfwSetKeyCallback(gWindow, key_callback);
-	glfwSetScrollCallback (gWindow, mouse_scroll_callback);
+		glfwSetKeyCallback(gWindow, key_callback);
+		glfwSetScrollCallback (gWindow, mouse_scroll_callback);
 
-	std::cout << "OpenGL Version: " << glGetString(GL_VERSION) << endl;
-	std::cout << "GLSL Version  : " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+		std::cout << "OpenGL Version: " << glGetString(GL_VERSION) << endl;
+		std::cout << "GLSL Version  : " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+
+		bgfx::glfwSetWindow(gWindow);
+	} else {
+		std::cout << "Running headless" << std::endl;
+	}
 
 	// Initialize Renderer	
-	bgfx::glfwSetWindow(gWindow);
 	bgfx::renderFrame();
 
 	uint32_t debug = BGFX_DEBUG_TEXT;
 	uint32_t reset = BGFX_RESET_VSYNC;
 
-	bool result = bgfx::init();
+	bool result = bgfx::init(
+			headless ? bgfx::RendererType::Noop : bgfx::RendererType::Count);
 	if (!result) {
 		std::cerr << "Error: could not initialize renderer!" << std::endl;
 		exit (EXIT_FAILURE);
@@ -151,11 +207,45 @@ int main(void)
 	timer.mCurrentTime = 0.0f;
 	timer.mDeltaTime = 0.0f;
 
+	// headless runs are used to measure the frame cost
+	if (headless) {
+		timer.mTargetFrameTime = 0.0f;
+	}
+
+	// Profiler
+	Profiler profiler;
+	gProfiler = &profiler;
+	profiler.SetThreadName("Main");
+
+	// Job system (lives in the host so that it survives module reloads)
+	JobSystem job_system;
+	job_system.Init();
+	gJobSystem = &job_system;
+
+	// Rewind buffer: 64 MB for up to one minute at 60 fps
+	RewindBuffer rewind_buffer;
+	rewind_buffer.Init(64 * 1024 * 1024, 60 * 60);
+	gRewindBuffer = &rewind_buffer;
+
 	printf("Initializing ModuleManager...\n");
 	RuntimeModuleManager module_manager;
-	module_manager.RegisterModule("src/modules/libRenderModule.so");
-	module_manager.RegisterModule("src/modules/libCharacterModule.so");
-	module_manager.RegisterModule("src/modules/libTestModule.so");
+	// Dependencies mirror the link dependencies in src/modules/CMakeLists.txt
+	RuntimeModule* render_module =
+		module_manager.RegisterModule("src/modules/libRenderModule.so");
+	RuntimeModule* character_module =
+		module_manager.RegisterModule("src/modules/libCharacterModule.so",
+				{ render_module });
+	module_manager.RegisterModule("src/modules/libTestModule.so",
+			{ character_module, render_module });
+
+	// recordings and replays have to start from the same state, the
+	// simulation state at the start of the recording is part of the log
+	if (replay_filename != nullptr || record_filename != nullptr) {
+		module_manager.mReadStateFile = false;
+	}
+	if (replay_filename != nullptr) {
+		module_manager.mFlushToDisk = false;
+	}
 
 	// Setup global variables
 	gModuleManager = &module_manager;
@@ -167,10 +257,42 @@ int main(void)
 
 	int64_t time_offset = bx::getHPCounter();
 
-	while(!glfwWindowShouldClose(gWindow)) {
+	InputRecorder input_recorder;
+	ReplayStatistics replay_statistics;
+	if (replay_filename != nullptr) {
+		if (!input_recorder.StartReplay(replay_filename, module_manager)) {
+			exit (EXIT_FAILURE);
+		}
+	} else if (record_filename != nullptr) {
+		if (!input_recorder.StartRecording(record_filename, module_manager)) {
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	FramePacer frame_pacer;
+	frame_pacer.Start();
+
+	int frame_count = 0;
+
+	while(max_frames < 0 || frame_count < max_frames) {
+		if (!headless) {
+			if (glfwWindowShouldClose(gWindow)) {
+				break;
+			}
+
+			handle_mouse();
+			handle_keyboard();
+			glfwGetWindowSize(gWindow, &width, &height);
+		}
+
+		int64_t frame_start = bx::getHPCounter();
+		float replay_frame_time = 0.0f;
+		if (input_recorder.IsReplaying()
+				&& !input_recorder.ReplayFrame(*gGuiInputState, replay_frame_time)) {
+			break;
+		}
+
 		// Start the imgui frame such that widgets can be submitted
-		handle_mouse();
-		glfwGetWindowSize(gWindow, &width, &height);
 
 		imguiBeginFrame (gGuiInputState->mouseX,
 				gGuiInputState->mouseY,
@@ -184,14 +306,17 @@ int main(void)
 		int64_t pre_module_check = bx::getHPCounter();
 
 		if (module_manager.CheckModulesChanged()) {
-			std::cout << "Detected module update. Unloading all modules." << std::endl;
-			module_manager.UnloadModules();
-			// We need to sleep to make sure we load the new files
-			module_manager.LoadModules();
+			module_manager.StageChangedModules();
+		}
+
+		if (module_manager.SwapStagedModules()) {
+			std::cout << "Swapped staged modules." << std::endl;
 			// We need to update our last timestamp to ignore the delay due
 			// to reloading of the modules.
 			last = bx::getHPCounter();
 		}
+
+		rewind_buffer.ApplyRequestedRestore(module_manager);
 	
 		// update time that was passed without module reloading
 		int64_t now = bx::getHPCounter();
@@ -207,6 +332,15 @@ int main(void)
 		const double toMs = 1000.0/freq;
 
 		gTimer->mFrameTime = (float)(frameTime / freq);
+
+		// replays use the recorded frame times such that they advance the
+		// same way as the recorded session
+		if (input_recorder.IsReplaying()) {
+			gTimer->mFrameTime = replay_frame_time;
+		} else if (input_recorder.IsRecording()) {
+			input_recorder.RecordFrame(*gGuiInputState, gTimer->mFrameTime);
+		}
+
 		if (!gTimer->mPaused) {
 			gTimer->mDeltaTime = gTimer->mFrameTime;
 			gTimer->mCurrentTime = gTimer->mCurrentTime + gTimer->mDeltaTime;
@@ -215,18 +349,71 @@ int main(void)
 		}
 
 		assert (gTimer->mDeltaTime >= 0.0f);
-		module_manager.Update(gTimer->mDeltaTime);
 
-		glfwPollEvents();
+		// advance the simulation in fixed steps
+		module_manager.BeginFrame();
+		gTimer->mSimulationAccumulator += gTimer->mDeltaTime;
+		int num_simulation_steps = 0;
+		while (gTimer->mSimulationAccumulator >= gTimer->mSimulationTimeStep
+				&& num_simulation_steps < gTimer->mMaxSimulationSteps) {
+			PROFILE_SCOPE("Simulate");
+			module_manager.Simulate(gTimer->mSimulationTimeStep);
+			gTimer->mSimulationAccumulator -= gTimer->mSimulationTimeStep;
+			num_simulation_steps++;
+		}
+
+		// drop the time we could not catch up with
+		if (gTimer->mSimulationAccumulator > gTimer->mSimulationTimeStep) {
+			gTimer->mSimulationAccumulator = gTimer->mSimulationTimeStep;
+		}
+
+		gTimer->mSimulationAlpha = 
+			gTimer->mSimulationAccumulator / gTimer->mSimulationTimeStep;
+
+		{
+			PROFILE_SCOPE("Update");
+			module_manager.Update(gTimer->mDeltaTime);
+		}
+
+		if (!gTimer->mPaused) {
+			rewind_buffer.Capture(module_manager);
+		}
+
+		if (!headless) {
+			glfwPollEvents();
+		}
 
 		// submit the imgui widgets
 		imguiEndFrame();
 
-    usleep(16000);
+		if (input_recorder.IsReplaying()) {
+			replay_statistics.AddFrame(module_manager,
+					float((bx::getHPCounter() - frame_start) / freq));
+		}
+
+		{
+			PROFILE_SCOPE("FramePacer");
+			frame_pacer.Wait(*gTimer);
+		}
+
+		profiler.EndFrame();
+		frame_count++;
 	}
 
+	if (input_recorder.IsReplaying()) {
+		input_recorder.StopReplay();
+		replay_statistics.Print();
+	}
+	input_recorder.StopRecording();
+
 	module_manager.UnregisterModules();
 
+	job_system.Shutdown();
+	gJobSystem = nullptr;
+
+	gProfiler = nullptr;
+	gRewindBuffer = nullptr;
+
 	gRenderer = nullptr;
 
 	imguiDestroy();
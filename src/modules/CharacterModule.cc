@@ -13,6 +13,7 @@
 #include "modules/RenderModule.h"
 #include "Serializer.h"
 #include "Timer.h"
+#include "Profiler.h"
 
 #include "string_utils.h"
 
@@ -43,14 +44,22 @@ const float cGravity = 9.81f;
 const float cGroundAcceleration = 10.0f;
 const float cCharacterHeight = 1.8f;
 const float cCharacterWidth = 1.f;
+
+// vertex format of the rig meshes and whether their vertex data gets freed
+// once the GPU buffers exist
+const bgfxutils::MeshVertexFormat cRigVertexFormat = bgfxutils::MeshVertexQuantized;
+const bool cReleaseRigMeshData = true;
+// number of simplified versions of the rig meshes for distant characters
+const int cRigMeshLods = 4;
 const char* cRigModelFile = "data/models/model.lua";
 const char* cAnimFile = "data/models/anim.csv";
 
 static VectorNf sRigQ;
 Quaternion offset_quat;
 
-struct module_state {
-};
+MODULE_STATE_DEPENDS();
+MODULE_STATE({
+});
 
 bool Animation::Load(const char* filename) {
 	ifstream infile (filename);
@@ -186,6 +195,7 @@ bool CharacterEntity::LoadRig(const char* filename) {
 	gLog ("Creating rig model from %s ... %s", filename, load_result ? "success" : "failed!");
 	gLog ("Rig model has %d degrees of freedom", mRigModel->qdot_size);
 	mRigState.q = VectorNd::Zero (mRigModel->q_size);
+	mPrevRigState = mRigState;
 
 	gLog ("Reading rig geometry information ... ");
 
@@ -335,7 +345,9 @@ bool CharacterEntity::LoadRig(const char* filename) {
 			// apply transform
 			mesh->Transform (mesh_transform.toMatrix());
 			mesh->UpdateBounds();
+			mesh->mVertexFormat = cRigVertexFormat;
 			mesh->Update();
+			mesh->GenerateLods(cRigMeshLods);
 
 			mEntity->mSkeletonMeshes.AddMesh(
 					mesh,
@@ -349,12 +361,30 @@ bool CharacterEntity::LoadRig(const char* filename) {
 			mEntity->mSkeleton.Length(),
 			num_meshes);
 
+	// all meshes in a single draw call for the skinned drawing
+	if (mEntity->mSkeletonMeshes.UpdateSkinnedMesh(cRigVertexFormat)) {
+		Mesh* skinned_mesh = mEntity->mSkeletonMeshes.mSkinnedMesh;
+		skinned_mesh->GenerateLods(cRigMeshLods);
+
+		gLog ("Created skinned mesh with %d vertices, %d bones and %d LODs",
+				(int) skinned_mesh->mBuildStats.numVertices,
+				(int) mEntity->mSkeletonMeshes.mSkinnedBones.size(),
+				skinned_mesh->GetNumLods());
+	}
+
+	if (cReleaseRigMeshData) {
+		size_t released = mEntity->mSkeletonMeshes.ReleaseCpuData();
+		gLog ("Released %.1f kB of rig mesh vertex data", released / 1024.);
+	}
+
 	return load_result;
 }
 
 static float cur_time = 0.0f;
 
 void CharacterEntity::ApplyCharacterController(float dt) {
+	PROFILE_SCOPE("CharacterEntity::ApplyCharacterController");
+
 	Vector3f mController_acceleration (
 			mController.mDirection[0] * cGroundAcceleration,
 			mController.mDirection[1] * cGroundAcceleration,
@@ -372,8 +402,6 @@ void CharacterEntity::ApplyCharacterController(float dt) {
 
 	mVelocity = mVelocity + acceleration * dt;
 
-	mPosition = mEntity->mTransform.translation;
-
 	if (mPosition[1] == 0.0f 
 			&& mController.mState[CharacterController::ControlStateJump]) {
 		mVelocity[1] = cJumpVelocity;	
@@ -387,14 +415,6 @@ void CharacterEntity::ApplyCharacterController(float dt) {
 		mVelocity[1] = 0.0f;
 	}
 
-	// apply transformation
-	mEntity->mTransform.translation.set(
-			mPosition[0],
-			mPosition[1],
-			mPosition[2]);
-
-	gRenderer->drawDebugSphere (Vector3f (0.f, 1.3 + sin(cur_time * 2.f), 0.f), 2.2f);
-
 	// Convert to different coordinate frame
 	Quaternion quat (1., 0.0f, 0.0f, 1.0f);
 	quat.normalize();
@@ -402,7 +422,7 @@ void CharacterEntity::ApplyCharacterController(float dt) {
 	float plane_angle = atan2 (mVelocity[2], mVelocity[0]);
 	Quaternion heading_rot (Quaternion::fromAxisAngle(Vector3f (0.f, 1.f, 0.f), plane_angle));
 
-	mEntity->mTransform.rotation = quat * heading_rot;
+	mRotation = quat * heading_rot;
 
 	if (mVelocity.squaredNorm() > 0.01f) {
 		mAnimTime += dt;
@@ -416,6 +436,8 @@ void CharacterEntity::ApplyCharacterController(float dt) {
 }
 
 void CharacterEntity::UpdateIKGizmos() {
+	PROFILE_SCOPE("CharacterEntity::UpdateIKGizmos");
+
 	for (int i = 0; i < mIKConstraints.size(); ++i) {
 		IKConstraint& constraint = mIKConstraints[i];
 		Transform ik_handle_transform;
@@ -469,6 +491,8 @@ void CharacterEntity::UpdateIKConstraintSet() {
 }
 
 void CharacterEntity::ApplyIKConstraints() {
+	PROFILE_SCOPE("CharacterEntity::ApplyIKConstraints");
+
 	if (mIKConstraints.size() == 0)
 		return;
 
@@ -484,15 +508,19 @@ void CharacterEntity::ApplyIKConstraints() {
 			q_res
 			);
 	mRigState.q = q_res;
+}
+
+void CharacterEntity::DrawIKConstraints() {
+	VectorNd q = mRigState.q;
 
 	for (int i = 0; i < mIKConstraints.size(); ++i) {
 		const IKConstraint& constraint = mIKConstraints[i];
 		UpdateKinematicsCustom (
-				*mRigModel, &q_res, nullptr, nullptr);
+				*mRigModel, &q, nullptr, nullptr);
 
 		Vector3f effector_pos = CalcBodyToBaseCoordinates(
 				*mRigModel, 
-				q_res, 
+				q, 
 				constraint.mEffectorBodyId, 
 				constraint.mEffectorLocalOffset,
 				false
@@ -518,17 +546,87 @@ void CharacterEntity::ApplyIKConstraints() {
 	}
 }
 
-void CharacterEntity::Update(float dt) {
-	UpdateIKGizmos();
+void CharacterEntity::Simulate(float dt) {
+	PROFILE_SCOPE("CharacterEntity::Simulate");
+
+	mPrevPosition = mPosition;
+	mPrevRotation = mRotation;
+	mPrevRigState = mRigState;
+
 	ApplyCharacterController(dt);
 	ApplyIKConstraints();
-	UpdateBoneMatrices();
 
 	cur_time += dt;
 }
 
-void CharacterEntity::UpdateBoneMatrices() {
-	VectorNd q = mRigState.q;
+void CharacterEntity::Update(float alpha) {
+	PROFILE_SCOPE("CharacterEntity::Update");
+
+	UpdateIKGizmos();
+
+	mEntity->mTransform.translation = 
+		mPrevPosition + (mPosition - mPrevPosition) * alpha;
+	mEntity->mTransform.rotation = mPrevRotation.slerp(alpha, mRotation);
+
+	// the rig state gets resized when the rig is reloaded
+	if (mPrevRigState.q.size() == mRigState.q.size()) {
+		UpdateBoneMatrices(InterpolateRigState(alpha));
+	} else {
+		UpdateBoneMatrices(mRigState.q);
+	}
+
+	gRenderer->drawDebugSphere (Vector3f (0.f, 1.3 + sin(cur_time * 2.f), 0.f), 2.2f);
+	DrawIKConstraints();
+}
+
+VectorNf CharacterEntity::InterpolateRigState(float alpha) const {
+	const VectorNf& q0 = mPrevRigState.q;
+	const VectorNf& q1 = mRigState.q;
+	VectorNf result = q0 + (q1 - q0) * alpha;
+
+	for (unsigned int i = 1; i < mRigModel->mJoints.size(); i++) {
+		if (mRigModel->mJoints[i].mJointType != JointTypeSpherical) {
+			continue;
+		}
+
+		// x, y, z are stored at q_index, w at the end of q
+		unsigned int indices[4] = {
+			mRigModel->mJoints[i].q_index,
+			mRigModel->mJoints[i].q_index + 1,
+			mRigModel->mJoints[i].q_index + 2,
+			mRigModel->multdof3_w_index[i]
+		};
+
+		// q and -q are the same rotation, take the shorter arc
+		float dot = 0.f;
+		for (int k = 0; k < 4; k++) {
+			dot += q0[indices[k]] * q1[indices[k]];
+		}
+		float sign = dot < 0.f ? -1.f : 1.f;
+
+		float norm = 0.f;
+		for (int k = 0; k < 4; k++) {
+			float value = q0[indices[k]]
+				+ (sign * q1[indices[k]] - q0[indices[k]]) * alpha;
+			result[indices[k]] = value;
+			norm += value * value;
+		}
+
+		if (norm > 0.f) {
+			norm = sqrtf(norm);
+			for (int k = 0; k < 4; k++) {
+				result[indices[k]] /= norm;
+			}
+		}
+	}
+
+	return result;
+}
+
+void CharacterEntity::UpdateBoneMatrices(const VectorNf& q_render) {
+	PROFILE_SCOPE("CharacterEntity::UpdateBoneMatrices");
+
+	VectorNd q = q_render;
 	UpdateKinematicsCustom(*mRigModel, &q, nullptr, nullptr);
 
 	for (int i = 0; i < mBoneFrameIndices.size(); ++i) {
@@ -685,31 +783,24 @@ static struct module_state *module_init() {
 	return state;
 }
 
-template <typename Serializer>
-static void module_serialize (
-		struct module_state *state,
-		Serializer* serializer) {
-//	SerializeVec3(*serializer, "protot.TestModule.entity.mPosition", state->character->mPosition);
-}
-
 static void module_finalize(struct module_state *state) {
 	std::cout << "Module finalize called" << std::endl;
 	free(state);
 }
 
+// The module has no state of its own, the character entities are owned
+// and serialized by the modules that create them.
 static void module_reload(struct module_state *state, void* read_serializer) {
 	std::cout << "Module reload called. State: " << state << std::endl;
-	// load the state of the entity
-	if (read_serializer != nullptr) {
-		module_serialize(state, static_cast<ReadSerializer*>(read_serializer));
-	}
 }
 
 static void module_unload(struct module_state *state, void* write_serializer) {
-	// serialize the state of the entity
-	if (write_serializer != nullptr) {
-		module_serialize(state, static_cast<WriteSerializer*>(write_serializer));
-	}
+}
+
+static void module_suspend(struct module_state *state) {
+}
+
+static void module_resume(struct module_state *state) {
 }
 
 static bool module_step(struct module_state *state, float dt) {
@@ -723,6 +814,13 @@ const struct module_api MODULE_API = {
 	.reload = module_reload,
 	.step = module_step,
 	.unload = module_unload,
-	.finalize = module_finalize
+	.finalize = module_finalize,
+	.state_size = sizeof(struct module_state),
+	.state_layout_hash = module_state_layout_hash,
+	.suspend = module_suspend,
+	.resume = module_resume,
+	.step_reads = 0,
+	.step_writes = 0,
+	.step_flags = MODULE_STEP_CONCURRENT
 };
 }
@@ -70,6 +70,15 @@ struct CharacterEntity {
 	std::vector<int> mBoneFrameIndices;
 	RigState mRigState;
 
+	/// Rotation of the entity computed by the simulation
+	Quaternion mRotation = Quaternion (0.0f, 0.0f, 0.0f, 1.0f);
+
+	/// State of the previous simulation step. Rendering interpolates
+	/// between this and the current state.
+	Vector3f mPrevPosition = Vector3f::Zero();
+	Quaternion mPrevRotation = Quaternion (0.0f, 0.0f, 0.0f, 1.0f);
+	RigState mPrevRigState;
+
 	std::vector<IKConstraint> mIKConstraints;
 	RigidBodyDynamics::InverseKinematicsConstraintSet mIKConstraintSet;
 
@@ -92,10 +101,21 @@ struct CharacterEntity {
 	void UpdateIKGizmos();
 	void UpdateIKConstraintSet();
 	void ApplyIKConstraints();
+	void DrawIKConstraints();
+
+	void UpdateBoneMatrices(const VectorNf& q);
+
+	/// Rig pose between mPrevRigState and mRigState. The quaternions of
+	/// spherical joints are interpolated along the shorter arc and
+	/// normalized, all other coordinates linearly.
+	VectorNf InterpolateRigState(float alpha) const;
 
-	void UpdateBoneMatrices();
+	/// Advances the character controller and IK by the fixed time step dt
+	void Simulate(float dt);
 
-	void Update(float dt); 
+	/// Interpolates the render entity between the last two simulation
+	/// states using the weight alpha
+	void Update(float alpha); 
 };
 
 void ShowCharacterPropertiesWindow (CharacterEntity* character);
@@ -0,0 +1,161 @@
+#include "Culling.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+Aabb Aabb::Transformed(const Matrix44f &matrix) const {
+	if (IsEmpty()) {
+		return Aabb();
+	}
+
+	Vector3f center = GetCenter();
+	Vector3f extent = GetExtent();
+
+	Vector3f world_center;
+	Vector3f world_extent;
+	for (int j = 0; j < 3; j++) {
+		world_center[j] = matrix(3, j);
+		world_extent[j] = 0.f;
+		for (int i = 0; i < 3; i++) {
+			world_center[j] += center[i] * matrix(i, j);
+			world_extent[j] += extent[i] * fabsf(matrix(i, j));
+		}
+	}
+
+	return Aabb(world_center - world_extent, world_center + world_extent);
+}
+
+void Frustum::FromViewProjection(const float* view, const float* proj) {
+	// combined matrix m such that clip = (x, y, z, 1) * m
+	float m[16];
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			m[i * 4 + j] = 0.f;
+			for (int k = 0; k < 4; k++) {
+				m[i * 4 + j] += view[i * 4 + k] * proj[k * 4 + j];
+			}
+		}
+	}
+
+	// -w <= x, y <= w and -w <= z <= w. The near plane for a 0..1 depth
+	// range would be z >= 0, the one used here is more conservative.
+	for (int i = 0; i < 4; i++) {
+		mPlanes[0][i] = m[i * 4 + 3] + m[i * 4 + 0];
+		mPlanes[1][i] = m[i * 4 + 3] - m[i * 4 + 0];
+		mPlanes[2][i] = m[i * 4 + 3] + m[i * 4 + 1];
+		mPlanes[3][i] = m[i * 4 + 3] - m[i * 4 + 1];
+		mPlanes[4][i] = m[i * 4 + 3] + m[i * 4 + 2];
+		mPlanes[5][i] = m[i * 4 + 3] - m[i * 4 + 2];
+	}
+}
+
+Frustum::Result Frustum::Test(const Aabb &aabb) const {
+	if (aabb.IsEmpty()) {
+		return Outside;
+	}
+
+	Vector3f center = aabb.GetCenter();
+	Vector3f extent = aabb.GetExtent();
+
+	Result result = Inside;
+	for (int i = 0; i < 6; i++) {
+		const Vector4f& plane = mPlanes[i];
+		float distance = plane[0] * center[0]
+			+ plane[1] * center[1]
+			+ plane[2] * center[2]
+			+ plane[3];
+		float radius = fabsf(plane[0]) * extent[0]
+			+ fabsf(plane[1]) * extent[1]
+			+ fabsf(plane[2]) * extent[2];
+
+		if (distance + radius < 0.f) {
+			return Outside;
+		}
+
+		if (distance - radius < 0.f) {
+			result = Intersect;
+		}
+	}
+
+	return result;
+}
+
+void Bvh::Build(const std::vector<Aabb> &leaf_bounds) {
+	mNodes.clear();
+	mLeafNodes.resize(leaf_bounds.size());
+
+	if (leaf_bounds.size() == 0) {
+		return;
+	}
+
+	std::vector<int> leaves(leaf_bounds.size());
+	for (size_t i = 0; i < leaves.size(); i++) {
+		leaves[i] = i;
+	}
+
+	mNodes.reserve(2 * leaf_bounds.size() - 1);
+	BuildRecursive(leaf_bounds, leaves.data(), leaves.size());
+}
+
+int Bvh::BuildRecursive(
+		const std::vector<Aabb> &leaf_bounds,
+		int* leaves,
+		int count) {
+	int node_index = mNodes.size();
+	mNodes.push_back(Node());
+
+	if (count == 1) {
+		mNodes[node_index].bounds = leaf_bounds[leaves[0]];
+		mNodes[node_index].leaf = leaves[0];
+		mLeafNodes[leaves[0]] = node_index;
+		return node_index;
+	}
+
+	// split at the median of the box centers along the largest axis
+	Aabb center_bounds;
+	for (int i = 0; i < count; i++) {
+		Vector3f center = leaf_bounds[leaves[i]].GetCenter();
+		center_bounds.Add(Aabb(center, center));
+	}
+
+	Vector3f size = center_bounds.mMax - center_bounds.mMin;
+	int axis = 0;
+	if (size[1] > size[axis]) {
+		axis = 1;
+	}
+	if (size[2] > size[axis]) {
+		axis = 2;
+	}
+
+	int half = count / 2;
+	std::nth_element(leaves, leaves + half, leaves + count,
+			[&leaf_bounds, axis](int a, int b) {
+				return leaf_bounds[a].mMin[axis] + leaf_bounds[a].mMax[axis]
+					< leaf_bounds[b].mMin[axis] + leaf_bounds[b].mMax[axis];
+			});
+
+	int left = BuildRecursive(leaf_bounds, leaves, half);
+	int right = BuildRecursive(leaf_bounds, leaves + half, count - half);
+
+	mNodes[node_index].right = right;
+	mNodes[node_index].bounds = mNodes[left].bounds;
+	mNodes[node_index].bounds.Add(mNodes[right].bounds);
+
+	return node_index;
+}
+
+void Bvh::Refit(const std::vector<Aabb> &leaf_bounds) {
+	assert (leaf_bounds.size() == mLeafNodes.size());
+
+	// children have higher indices than their parents
+	for (int i = mNodes.size() - 1; i >= 0; i--) {
+		Node& node = mNodes[i];
+		if (node.leaf >= 0) {
+			node.bounds = leaf_bounds[node.leaf];
+		} else {
+			node.bounds = mNodes[i + 1].bounds;
+			node.bounds.Add(mNodes[node.right].bounds);
+		}
+	}
+}
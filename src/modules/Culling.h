@@ -0,0 +1,135 @@
+#pragma once
+
+#include <vector>
+
+#include "math_types.h"
+
+// Axis aligned bounding box. A default constructed box is empty and
+// becomes valid once a point or another box gets added.
+struct Aabb {
+	Vector3f mMin;
+	Vector3f mMax;
+
+	Aabb() :
+		mMin (1.0e30f, 1.0e30f, 1.0e30f),
+		mMax (-1.0e30f, -1.0e30f, -1.0e30f)
+	{}
+
+	Aabb(const Vector3f &min, const Vector3f &max) :
+		mMin (min),
+		mMax (max)
+	{}
+
+	bool IsEmpty() const {
+		return mMin[0] > mMax[0] || mMin[1] > mMax[1] || mMin[2] > mMax[2];
+	}
+
+	Vector3f GetCenter() const {
+		return (mMin + mMax) * 0.5f;
+	}
+
+	Vector3f GetExtent() const {
+		return (mMax - mMin) * 0.5f;
+	}
+
+	void Add(const Aabb &other) {
+		for (int i = 0; i < 3; i++) {
+			mMin[i] = mMin[i] < other.mMin[i] ? mMin[i] : other.mMin[i];
+			mMax[i] = mMax[i] > other.mMax[i] ? mMax[i] : other.mMax[i];
+		}
+	}
+
+	/// Bounds of this box transformed by matrix (row vector convention as
+	/// used for the bone matrices, i.e. the translation is in the last row)
+	Aabb Transformed(const Matrix44f &matrix) const;
+};
+
+// Frustum given by six planes with normals pointing inwards
+struct Frustum {
+	enum Result {
+		Outside,
+		Intersect,
+		Inside
+	};
+
+	Vector4f mPlanes[6];
+
+	/// Extracts the planes from bx style view and projection matrices
+	void FromViewProjection(const float* view, const float* proj);
+
+	Result Test(const Aabb &aabb) const;
+};
+
+// Bounding volume hierarchy over a set of boxes (the leaves). Building
+// sorts the leaves by a median split along the largest axis; after that
+// the hierarchy only has to be refit when the leaves move.
+struct Bvh {
+	struct Node {
+		Aabb bounds;
+		// index of the leaf for leaf nodes, otherwise -1
+		int leaf = -1;
+		// children of inner nodes. The left child directly follows its
+		// parent, all children have higher indices than their parents.
+		int right = -1;
+	};
+
+	std::vector<Node> mNodes;
+	std::vector<int> mLeafNodes;
+
+	void Build(const std::vector<Aabb> &leaf_bounds);
+	void Refit(const std::vector<Aabb> &leaf_bounds);
+
+	/// Calls callback(leaf, result) for all leaves that are not outside of
+	/// the frustum. Subtrees that are completely inside do not get tested
+	/// any further. Returns the number of tested nodes.
+	template <typename Callback>
+	int Query(const Frustum &frustum, const Callback &callback) const;
+
+	int BuildRecursive(
+			const std::vector<Aabb> &leaf_bounds,
+			int* leaves,
+			int count);
+};
+
+template <typename Callback>
+int Bvh::Query(const Frustum &frustum, const Callback &callback) const {
+	if (mNodes.size() == 0) {
+		return 0;
+	}
+
+	struct StackEntry {
+		int node;
+		bool inside;
+	};
+
+	StackEntry stack[64];
+	int stack_size = 0;
+	int num_tested = 0;
+
+	stack[stack_size++] = StackEntry { 0, false };
+
+	while (stack_size > 0) {
+		StackEntry entry = stack[--stack_size];
+		const Node& node = mNodes[entry.node];
+
+		Frustum::Result result = Frustum::Inside;
+		if (!entry.inside) {
+			result = frustum.Test(node.bounds);
+			num_tested++;
+
+			if (result == Frustum::Outside) {
+				continue;
+			}
+		}
+
+		if (node.leaf >= 0) {
+			callback(node.leaf, result);
+		} else {
+			bool inside = result == Frustum::Inside;
+			stack[stack_size++] = StackEntry { node.right, inside };
+			stack[stack_size++] = StackEntry { entry.node + 1, inside };
+		}
+	}
+
+	return num_tested;
+}
@@ -0,0 +1,594 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <vector>
+
+namespace MeshOptimizer {
+
+static uint32_t HashBytes(const uint8_t* data, uint32_t size) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (uint32_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t WeldVertices(
+		const void* vertices,
+		uint32_t num_vertices,
+		uint32_t stride,
+		uint32_t* remap) {
+	const uint8_t* data = static_cast<const uint8_t*>(vertices);
+
+	// open addressing hash table of the unique vertices, at most half full
+	uint32_t table_size = 1;
+	while (table_size < num_vertices * 2) {
+		table_size *= 2;
+	}
+	std::vector<uint32_t> table(table_size, UINT32_MAX);
+	std::vector<uint32_t> unique_vertices;
+	unique_vertices.reserve(num_vertices);
+
+	for (uint32_t i = 0; i < num_vertices; i++) {
+		const uint8_t* vertex = data + i * stride;
+		uint32_t slot = HashBytes(vertex, stride) & (table_size - 1);
+
+		while (table[slot] != UINT32_MAX) {
+			uint32_t unique = table[slot];
+			if (memcmp(data + unique_vertices[unique] * stride, vertex, stride) == 0) {
+				break;
+			}
+
+			slot = (slot + 1) & (table_size - 1);
+		}
+
+		if (table[slot] == UINT32_MAX) {
+			table[slot] = unique_vertices.size();
+			unique_vertices.push_back(i);
+		}
+
+		remap[i] = table[slot];
+	}
+
+	return unique_vertices.size();
+}
+
+//
+// Forsyth vertex cache optimization
+//
+
+static const uint32_t cCacheSize = 32;
+static const float cCacheDecayPower = 1.5f;
+static const float cLastTriangleScore = 0.75f;
+static const float cValenceBoostScale = 2.0f;
+static const float cValenceBoostPower = 0.5f;
+
+// Whether index k of the triangle repeats an earlier one (degenerate
+// triangles), such vertices are only counted once
+static bool IsRepeatedIndex(const uint32_t* triangle, int k) {
+	return (k > 0 && triangle[k] == triangle[0])
+		|| (k > 1 && triangle[k] == triangle[1]);
+}
+
+static float VertexScore(int cache_position, uint32_t num_active_triangles) {
+	if (num_active_triangles == 0) {
+		// no triangle needs this vertex anymore
+		return -1.0f;
+	}
+
+	float score = 0.0f;
+	if (cache_position >= 0) {
+		if (cache_position < 3) {
+			// vertices of the last triangle get a fixed score such that
+			// their triangles are not preferred too much
+			score = cLastTriangleScore;
+		} else {
+			const float scale = 1.0f / float(cCacheSize - 3);
+			score = powf(1.0f - float(cache_position - 3) * scale, cCacheDecayPower);
+		}
+	}
+
+	// boost vertices with few remaining triangles to get rid of them
+	score += cValenceBoostScale * powf(float(num_active_triangles), -cValenceBoostPower);
+
+	return score;
+}
+
+void OptimizeVertexCache(
+		uint32_t* indices,
+		uint32_t num_indices,
+		uint32_t num_vertices) {
+	assert (num_indices % 3 == 0);
+	uint32_t num_triangles = num_indices / 3;
+	if (num_triangles == 0) {
+		return;
+	}
+
+	// triangles of every vertex
+	std::vector<uint32_t> num_active(num_vertices, 0);
+	for (uint32_t i = 0; i < num_indices; i++) {
+		assert (indices[i] < num_vertices);
+		if (!IsRepeatedIndex(&indices[i - i % 3], i % 3)) {
+			num_active[indices[i]]++;
+		}
+	}
+
+	std::vector<uint32_t> triangle_offsets(num_vertices + 1, 0);
+	for (uint32_t i = 0; i < num_vertices; i++) {
+		triangle_offsets[i + 1] = triangle_offsets[i] + num_active[i];
+	}
+
+	std::vector<uint32_t> vertex_triangles(triangle_offsets[num_vertices]);
+	std::vector<uint32_t> fill(triangle_offsets.begin(), triangle_offsets.end() - 1);
+	for (uint32_t i = 0; i < num_indices; i++) {
+		if (!IsRepeatedIndex(&indices[i - i % 3], i % 3)) {
+			vertex_triangles[fill[indices[i]]++] = i / 3;
+		}
+	}
+
+	std::vector<float> vertex_score(num_vertices);
+	for (uint32_t i = 0; i < num_vertices; i++) {
+		vertex_score[i] = VertexScore(-1, num_active[i]);
+	}
+
+	std::vector<float> triangle_score(num_triangles);
+	std::vector<bool> triangle_added(num_triangles, false);
+	for (uint32_t i = 0; i < num_triangles; i++) {
+		triangle_score[i] = vertex_score[indices[3 * i]]
+			+ vertex_score[indices[3 * i + 1]]
+			+ vertex_score[indices[3 * i + 2]];
+	}
+
+	// simulated LRU cache, three extra entries for the vertices that get
+	// pushed out by a new triangle
+	uint32_t cache[cCacheSize + 3];
+	uint32_t cache_count = 0;
+
+	std::vector<uint32_t> result;
+	result.reserve(num_indices);
+
+	uint32_t best_triangle = std::max_element(triangle_score.begin(), triangle_score.end()) - triangle_score.begin();
+	uint32_t scan_position = 0;
+
+	while (best_triangle != UINT32_MAX) {
+		triangle_added[best_triangle] = true;
+
+		uint32_t new_cache[cCacheSize + 3];
+		uint32_t new_cache_count = 0;
+
+		const uint32_t* triangle = &indices[3 * best_triangle];
+		for (int k = 0; k < 3; k++) {
+			uint32_t v = triangle[k];
+			result.push_back(v);
+			if (IsRepeatedIndex(triangle, k)) {
+				continue;
+			}
+			new_cache[new_cache_count++] = v;
+
+			// remove the triangle from the list of active triangles
+			uint32_t* begin = &vertex_triangles[triangle_offsets[v]];
+			uint32_t* end = begin + num_active[v];
+			uint32_t* it = std::find(begin, end, best_triangle);
+			assert (it != end);
+			std::swap(*it, *(end - 1));
+			num_active[v]--;
+		}
+
+		uint32_t num_added = new_cache_count;
+		for (uint32_t i = 0; i < cache_count; i++) {
+			uint32_t v = cache[i];
+			if (std::find(new_cache, new_cache + num_added, v) == new_cache + num_added) {
+				new_cache[new_cache_count++] = v;
+			}
+		}
+
+		// update the scores of the cached vertices and of the vertices that
+		// dropped out of the cache
+		for (uint32_t i = 0; i < new_cache_count; i++) {
+			uint32_t v = new_cache[i];
+			int position = i < cCacheSize ? int(i) : -1;
+			vertex_score[v] = VertexScore(position, num_active[v]);
+		}
+
+		// the next triangle is the best one that uses a cached vertex
+		best_triangle = UINT32_MAX;
+		float best_score = -1.0f;
+		for (uint32_t i = 0; i < new_cache_count; i++) {
+			uint32_t v = new_cache[i];
+			for (uint32_t j = 0; j < num_active[v]; j++) {
+				uint32_t t = vertex_triangles[triangle_offsets[v] + j];
+				float score = vertex_score[indices[3 * t]]
+					+ vertex_score[indices[3 * t + 1]]
+					+ vertex_score[indices[3 * t + 2]];
+				triangle_score[t] = score;
+
+				if (score > best_score) {
+					best_score = score;
+					best_triangle = t;
+				}
+			}
+		}
+
+		cache_count = std::min(new_cache_count, cCacheSize);
+		memcpy(cache, new_cache, cache_count * sizeof(uint32_t));
+
+		// no cached vertex has remaining triangles: continue with the
+		// first triangle that was not added yet
+		if (best_triangle == UINT32_MAX) {
+			while (scan_position < num_triangles && triangle_added[scan_position]) {
+				scan_position++;
+			}
+
+			if (scan_position < num_triangles) {
+				best_triangle = scan_position;
+			}
+		}
+	}
+
+	assert (result.size() == num_indices);
+	memcpy(indices, result.data(), num_indices * sizeof(uint32_t));
+}
+
+uint32_t OptimizeVertexFetch(
+		uint32_t* indices,
+		uint32_t num_indices,
+		uint32_t num_vertices,
+		uint32_t* remap) {
+	std::fill(remap, remap + num_vertices, UINT32_MAX);
+
+	uint32_t next_vertex = 0;
+	for (uint32_t i = 0; i < num_indices; i++) {
+		uint32_t v = indices[i];
+		assert (v < num_vertices);
+
+		if (remap[v] == UINT32_MAX) {
+			remap[v] = next_vertex++;
+		}
+		indices[i] = remap[v];
+	}
+
+	return next_vertex;
+}
+
+//
+// Quadric error simplification
+//
+
+// Symmetric 4x4 matrix of the squared distances to a set of planes
+struct Quadric {
+	double a2, ab, ac, ad;
+	double b2, bc, bd;
+	double c2, cd;
+	double d2;
+
+	Quadric() :
+		a2(0.), ab(0.), ac(0.), ad(0.),
+		b2(0.), bc(0.), bd(0.),
+		c2(0.), cd(0.),
+		d2(0.)
+	{}
+
+	void AddPlane(double a, double b, double c, double d, double weight) {
+		a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+		b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+		c2 += weight * c * c; cd += weight * c * d;
+		d2 += weight * d * d;
+	}
+
+	void Add(const Quadric& other) {
+		a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+		b2 += other.b2; bc += other.bc; bd += other.bd;
+		c2 += other.c2; cd += other.cd;
+		d2 += other.d2;
+	}
+
+	double Evaluate(const float* p) const {
+		double x = p[0], y = p[1], z = p[2];
+		double result = a2 * x * x + 2. * ab * x * y + 2. * ac * x * z + 2. * ad * x
+			+ b2 * y * y + 2. * bc * y * z + 2. * bd * y
+			+ c2 * z * z + 2. * cd * z
+			+ d2;
+		return result > 0. ? result : 0.;
+	}
+};
+
+// open borders must not shrink, their planes get a larger weight
+static const double cBoundaryWeight = 10.;
+// collapses that rotate a triangle normal by more than ~80 degrees are
+// rejected
+static const float cMinNormalDot = 0.2f;
+
+struct Collapse {
+	double cost;
+	uint32_t from;
+	uint32_t to;
+	uint32_t from_version;
+	uint32_t to_version;
+
+	bool operator<(const Collapse& other) const {
+		// std::priority_queue is a max heap
+		return cost > other.cost;
+	}
+};
+
+static void TriangleNormal(const float* a, const float* b, const float* c, float result[3]) {
+	float e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	float e1[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+	result[0] = e0[1] * e1[2] - e0[2] * e1[1];
+	result[1] = e0[2] * e1[0] - e0[0] * e1[2];
+	result[2] = e0[0] * e1[1] - e0[1] * e1[0];
+}
+
+uint32_t SimplifyMesh(
+		uint32_t* indices,
+		uint32_t num_indices,
+		const float* positions,
+		uint32_t num_vertices,
+		uint32_t target_num_indices,
+		uint32_t* source_triangles,
+		float* error) {
+	assert (num_indices % 3 == 0);
+	uint32_t num_triangles = num_indices / 3;
+
+	std::vector<Quadric> quadrics(num_vertices);
+	std::vector<std::vector<uint32_t> > vertex_triangles(num_vertices);
+	std::vector<bool> triangle_alive(num_triangles, true);
+	uint32_t num_alive = num_indices;
+
+	// plane quadrics weighted by the triangle area
+	for (uint32_t t = 0; t < num_triangles; t++) {
+		const uint32_t* triangle = &indices[3 * t];
+		const float* p0 = &positions[3 * triangle[0]];
+
+		// triangles that reference a vertex twice are invisible
+		if (triangle[0] == triangle[1] || triangle[1] == triangle[2] || triangle[0] == triangle[2]) {
+			triangle_alive[t] = false;
+			num_alive -= 3;
+			continue;
+		}
+
+		float n[3];
+		TriangleNormal(p0, &positions[3 * triangle[1]], &positions[3 * triangle[2]], n);
+		double length = sqrt(double(n[0]) * n[0] + double(n[1]) * n[1] + double(n[2]) * n[2]);
+		if (length > 0.) {
+			double a = n[0] / length, b = n[1] / length, c = n[2] / length;
+			double d = -(a * p0[0] + b * p0[1] + c * p0[2]);
+			for (int k = 0; k < 3; k++) {
+				quadrics[triangle[k]].AddPlane(a, b, c, d, length * 0.5);
+			}
+		}
+
+		for (int k = 0; k < 3; k++) {
+			vertex_triangles[triangle[k]].push_back(t);
+		}
+	}
+
+	// boundary edges only belong to a single triangle
+	std::vector<std::pair<uint64_t, uint32_t> > edges;
+	edges.reserve(num_indices);
+	for (uint32_t t = 0; t < num_triangles; t++) {
+		if (!triangle_alive[t]) {
+			continue;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			uint32_t a = indices[3 * t + k];
+			uint32_t b = indices[3 * t + (k + 1) % 3];
+			uint64_t key = a < b ? (uint64_t(a) << 32 | b) : (uint64_t(b) << 32 | a);
+			edges.push_back(std::make_pair(key, 3 * t + k));
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+
+	for (size_t i = 0; i < edges.size(); i++) {
+		bool shared = (i > 0 && edges[i - 1].first == edges[i].first)
+			|| (i + 1 < edges.size() && edges[i + 1].first == edges[i].first);
+		if (shared) {
+			continue;
+		}
+
+		// plane through the edge perpendicular to the triangle
+		uint32_t corner = edges[i].second;
+		uint32_t t = corner / 3;
+		const float* pa = &positions[3 * indices[corner]];
+		const float* pb = &positions[3 * indices[3 * t + (corner % 3 + 1) % 3]];
+		const float* pc = &positions[3 * indices[3 * t + (corner % 3 + 2) % 3]];
+
+		float n[3];
+		TriangleNormal(pa, pb, pc, n);
+		double e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+		double plane[3] = {
+			e[1] * n[2] - e[2] * n[1],
+			e[2] * n[0] - e[0] * n[2],
+			e[0] * n[1] - e[1] * n[0]
+		};
+		double length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+		if (length == 0.) {
+			continue;
+		}
+
+		double a = plane[0] / length, b = plane[1] / length, c = plane[2] / length;
+		double d = -(a * pa[0] + b * pa[1] + c * pa[2]);
+		double weight = cBoundaryWeight * (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+		quadrics[indices[corner]].AddPlane(a, b, c, d, weight);
+		quadrics[indices[3 * t + (corner % 3 + 1) % 3]].AddPlane(a, b, c, d, weight);
+	}
+
+	std::vector<uint32_t> versions(num_vertices, 0);
+	std::vector<bool> vertex_alive(num_vertices, true);
+	std::priority_queue<Collapse> queue;
+
+	auto push_collapse = [&](uint32_t from, uint32_t to) {
+		Quadric q = quadrics[from];
+		q.Add(quadrics[to]);
+
+		Collapse collapse;
+		collapse.cost = q.Evaluate(&positions[3 * to]);
+		collapse.from = from;
+		collapse.to = to;
+		collapse.from_version = versions[from];
+		collapse.to_version = versions[to];
+		queue.push(collapse);
+	};
+
+	for (uint32_t i = 0; i < num_indices; i++) {
+		uint32_t a = indices[i];
+		uint32_t b = indices[i - i % 3 + (i + 1) % 3];
+		if (triangle_alive[i / 3]) {
+			push_collapse(a, b);
+			push_collapse(b, a);
+		}
+	}
+
+	double max_error = 0.;
+
+	while (num_alive > target_num_indices && !queue.empty()) {
+		Collapse collapse = queue.top();
+		queue.pop();
+
+		uint32_t from = collapse.from;
+		uint32_t to = collapse.to;
+		if (!vertex_alive[from] || !vertex_alive[to]
+				|| versions[from] != collapse.from_version
+				|| versions[to] != collapse.to_version) {
+			continue;
+		}
+
+		// moving from onto to must not flip any of the remaining triangles
+		bool valid = true;
+		bool connected = false;
+		const float* p_to = &positions[3 * to];
+		for (uint32_t t : vertex_triangles[from]) {
+			if (!triangle_alive[t]) {
+				continue;
+			}
+
+			const uint32_t* triangle = &indices[3 * t];
+			if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+				connected = true;
+				continue;
+			}
+
+			const float* p[3];
+			const float* q[3];
+			for (int k = 0; k < 3; k++) {
+				p[k] = &positions[3 * triangle[k]];
+				q[k] = triangle[k] == from ? p_to : p[k];
+			}
+
+			float n0[3], n1[3];
+			TriangleNormal(p[0], p[1], p[2], n0);
+			TriangleNormal(q[0], q[1], q[2], n1);
+			float dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+			float l0 = sqrtf(n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]);
+			float l1 = sqrtf(n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]);
+			if (l0 > 0.f && (l1 == 0.f || dot < cMinNormalDot * l0 * l1)) {
+				valid = false;
+				break;
+			}
+		}
+
+		if (!valid || !connected) {
+			continue;
+		}
+
+		// collapse
+		vertex_alive[from] = false;
+		quadrics[to].Add(quadrics[from]);
+		versions[to]++;
+		max_error = std::max(max_error, collapse.cost);
+
+		for (uint32_t t : vertex_triangles[from]) {
+			if (!triangle_alive[t]) {
+				continue;
+			}
+
+			uint32_t* triangle = &indices[3 * t];
+			if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+				triangle_alive[t] = false;
+				num_alive -= 3;
+				continue;
+			}
+
+			for (int k = 0; k < 3; k++) {
+				if (triangle[k] == from) {
+					triangle[k] = to;
+				}
+			}
+			vertex_triangles[to].push_back(t);
+		}
+		std::vector<uint32_t>().swap(vertex_triangles[from]);
+
+		// drop removed triangles and update the collapses around to
+		std::vector<uint32_t>& to_triangles = vertex_triangles[to];
+		to_triangles.erase(std::remove_if(to_triangles.begin(), to_triangles.end(),
+					[&](uint32_t t) { return !triangle_alive[t]; }),
+				to_triangles.end());
+
+		for (uint32_t t : to_triangles) {
+			for (int k = 0; k < 3; k++) {
+				uint32_t v = indices[3 * t + k];
+				if (v != to) {
+					push_collapse(v, to);
+					push_collapse(to, v);
+				}
+			}
+		}
+	}
+
+	// compact the remaining triangles
+	uint32_t result = 0;
+	for (uint32_t t = 0; t < num_triangles; t++) {
+		if (!triangle_alive[t]) {
+			continue;
+		}
+
+		if (source_triangles != nullptr) {
+			source_triangles[result / 3] = t;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			indices[result + k] = indices[3 * t + k];
+		}
+		result += 3;
+	}
+
+	if (error != nullptr) {
+		*error = float(max_error);
+	}
+
+	return result;
+}
+
+float ComputeACMR(
+		const uint32_t* indices,
+		uint32_t num_indices,
+		uint32_t num_vertices,
+		uint32_t cache_size) {
+	if (num_indices < 3) {
+		return 0.0f;
+	}
+
+	// time stamp of the vertices when they entered the FIFO cache
+	std::vector<uint32_t> timestamps(num_vertices, 0);
+	uint32_t time = cache_size + 1;
+	uint32_t num_misses = 0;
+
+	for (uint32_t i = 0; i < num_indices; i++) {
+		uint32_t v = indices[i];
+		if (time - timestamps[v] > cache_size) {
+			timestamps[v] = time++;
+			num_misses++;
+		}
+	}
+
+	return float(num_misses) / float(num_indices / 3);
+}
+
+}
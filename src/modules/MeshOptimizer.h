@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+
+// Indexing and vertex cache optimization of triangle lists.
+//
+// Usage:
+//
+//   std::vector<uint32_t> remap(num_vertices);
+//   uint32_t num_unique = MeshOptimizer::WeldVertices(
+//       vertices, num_vertices, stride, remap.data());
+//   // indices of the unindexed triangle list are remap[0 .. num_vertices)
+//   MeshOptimizer::OptimizeVertexCache(indices, num_indices, num_unique);
+//   MeshOptimizer::OptimizeVertexFetch(indices, num_indices, num_unique, remap.data());
+//   // vertex i of the welded mesh moves to remap[i]
+namespace MeshOptimizer {
+	// size of the simulated post-transform cache used by ComputeACMR()
+	static const uint32_t cDefaultCacheSize = 16;
+
+	/// Finds vertices with identical data (compared bytewise). remap[i] is
+	/// set to the index of vertex i in the list of unique vertices, which
+	/// keeps the order of first occurrence. Returns the number of unique
+	/// vertices.
+	uint32_t WeldVertices(
+			const void* vertices,
+			uint32_t num_vertices,
+			uint32_t stride,
+			uint32_t* remap);
+
+	/// Reorders the triangles for a better post-transform vertex cache hit
+	/// rate ("Linear-Speed Vertex Cache Optimisation", Tom Forsyth).
+	void OptimizeVertexCache(
+			uint32_t* indices,
+			uint32_t num_indices,
+			uint32_t num_vertices);
+
+	/// Renumbers the vertices in the order they are first referenced by
+	/// the indices. remap[i] is set to the new index of vertex i, unused
+	/// vertices get UINT32_MAX. Returns the number of referenced vertices.
+	uint32_t OptimizeVertexFetch(
+			uint32_t* indices,
+			uint32_t num_indices,
+			uint32_t num_vertices,
+			uint32_t* remap);
+
+	/// Simplifies the triangle list by quadric error edge collapses
+	/// ("Surface Simplification Using Quadric Error Metrics", Garland and
+	/// Heckbert) until at most target_num_indices indices remain or no
+	/// collapse is possible without flipping triangles. Vertices only get
+	/// collapsed onto other vertices such that their attributes stay
+	/// valid. positions contains three floats per vertex.
+	///
+	/// The remaining triangles are written to the front of indices and the
+	/// new number of indices is returned. If source_triangles is set it
+	/// receives the original index of every remaining triangle. error
+	/// receives the largest quadric error of all collapses.
+	uint32_t SimplifyMesh(
+			uint32_t* indices,
+			uint32_t num_indices,
+			const float* positions,
+			uint32_t num_vertices,
+			uint32_t target_num_indices,
+			uint32_t* source_triangles = nullptr,
+			float* error = nullptr);
+
+	/// Average cache miss ratio: the number of vertex shader invocations
+	/// per triangle for a FIFO cache of the given size. Ranges from 3 (no
+	/// reuse at all) down to about 0.5 for regular grids.
+	float ComputeACMR(
+			const uint32_t* indices,
+			uint32_t num_indices,
+			uint32_t num_vertices,
+			uint32_t cache_size = cDefaultCacheSize);
+}
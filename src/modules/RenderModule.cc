@@ -30,8 +30,11 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 
 #include "Serializer.h"
+#include "Timer.h"
+#include "Profiler.h"
 
 using namespace std;
 
@@ -48,9 +51,20 @@ struct module_state {
 	Renderer *renderer;
 };
 
+// Without a window (headless mode) the renderer keeps its view size which
+// defaults to 800x600.
+static void get_view_size(Renderer* renderer, int* width, int* height) {
+	if (gWindow != nullptr) {
+		glfwGetWindowSize(gWindow, width, height);
+		return;
+	}
+
+	*width = renderer->view_width > 1 ? renderer->view_width : 800;
+	*height = renderer->view_height > 1 ? renderer->view_height : 600;
+}
+
 static struct module_state *module_init() {
 	gLog ("RenderModule init called.");
-	assert (gWindow != nullptr && "Cannot initialize renderer module without gWindow!");
 
 	module_state *state = (module_state*) malloc(sizeof(*state));
 	state->renderer = new Renderer();
@@ -59,19 +73,51 @@ static struct module_state *module_init() {
 	return state;
 }
 
+// Matrices and GPU resources get recreated by the renderer and are
+// therefore not serialized.
+static const SerializerField cCameraFields[] = {
+	SERIALIZER_FIELD(Camera, eye),
+	SERIALIZER_FIELD(Camera, poi),
+	SERIALIZER_FIELD(Camera, up),
+	SERIALIZER_FIELD(Camera, near),
+	SERIALIZER_FIELD(Camera, far),
+	SERIALIZER_FIELD(Camera, fov),
+	SERIALIZER_FIELD(Camera, orthographic)
+};
+
+static const SerializerField cLightFields[] = {
+	SERIALIZER_FIELD(Light, pos),
+	SERIALIZER_FIELD(Light, dir),
+	SERIALIZER_FIELD(Light, shadowMapBias),
+	SERIALIZER_FIELD(Light, enabled),
+	SERIALIZER_FIELD(Light, near),
+	SERIALIZER_FIELD(Light, far),
+	SERIALIZER_FIELD(Light, area)
+};
+
 template <typename Serializer>
 static void module_serialize (
 		struct module_state *state,
 		Serializer* serializer) {
-	// get the state from the serializer
-	Camera* camera = &gRenderer->cameras[gRenderer->activeCameraIndex];
-	assert (camera != nullptr);
+	SerializeBool (*serializer, SERIALIZER_KEY("protot.RenderModule.draw_floor"), gRenderer->drawFloor);
+	SerializeBool (*serializer, SERIALIZER_KEY("protot.RenderModule.draw_skybox"), gRenderer->drawSkybox);
+	SerializeBool (*serializer, SERIALIZER_KEY("protot.RenderModule.debug_enabled"), gRenderer->drawDebug);
+	SerializedUint16 (*serializer, SERIALIZER_KEY("protot.RenderModule.active_camera_index"), gRenderer->activeCameraIndex);
+
+	// cameras are plain values and get resized to the serialized count,
+	// the lights own GPU resources and were created by
+	// Renderer::initialize()
+	SerializeStructs (*serializer, SERIALIZER_KEY("protot.RenderModule.cameras"),
+			gRenderer->cameras, cCameraFields);
+	if (gRenderer->cameras.size() == 0) {
+		gRenderer->cameras.push_back(Camera());
+	}
+	SerializeStructs (*serializer, SERIALIZER_KEY("protot.RenderModule.lights"),
+			gRenderer->lights.data(), gRenderer->lights.size(), cLightFields);
 
-	SerializeBool (*serializer, "protot.RenderModule.draw_floor", gRenderer->drawFloor);
-	SerializeBool (*serializer, "protot.RenderModule.draw_skybox", gRenderer->drawSkybox);
-	SerializeBool (*serializer, "protot.RenderModule.debug_enabled", gRenderer->drawDebug);
-	SerializeVec3 (*serializer, "protot.RenderModule.camera.eye", camera->eye);
-	SerializeVec3 (*serializer, "protot.RenderModule.camera.poi", camera->poi);
+	if (gRenderer->activeCameraIndex >= gRenderer->cameras.size()) {
+		gRenderer->activeCameraIndex = 0;
+	}
 }
 
 static void module_finalize(struct module_state *state) {
@@ -85,12 +131,11 @@ static void module_finalize(struct module_state *state) {
 
 static void module_reload(struct module_state *state, void *read_serializer) {
 	gLog ("RenderModule reload called");
-	assert (gWindow != nullptr);
+	assert (state != nullptr);
 	int width, height;
-	glfwGetWindowSize(gWindow, &width, &height);
+	get_view_size(state->renderer, &width, &height);
 
 	gLog ("Renderer initialize");
-	assert (state != nullptr);
 	state->renderer->initialize(width, height);
 	gRenderer = state->renderer;
 
@@ -120,11 +165,10 @@ static void module_unload(struct module_state *state, void* write_serializer) {
 
 static bool module_step(struct module_state *state, float dt) {
 	int width, height;
-	assert (gWindow != nullptr);
-	glfwGetWindowSize(gWindow, &width, &height);
+	get_view_size(state->renderer, &width, &height);
 	state->renderer->updateShaders();
 
-	bgfx::reset (width, height);
+	bgfx::reset (width, height, state->renderer->resetFlags);
 
 	int dock_top_offset = 20.0f;
 	int dock_width = 400;
@@ -149,10 +193,125 @@ const struct module_api MODULE_API = {
 	.reload = module_reload,
 	.step = module_step,
 	.unload = module_unload,
-	.finalize = module_finalize
+	.finalize = module_finalize,
+	.step_reads = MODULE_RESOURCE_ENTITIES | MODULE_RESOURCE_CAMERAS 
+		| MODULE_RESOURCE_DEBUG_COMMANDS | MODULE_RESOURCE_TIMER,
+	.step_writes = MODULE_RESOURCE_DEBUG_COMMANDS | MODULE_RESOURCE_GUI,
+	.step_flags = MODULE_STEP_CONCURRENT | MODULE_STEP_MAIN_THREAD
 };
 }
 
+void SkeletonMeshes::UpdateBounds() {
+	mWorldBounds.resize(mMeshBoneIndices.size());
+	mBounds = Aabb();
+
+	for (size_t i = 0; i < mMeshBoneIndices.size(); i++) {
+		const Mesh* mesh = mMeshBoneIndices[i].first;
+		Aabb mesh_bounds (mesh->mBoundsMin, mesh->mBoundsMax);
+
+		mWorldBounds[i] = mesh_bounds.Transformed(GetBoneMatrix(i));
+		mBounds.Add(mWorldBounds[i]);
+	}
+}
+
+bool SkeletonMeshes::UpdateSkinnedMesh(bgfxutils::MeshVertexFormat format) {
+	for (int i = 0; i < Length(); i++) {
+		if (GetMesh(i)->mCpuDataReleased) {
+			gLog ("Warning: cannot create skinned mesh, mesh vertex data was released");
+			return false;
+		}
+	}
+
+	if (mOwnsSkinnedMesh) {
+		delete mSkinnedMesh;
+	}
+	mSkinnedMesh = nullptr;
+	mOwnsSkinnedMesh = false;
+	mSkinnedBones.clear();
+
+	Mesh* skinned_mesh = new Mesh();
+
+	for (int i = 0; i < Length(); i++) {
+		const Mesh* mesh = GetMesh(i);
+		int bone = mMeshBoneIndices[i].second;
+
+		// skinning matrix of the bone
+		std::vector<int>::iterator it = std::find(mSkinnedBones.begin(), mSkinnedBones.end(), bone);
+		uint8_t bone_index = it - mSkinnedBones.begin();
+		if (it == mSkinnedBones.end()) {
+			if (mSkinnedBones.size() == cMaxSkinnedBones) {
+				gLog ("Warning: cannot create skinned mesh, meshes are attached to more than %d bones", cMaxSkinnedBones);
+				mSkinnedBones.clear();
+				delete skinned_mesh;
+				return false;
+			}
+			mSkinnedBones.push_back(bone);
+		}
+
+		skinned_mesh->Merge(*mesh);
+		skinned_mesh->mBoneIndices.resize(skinned_mesh->mVertices.size(), bone_index);
+	}
+
+	if (skinned_mesh->mVertices.size() == 0) {
+		mSkinnedBones.clear();
+		delete skinned_mesh;
+		return false;
+	}
+
+	skinned_mesh->UpdateBounds();
+	skinned_mesh->mVertexFormat = format;
+	skinned_mesh->Update();
+	if (skinned_mesh->mBgfxMesh == nullptr) {
+		mSkinnedBones.clear();
+		delete skinned_mesh;
+		return false;
+	}
+
+	mSkinnedMesh = skinned_mesh;
+	mOwnsSkinnedMesh = true;
+
+	return true;
+}
+
+static size_t meshCpuDataSize(const Mesh* mesh) {
+	size_t result = mesh->mVertices.capacity() * sizeof(Vector4f)
+		+ mesh->mNormals.capacity() * sizeof(Vector3f)
+		+ mesh->mColors.capacity() * sizeof(Vector4f)
+		+ mesh->mBoneIndices.capacity() * sizeof(uint8_t);
+
+	for (const Mesh* lod : mesh->mLods) {
+		result += meshCpuDataSize(lod);
+	}
+
+	return result;
+}
+
+size_t SkeletonMeshes::ReleaseCpuData() {
+	size_t result = 0;
+
+	for (Mesh* mesh : mOwnedMeshes) {
+		result += meshCpuDataSize(mesh);
+		mesh->ReleaseCpuData();
+	}
+
+	if (mOwnsSkinnedMesh && mSkinnedMesh != nullptr) {
+		result += meshCpuDataSize(mSkinnedMesh);
+		mSkinnedMesh->ReleaseCpuData();
+	}
+
+	return result;
+}
+
+void SkeletonMeshes::SetSharedSkinnedMesh(const SkeletonMeshes& other) {
+	if (mOwnsSkinnedMesh) {
+		delete mSkinnedMesh;
+	}
+
+	mSkinnedMesh = other.mSkinnedMesh;
+	mSkinnedBones = other.mSkinnedBones;
+	mOwnsSkinnedMesh = false;
+}
+
 void Skeleton::UpdateMatrices(const Matrix44f &world_transform) {
 	for (uint32_t i = 0; i < mBoneMatrices.size(); ++i) {
 		Matrix44f parent_matrix (world_transform);
@@ -174,6 +333,9 @@ bgfx::IndexBufferHandle plane_ibh;
 bgfx::UniformHandle u_time;
 bgfx::UniformHandle u_color;
 bgfx::UniformHandle u_line_params;
+// decoding of the packed vertex formats, see Mesh::mDecode
+bgfx::UniformHandle u_meshDecode;
+static const float sMeshDecodeIdentity[8] = { 1.f, 1.f, 1.f, 0.f, 0.f, 0.f, 0.f, 0.f };
 
 bgfx::UniformHandle u_mtx;
 bgfx::UniformHandle u_exposure;
@@ -490,6 +652,54 @@ RenderState s_renderStates[RenderState::Count] = {
 		0,
 		RenderProgram(),
 		RenderState::Debug
+	},
+	{ // ShadowMapInstanced
+		0
+		| BGFX_STATE_RGB_WRITE
+		| BGFX_STATE_ALPHA_WRITE
+		| BGFX_STATE_DEPTH_WRITE
+		| BGFX_STATE_DEPTH_TEST_LESS
+		| BGFX_STATE_CULL_CW
+		| BGFX_STATE_MSAA,
+		0,
+		RenderProgram(),
+		RenderState::ShadowMap
+	},
+	{ // SceneInstanced
+		0
+		| BGFX_STATE_RGB_WRITE
+		| BGFX_STATE_ALPHA_WRITE
+		| BGFX_STATE_DEPTH_WRITE
+		| BGFX_STATE_DEPTH_TEST_LESS
+		| BGFX_STATE_CULL_CW
+		| BGFX_STATE_MSAA,
+		0,
+		RenderProgram(),
+		RenderState::Scene
+	},
+	{ // ShadowMapSkinned
+		0
+		| BGFX_STATE_RGB_WRITE
+		| BGFX_STATE_ALPHA_WRITE
+		| BGFX_STATE_DEPTH_WRITE
+		| BGFX_STATE_DEPTH_TEST_LESS
+		| BGFX_STATE_CULL_CW
+		| BGFX_STATE_MSAA,
+		0,
+		RenderProgram(),
+		RenderState::ShadowMap
+	},
+	{ // SceneSkinned
+		0
+		| BGFX_STATE_RGB_WRITE
+		| BGFX_STATE_ALPHA_WRITE
+		| BGFX_STATE_DEPTH_WRITE
+		| BGFX_STATE_DEPTH_TEST_LESS
+		| BGFX_STATE_CULL_CW
+		| BGFX_STATE_MSAA,
+		0,
+		RenderProgram(),
+		RenderState::Scene
 	}
 };
 
@@ -951,6 +1161,183 @@ void Path::UpdateBuffers() {
 	assert (bgfx::isValid(mIndexBufferHandle));
 }
 
+StreamingPath::StreamingPath(uint32_t capacity) {
+	// without 32 bit indices all vertices have to be addressable with 16 bits
+	if (capacity * 2 > UINT16_MAX
+			&& 0 == (bgfx::getCaps()->supported & BGFX_CAPS_INDEX32)) {
+		gLog ("Warning: 32 bit indices not supported, limiting path capacity to %d points", UINT16_MAX / 2);
+		capacity = UINT16_MAX / 2;
+	}
+
+	assert (capacity > 1);
+	mCapacity = capacity;
+	mVertices = new PathVertex[2 * mCapacity];
+
+	mVertexBufferHandle = bgfx::createDynamicVertexBuffer(
+			2 * mCapacity,
+			PathVertex::ms_decl
+			);
+
+	// segment i connects slot i with slot i + 1, the last one wraps around
+	bool index32 = mCapacity * 2 > UINT16_MAX;
+	uint32_t num_indices = 6 * mCapacity;
+	const bgfx::Memory* mem = bgfx::alloc(num_indices * (index32 ? sizeof(uint32_t) : sizeof(uint16_t)));
+	for (uint32_t i = 0; i < mCapacity; i++) {
+		uint32_t j = 2 * i;
+		uint32_t k = 2 * ((i + 1) % mCapacity);
+		uint32_t segment[6] = { j + 0, j + 1, k + 0, k + 0, j + 1, k + 1 };
+
+		for (int l = 0; l < 6; l++) {
+			if (index32) {
+				reinterpret_cast<uint32_t*>(mem->data)[6 * i + l] = segment[l];
+			} else {
+				reinterpret_cast<uint16_t*>(mem->data)[6 * i + l] = uint16_t(segment[l]);
+			}
+		}
+	}
+
+	mIndexBufferHandle = bgfx::createIndexBuffer(mem, index32 ? BGFX_BUFFER_INDEX32 : BGFX_BUFFER_NONE);
+}
+
+StreamingPath::~StreamingPath() {
+	if (bgfx::isValid(mVertexBufferHandle))
+		bgfx::destroyDynamicVertexBuffer(mVertexBufferHandle);
+
+	if (bgfx::isValid(mIndexBufferHandle))
+		bgfx::destroyIndexBuffer(mIndexBufferHandle);
+
+	delete[] mVertices;
+}
+
+void StreamingPath::Append(const Vector3f &point, const Vector4f &color) {
+	uint32_t slot = mHead;
+	uint32_t prev_slot = (slot + mCapacity - 1) % mCapacity;
+
+	if (mCount > 0) {
+		mLength += (point - mLastPoint).norm();
+	}
+
+	PathVertex& vertex = mVertices[2 * slot];
+	memcpy (vertex.position, point.data(), sizeof(float) * 3);
+	memcpy (vertex.prev, (mCount > 0 ? mLastPoint : point).data(), sizeof(float) * 3);
+	memcpy (vertex.next, point.data(), sizeof(float) * 3);
+	memcpy (vertex.color, color.data(), sizeof(float) * 4);
+	vertex.info[0] = -1.0f;
+	vertex.info[1] = mLength;
+	mVertices[2 * slot + 1] = vertex;
+	mVertices[2 * slot + 1].info[0] = 1.0f;
+	MarkDirty(slot);
+
+	// the previous point is no longer the end of the path
+	if (mCount > 0) {
+		memcpy (mVertices[2 * prev_slot].next, point.data(), sizeof(float) * 3);
+		memcpy (mVertices[2 * prev_slot + 1].next, point.data(), sizeof(float) * 3);
+		MarkDirty(prev_slot);
+	}
+
+	mHead = (slot + 1) % mCapacity;
+	mLastPoint = point;
+
+	if (mCount < mCapacity) {
+		mCount++;
+	} else {
+		// the oldest point got overwritten, the next one starts the path
+		uint32_t oldest = mHead;
+		memcpy (mVertices[2 * oldest].prev, mVertices[2 * oldest].position, sizeof(float) * 3);
+		memcpy (mVertices[2 * oldest + 1].prev, mVertices[2 * oldest].position, sizeof(float) * 3);
+		MarkDirty(oldest);
+	}
+}
+
+void StreamingPath::Clear() {
+	mHead = 0;
+	mCount = 0;
+	mLength = 0.f;
+	mDirtySlots.clear();
+	mAllDirty = false;
+}
+
+void StreamingPath::MarkDirty(uint32_t slot) {
+	if (mAllDirty) {
+		return;
+	}
+
+	if (mDirtySlots.size() >= mCapacity) {
+		mAllDirty = true;
+		mDirtySlots.clear();
+		return;
+	}
+
+	mDirtySlots.push_back(slot);
+}
+
+void StreamingPath::UpdateBuffers() {
+	if (mAllDirty) {
+		uint32_t num_slots = mCount < mCapacity ? mCount : mCapacity;
+		if (num_slots > 0) {
+			bgfx::updateDynamicVertexBuffer(
+					mVertexBufferHandle,
+					0,
+					bgfx::copy(mVertices, sizeof(PathVertex) * 2 * num_slots)
+					);
+		}
+		mAllDirty = false;
+		return;
+	}
+
+	if (mDirtySlots.size() == 0) {
+		return;
+	}
+
+	std::sort(mDirtySlots.begin(), mDirtySlots.end());
+
+	// upload runs of consecutive slots
+	size_t begin = 0;
+	while (begin < mDirtySlots.size()) {
+		size_t end = begin + 1;
+		while (end < mDirtySlots.size()
+				&& mDirtySlots[end] <= mDirtySlots[end - 1] + 1) {
+			end++;
+		}
+
+		uint32_t first_slot = mDirtySlots[begin];
+		uint32_t num_slots = mDirtySlots[end - 1] - first_slot + 1;
+		bgfx::updateDynamicVertexBuffer(
+				mVertexBufferHandle,
+				2 * first_slot,
+				bgfx::copy(
+					&mVertices[2 * first_slot],
+					sizeof(PathVertex) * 2 * num_slots
+					)
+				);
+
+		begin = end;
+	}
+
+	mDirtySlots.clear();
+}
+
+int StreamingPath::GetIndexRanges(uint32_t first[2], uint32_t num[2]) const {
+	if (mCount < 2) {
+		return 0;
+	}
+
+	uint32_t oldest = mCount < mCapacity ? 0 : mHead;
+	uint32_t num_segments = mCount - 1;
+
+	if (oldest + num_segments <= mCapacity) {
+		first[0] = 6 * oldest;
+		num[0] = 6 * num_segments;
+		return 1;
+	}
+
+	first[0] = 6 * oldest;
+	num[0] = 6 * (mCapacity - oldest);
+	first[1] = 0;
+	num[1] = 6 * (num_segments - (mCapacity - oldest));
+	return 2;
+}
+
 void Renderer::setupShaders() {
 	// Create uniforms
 	sceneDefaultTextureSampler = bgfx::createUniform("sceneDefaultTexture", bgfx::UniformType::Int1);
@@ -996,6 +1383,7 @@ void Renderer::setupShaders() {
 	u_time = bgfx::createUniform("u_time", bgfx::UniformType::Vec4);
 	u_color = bgfx::createUniform("u_color", bgfx::UniformType::Vec4);
 	u_line_params = bgfx::createUniform("u_line_params", bgfx::UniformType::Vec4);
+	u_meshDecode = bgfx::createUniform("u_meshDecode", bgfx::UniformType::Vec4, 2);
 
 	m_timeOffset = bx::getHPCounter();
 
@@ -1037,6 +1425,17 @@ void Renderer::setupShaders() {
 		s_renderStates[RenderState::Scene].m_program = RenderProgram("shaders/src/vs_sms_mesh.sc",   "shaders/src/fs_sms_mesh.sc");
 		s_renderStates[RenderState::SceneTextured].m_program = RenderProgram("shaders/src/vs_sms_mesh_textured.sc",   "shaders/src/fs_sms_mesh_textured.sc");
 
+		// Instanced entity meshes. Without instancing support the programs
+		// stay invalid and the entities are drawn one by one.
+		if (0 != (caps->supported & BGFX_CAPS_INSTANCING)) {
+			s_renderStates[RenderState::ShadowMapInstanced].m_program = RenderProgram("shaders/src/vs_sms_mesh_instanced.sc", "shaders/src/fs_sms_shadow.sc");
+			s_renderStates[RenderState::SceneInstanced].m_program = RenderProgram("shaders/src/vs_sms_mesh_instanced.sc", "shaders/src/fs_sms_mesh_instanced.sc");
+		}
+
+		// Merged character meshes with rigid skinning
+		s_renderStates[RenderState::ShadowMapSkinned].m_program = RenderProgram("shaders/src/vs_sms_mesh_skinned.sc", "shaders/src/fs_sms_shadow.sc");
+		s_renderStates[RenderState::SceneSkinned].m_program = RenderProgram("shaders/src/vs_sms_mesh_skinned.sc", "shaders/src/fs_sms_mesh.sc");
+
 		lights[0].shadowMapTexture= bgfx::createTexture2D(lights[0].shadowMapSize, lights[0].shadowMapSize, false, 1, bgfx::TextureFormat::D16, BGFX_TEXTURE_COMPARE_LEQUAL);
 		bgfx::TextureHandle fbtextures[] = { lights[0].shadowMapTexture };
 		lights[0].shadowMapFB = bgfx::createFrameBuffer(BX_COUNTOF(fbtextures), fbtextures, true);
@@ -1044,9 +1443,10 @@ void Renderer::setupShaders() {
 	else
 	{
 		// Depth textures and shadow samplers are not supported. Use float
-		// depth packing into color buffer instead.
-		s_renderStates[RenderState::ShadowMap].m_program.program = bgfxutils::loadProgram("vs_sms_shadow_pd", "fs_sms_shadow_pd");
-		s_renderStates[RenderState::Scene].m_program.program = bgfxutils::loadProgram("vs_sms_mesh",      "fs_sms_mesh_pd");
+		// depth packing into color buffer instead. The vertex shaders are
+		// compiled from source as they decode the packed vertex formats.
+		s_renderStates[RenderState::ShadowMap].m_program = RenderProgram("shaders/src/vs_sms_shadow_pd.sc", "shaders/src/fs_sms_shadow_pd.sc");
+		s_renderStates[RenderState::Scene].m_program = RenderProgram("shaders/src/vs_sms_mesh.sc", "shaders/src/fs_sms_mesh_pd.sc");
 		s_renderStates[RenderState::SceneTextured].m_program.program = bgfxutils::loadProgram("vs_sms_mesh_textured",      "fs_sms_mesh_pd_textured");
 
 		lights[0].shadowMapTexture = bgfx::createTexture2D(lights[0].shadowMapSize, lights[0].shadowMapSize, false, 1, bgfx::TextureFormat::BGRA8, BGFX_TEXTURE_RT);
@@ -1069,6 +1469,12 @@ void Renderer::setupRenderPasses() {
 	// ShadowMap
 	s_renderStates[RenderState::ShadowMap].m_viewId = RenderState::ShadowMap;
 
+	// Views that are drawn by the render queue get submitted in the order
+	// of the queue
+	bgfx::setViewSeq(RenderState::ShadowMap, true);
+	bgfx::setViewSeq(RenderState::Scene, true);
+	bgfx::setViewSeq(RenderState::SceneTextured, true);
+
 	// Scene
 	s_renderStates[RenderState::Scene].m_viewId  = RenderState::Scene;
 	s_renderStates[RenderState::Scene].m_numTextures = 1;
@@ -1101,6 +1507,30 @@ void Renderer::setupRenderPasses() {
 
 	// Debug
 	s_renderStates[RenderState::Debug].m_viewId = RenderState::Debug;
+
+	// ShadowMapInstanced: same view as ShadowMap
+	s_renderStates[RenderState::ShadowMapInstanced].m_viewId = RenderState::ShadowMap;
+
+	// SceneInstanced: same view and shadow map texture as Scene
+	s_renderStates[RenderState::SceneInstanced].m_viewId = RenderState::Scene;
+	s_renderStates[RenderState::SceneInstanced].m_numTextures = 1;
+
+	s_renderStates[RenderState::SceneInstanced].m_textures[0].m_flags = UINT32_MAX;
+	s_renderStates[RenderState::SceneInstanced].m_textures[0].m_stage = 0;
+	s_renderStates[RenderState::SceneInstanced].m_textures[0].m_sampler = lights[0].u_shadowMap;
+	s_renderStates[RenderState::SceneInstanced].m_textures[0].m_texture = lights[0].shadowMapTexture;
+
+	// ShadowMapSkinned: same view as ShadowMap
+	s_renderStates[RenderState::ShadowMapSkinned].m_viewId = RenderState::ShadowMap;
+
+	// SceneSkinned: same view and shadow map texture as Scene
+	s_renderStates[RenderState::SceneSkinned].m_viewId = RenderState::Scene;
+	s_renderStates[RenderState::SceneSkinned].m_numTextures = 1;
+
+	s_renderStates[RenderState::SceneSkinned].m_textures[0].m_flags = UINT32_MAX;
+	s_renderStates[RenderState::SceneSkinned].m_textures[0].m_stage = 0;
+	s_renderStates[RenderState::SceneSkinned].m_textures[0].m_sampler = lights[0].u_shadowMap;
+	s_renderStates[RenderState::SceneSkinned].m_textures[0].m_texture = lights[0].shadowMapTexture;
 }
 
 // void Renderer::setupWindowX11 (Display* x11_display, int x11_window_id) {
@@ -1171,10 +1601,8 @@ void Renderer::initialize(int width, int height) {
 	this->view_height = height;
 
 	uint32_t debug = BGFX_DEBUG_TEXT;
-	uint32_t reset = BGFX_RESET_VSYNC;
-
-	reset = BGFX_RESET_VSYNC | BGFX_RESET_MAXANISOTROPY | BGFX_RESET_MSAA_X16;
-	bgfx::reset(view_width, view_height, reset);
+	resetFlags = BGFX_RESET_VSYNC | BGFX_RESET_MAXANISOTROPY | BGFX_RESET_MSAA_X16;
+	bgfx::reset(view_width, view_height, resetFlags);
 
 	bgfx::setViewClear(0
 			, BGFX_CLEAR_COLOR|BGFX_CLEAR_DEPTH
@@ -1231,6 +1659,7 @@ void Renderer::shutdown() {
 	bgfx::destroyUniform(u_time);
 	bgfx::destroyUniform(u_color);
 	bgfx::destroyUniform(u_line_params);
+	bgfx::destroyUniform(u_meshDecode);
 
 	for (uint8_t ii = 0; ii < RenderState::Count; ++ii) {
 		if (bgfx::isValid(s_renderStates[ii].m_program.program)) {
@@ -1247,6 +1676,11 @@ void Renderer::shutdown() {
 		entities[i] = NULL;
 	}
 
+	for (size_t i = 0; i < streamingPaths.size(); i++) {
+		delete streamingPaths[i];
+	}
+	streamingPaths.clear();
+
 	for (size_t i = 0; i < lights.size(); i++) {
 		gLog ("Destroying light uniforms for light %d", i);
 		bgfx::destroyFrameBuffer(lights[i].shadowMapFB);
@@ -1278,6 +1712,8 @@ void Renderer::resize (int x, int y, int width, int height) {
 }
 
 void Renderer::paintGL() {
+	PROFILE_SCOPE("Renderer::paintGL");
+
 	int64_t now = bx::getHPCounter();
 	static int64_t last = now;
 	const int64_t frameTime = now - last;
@@ -1294,6 +1730,18 @@ void Renderer::paintGL() {
 	// debug font is 8 pixels wide
 	int num_chars = view_width / 8;
 	bgfx::dbgTextPrintf(num_chars - 18, 0, 0x0f, "Frame: % 7.3f[ms]", double(frameTime)*toMs);
+	bgfx::dbgTextPrintf(num_chars - 18, 1, 0x0f, "p50:   % 7.3f[ms]", gTimer->mFrameTimeP50 * 1000.0);
+	bgfx::dbgTextPrintf(num_chars - 18, 2, 0x0f, "p95:   % 7.3f[ms]", gTimer->mFrameTimeP95 * 1000.0);
+	bgfx::dbgTextPrintf(num_chars - 18, 3, 0x0f, "p99:   % 7.3f[ms]", gTimer->mFrameTimeP99 * 1000.0);
+	bgfx::dbgTextPrintf(num_chars - 18, 4, 0x0f, "Draws: % 7d", entityStats.numDrawCalls);
+	bgfx::dbgTextPrintf(num_chars - 18, 5, 0x0f, "Subm:  % 7.3f[ms]", entityStats.submitTime * 1000.0);
+	bgfx::dbgTextPrintf(num_chars - 18, 6, 0x0f, "Meshes:% 7d", cullingStats.numMeshes);
+	bgfx::dbgTextPrintf(num_chars - 18, 7, 0x0f, "Scene: % 7d", cullingStats.numVisibleScene);
+	bgfx::dbgTextPrintf(num_chars - 18, 8, 0x0f, "Shadow:% 7d", cullingStats.numVisibleShadowMap);
+	bgfx::dbgTextPrintf(num_chars - 18, 9, 0x0f, "Nodes: % 7d", cullingStats.numNodesTested);
+	bgfx::dbgTextPrintf(num_chars - 18, 10, 0x0f, "Cull:  % 7.3f[ms]", cullingStats.cullTime * 1000.0);
+	bgfx::dbgTextPrintf(num_chars - 18, 11, 0x0f, "Queue: % 7.3f[ms]", renderQueue.mStats.flushTime * 1000.0);
+	bgfx::dbgTextPrintf(num_chars - 18, 12, 0x0f, "Tris:  % 7d", entityStats.numTriangles);
 
 	// This dummy draw call is here to make sure that view 0 is cleared
 	// if no other draw calls are submitted to view 0.
@@ -1306,6 +1754,7 @@ void Renderer::paintGL() {
 
 	// lights: update view and projection matrices and shadow map parameters
 	for (uint32_t i = 0; i < lights.size(); i++) {
+		PROFILE_SCOPE("Light");
 		bgfx::setUniform(lights[i].u_lightPos, lights[i].pos.data());
 		float shadow_map_params[4];
 		shadow_map_params[0] = static_cast<float>(lights[i].shadowMapSize);
@@ -1423,6 +1872,8 @@ void Renderer::paintGL() {
 	//
 
 	if (drawSkybox) {
+		PROFILE_SCOPE("Skybox");
+
 		// Skybox pass
 		memcpy (IBL::uniforms.m_cameraPos, cameras[activeCameraIndex].eye.data(), 3 * sizeof(float));
 
@@ -1450,8 +1901,9 @@ void Renderer::paintGL() {
 
 	if (drawFloor)
 	{
+		PROFILE_SCOPE("Floor");
+
 		// render the plane
-		uint32_t cached = bgfx::setTransform(mtxFloor);
 		for (uint32_t pass = 0; pass < RenderState::Count; ++pass) {
 			// Only draw plane textured or during the shadow map passes
 			if (pass != RenderState::SceneTextured
@@ -1463,24 +1915,14 @@ void Renderer::paintGL() {
 				continue;
 			}
 
-			bgfx::setTransform(cached);
-			for (uint8_t tex = 0; tex < st.m_numTextures; ++tex)
-			{
-				const RenderState::Texture& texture = st.m_textures[tex];
-				bgfx::setTexture(texture.m_stage
-						, texture.m_sampler
-						, texture.m_texture
-						, texture.m_flags
-						);
-			}
-
-			bgfx::setUniform(lights[0].u_lightMtx, lightMtx);
-			bgfx::setUniform(lights[0].u_lightPos, lights[0].pos.data());
-			bgfx::setUniform(u_color, Vector4f(1.f, 1.f, 1.f, 1.f).data(), 4);
-			bgfx::setIndexBuffer(plane_ibh);
-			bgfx::setVertexBuffer(plane_vbh);
-			bgfx::setState(st.m_state);
-			bgfx::submit(st.m_viewId, st.m_program.program);
+			// the floor covers most of the views, draw it after the
+			// entities
+			renderQueue.SetTransform(mtxFloor);
+			renderQueue.SetUniform(lights[0].u_lightMtx, lightMtx);
+			renderQueue.SetUniform(lights[0].u_lightPos, lights[0].pos.data());
+			renderQueue.SetUniform(u_color, Vector4f(1.f, 1.f, 1.f, 1.f).data());
+			renderQueue.SetUniform(u_meshDecode, sMeshDecodeIdentity, 2);
+			renderQueue.Submit(&st, plane_vbh, plane_ibh, 1.0e30f);
 		}
 	}
 
@@ -1489,55 +1931,41 @@ void Renderer::paintGL() {
 	//
 		
 	// render entities
-	for (size_t i = 0; i < entities.size(); i++) {
-		float mtxLightViewProjInv[16];
-		float light_pos_world[3];
-		
-		// shadow map pass
-		for (uint32_t j = 0; j < entities[i]->mSkeletonMeshes.Length(); ++j) {
-			bx::mtxMul(
-					lightMtx, 
-					entities[i]->mSkeletonMeshes.GetBoneMatrix(j).data(),
-					lights[0].mtxShadow
-					);
-			bgfx::setUniform(lights[0].u_lightMtx, lightMtx);
-			entities[i]->mSkeletonMeshes.GetMesh(j)->Submit(
-					&s_renderStates[RenderState::ShadowMap],
-					entities[i]->mSkeletonMeshes.GetBoneMatrix(j).data()
-					);
+	{
+		PROFILE_SCOPE("Entities");
+
+		updateEntityVisibility();
+
+		int64_t submit_start = bx::getHPCounter();
+		entityStats.numDrawCalls = 0;
+		entityStats.numInstances = 0;
+		entityStats.numTriangles = 0;
+
+		const bgfx::Caps* caps = bgfx::getCaps();
+		bool instanced = drawInstanced
+				&& 0 != (caps->supported & BGFX_CAPS_INSTANCING)
+				&& isValid(s_renderStates[RenderState::ShadowMapInstanced].m_program.program)
+				&& isValid(s_renderStates[RenderState::SceneInstanced].m_program.program);
+
+		if (drawSkinned
+				&& isValid(s_renderStates[RenderState::ShadowMapSkinned].m_program.program)
+				&& isValid(s_renderStates[RenderState::SceneSkinned].m_program.program)) {
+			submitEntitiesSkinned(instanced);
+		} else if (instanced) {
+			submitEntitiesInstanced();
+		} else {
+			submitEntities();
 		}
 
-		// scene pass
-		for (uint32_t j = 0; j < entities[i]->mSkeletonMeshes.Length(); ++j) {
-			bx::mtxMul(
-					lightMtx, 
-					entities[i]->mSkeletonMeshes.GetBoneMatrix(j).data(),
-					lights[0].mtxShadow
-					);
-
-			// compute world position of the light
-			Vector4f light_pos4 (
-					lights[0].pos[0],
-					lights[0].pos[1],
-					lights[0].pos[2],
-					1.0f
-					);
-			Vector4f light_pos = 
-				entities[i]->mSkeletonMeshes.GetBoneMatrix(j)
-				* light_pos4;
-
-			bgfx::setUniform(lights[0].u_lightPos, light_pos.data());
-			bgfx::setUniform(u_color, entities[i]->mColor.data());
-			bgfx::setUniform(lights[0].u_lightMtx, lightMtx);
-			entities[i]->mSkeletonMeshes.GetMesh(j)->Submit(
-					&s_renderStates[RenderState::Scene],
-					entities[i]->mSkeletonMeshes.GetBoneMatrix(j).data()
-					);
-		}
+		entityStats.submitTime = double(bx::getHPCounter() - submit_start) / freq;
 	}
 
+	renderQueue.Flush();
+
 	// render debug information
 	if (drawDebug) {
+		PROFILE_SCOPE("Debug");
+
 		float tmp[16];
 
 		// render light frustums 
@@ -1575,78 +2003,8 @@ void Renderer::paintGL() {
 		}
 
 		// debug commands
-		bgfx::setUniform(u_color, Vector4f(1.0f, 1.0f, 1.0f, 1.f).data(), 4);
-
-		// assemble lines for alls debug lines
-		debugPaths.resize(debugCommands.size());
-		for (uint32_t i = 0; i < debugCommands.size(); i++) {
-			Path &line = debugPaths[i];
-
-			if (debugCommands[i].type == DebugCommand::Line) {
-				line.points.clear();
-				line.colors.clear();
-
-				line.points.push_back(debugCommands[i].from);
-				line.colors.push_back(debugCommands[i].color);
-
-				line.points.push_back(debugCommands[i].to);
-				line.colors.push_back(debugCommands[i].color);
-
-				line.UpdateBuffers();
-			} else if (debugCommands[i].type == DebugCommand::Circle) {
-				line.points.clear();
-				line.colors.clear();
-				float radius = debugCommands[i].radius;
-				float c,s,angle;
-
-				// construct an orthogonal vector from the normal.
-				Vector3f plane1 (
-						debugCommands[i].to[1] - debugCommands[i].to[2],
-						debugCommands[i].to[0],
-						-debugCommands[i].to[0]
-						);
-				plane1.normalize();
-				Vector3f plane2 = debugCommands[i].to.cross(plane1);
-
-				const int cNumSegments = 64;
-				for (uint32_t j = 0; j < cNumSegments; j++) {
-					angle = M_PI * 0.5f + 2. * M_PI * static_cast<float>(j) / static_cast<float>(cNumSegments - 1);
-
-					s = sin(angle) * radius;
-					c = cos(angle) * radius;
-
-					line.points.push_back(debugCommands[i].from + plane1 * s + plane2 * c);
-					line.colors.push_back(debugCommands[i].color);
-				}
-
-				line.UpdateBuffers();
-			}
-
-			float thickness = 0.05143f;
-			float miter = 0.0f;
-			float aspect = static_cast<float>(view_width) / static_cast<float>(view_height);
-
-			Vector4f params (thickness, miter, aspect, 0.0f);
-
-			// submit data to regular lines state
-			const RenderState& st = s_renderStates[RenderState::Lines];
-
-			bgfx::setUniform(u_line_params, params.data(), 1);
-			bgfx::setIndexBuffer(line.mIndexBufferHandle);
-			bgfx::setVertexBuffer(line.mVertexBufferHandle);
-			bgfx::setState(st.m_state);
-			bgfx::submit(st.m_viewId, st.m_program.program);
-
-			// submit data to state LinesOccluded
-			bgfx::setState(s_renderStates[RenderState::LinesOccluded].m_state);
-			bgfx::setUniform(u_line_params, params.data(), 1);
-			bgfx::setIndexBuffer(line.mIndexBufferHandle);
-			bgfx::setVertexBuffer(line.mVertexBufferHandle);
-				bgfx::submit(
-					s_renderStates[RenderState::LinesOccluded].m_viewId,
-					s_renderStates[RenderState::LinesOccluded].m_program.program
-					);
-		}
+		submitDebugCommands();
+		submitStreamingPaths();
 	}
 
 	// Advance to next frame. Rendering thread will be kicked to
@@ -1679,6 +2037,32 @@ void Renderer::paintGL() {
 		ImGui::Checkbox("Draw Floor", &drawFloor);
 		ImGui::Checkbox("Draw Skybox", &drawSkybox);
 		ImGui::Checkbox("Draw Debug", &drawDebug);
+		ImGui::Checkbox("Draw Instanced", &drawInstanced);
+		ImGui::Checkbox("Draw Skinned", &drawSkinned);
+		ImGui::Checkbox("Frustum Culling", &cullEntities);
+		ImGui::Checkbox("Use LODs", &useLods);
+		ImGui::SliderFloat("LOD Pixel Size", &lodPixelSize, 16.f, 1024.f);
+
+		ImGui::Text("Debug primitives: %d, %d vertices, %d draw calls, %d dropped",
+				debugStats.numCommands,
+				debugStats.numVertices,
+				debugStats.numDrawCalls,
+				debugStats.numDropped);
+
+		const RenderQueue::Stats& queue_stats = renderQueue.mStats;
+		ImGui::Text("Render queue: %d draws, %d state changes, %d texture changes",
+				queue_stats.numDraws,
+				queue_stats.numStateChanges,
+				queue_stats.numTextureChanges);
+		ImGui::Text("Uniforms: %d set, %d skipped, flush %.3f ms",
+				queue_stats.numUniforms,
+				queue_stats.numSkippedUniforms,
+				queue_stats.flushTime * 1000.);
+		ImGui::Text("Entity draw calls: %d (%d meshes), %d triangles, submit %.3f ms",
+				entityStats.numDrawCalls,
+				entityStats.numInstances,
+				entityStats.numTriangles,
+				entityStats.submitTime * 1000.);
 
 		for (int i = 0; i < lights.size(); i++) {
 			ImGui::SliderFloat("Bias", 
@@ -1696,6 +2080,8 @@ void Renderer::paintGL() {
 }
 
 bool Renderer::updateShaders() {
+	PROFILE_SCOPE("Renderer::updateShaders");
+
 	bool result = true;
 	for (int i = 0; i < RenderState::Count; i++) {
 		RenderState& st = s_renderStates[i];
@@ -1704,6 +2090,7 @@ bool Renderer::updateShaders() {
 				&& st.m_program.fragmentShaderFileName!= ""
 			 ) {
 			if (st.m_program.checkModified()) {
+				PROFILE_SCOPE("ReloadShader");
 				bool load_success = st.m_program.reload();
 
 				// if so far everything was successful but this one failed
@@ -1717,6 +2104,624 @@ bool Renderer::updateShaders() {
 	return true;
 }
 
+// Updates the world space bounds of all entities and determines the
+// meshes that are visible in the scene and the shadow map pass
+void Renderer::updateEntityVisibility() {
+	PROFILE_SCOPE("Culling");
+
+	int64_t cull_start = bx::getHPCounter();
+
+	entityBounds.resize(entities.size());
+	for (size_t i = 0; i < entities.size(); i++) {
+		entities[i]->mSkeletonMeshes.UpdateBounds();
+		entityBounds[i] = entities[i]->mSkeletonMeshes.mBounds;
+	}
+
+	// the bounds follow the animation, so the hierarchy gets refit every
+	// frame. Skipping frames would cull with outdated bounds.
+	if (entityBvhEntities != entities) {
+		entityBvh.Build(entityBounds);
+		entityBvhEntities = entities;
+	} else {
+		entityBvh.Refit(entityBounds);
+	}
+
+	Frustum scene_frustum;
+	scene_frustum.FromViewProjection(
+			cameras[activeCameraIndex].mtxView,
+			cameras[activeCameraIndex].mtxProj);
+
+	Frustum shadow_frustum;
+	shadow_frustum.FromViewProjection(lights[0].mtxView, lights[0].mtxProj);
+
+	// the light projection is orthographic, hence the shadow map LOD only
+	// depends on the world size of the meshes and not on their distance
+	LodView& shadow_lod_view = lodViews[LodViewShadowMap];
+	bx::mtxMul(shadow_lod_view.viewProj, lights[0].mtxView, lights[0].mtxProj);
+	shadow_lod_view.pixelScale = lights[0].mtxProj[5] * lights[0].shadowMapSize;
+	shadow_lod_view.orthographic = true;
+
+	LodView& scene_lod_view = lodViews[LodViewScene];
+	bx::mtxMul(scene_lod_view.viewProj,
+			cameras[activeCameraIndex].mtxView,
+			cameras[activeCameraIndex].mtxProj);
+	scene_lod_view.pixelScale = cameras[activeCameraIndex].mtxProj[5] * view_height;
+	scene_lod_view.orthographic = cameras[activeCameraIndex].orthographic;
+
+	cullingStats.numNodesTested = 0;
+	if (cullEntities) {
+		entitySceneVisibility.assign(entities.size(), Frustum::Outside);
+		entityShadowVisibility.assign(entities.size(), Frustum::Outside);
+
+		cullingStats.numNodesTested += entityBvh.Query(scene_frustum,
+				[this](int leaf, Frustum::Result result) {
+					entitySceneVisibility[leaf] = result;
+				});
+		cullingStats.numNodesTested += entityBvh.Query(shadow_frustum,
+				[this](int leaf, Frustum::Result result) {
+					entityShadowVisibility[leaf] = result;
+				});
+	} else {
+		entitySceneVisibility.assign(entities.size(), Frustum::Inside);
+		entityShadowVisibility.assign(entities.size(), Frustum::Inside);
+	}
+
+	// meshes of entities that intersect a frustum are tested individually
+	meshInstances.clear();
+	cullingStats.numMeshes = 0;
+	cullingStats.numVisibleScene = 0;
+	cullingStats.numVisibleShadowMap = 0;
+
+	for (size_t i = 0; i < entities.size(); i++) {
+		const SkeletonMeshes& skeleton_meshes = entities[i]->mSkeletonMeshes;
+		cullingStats.numMeshes += skeleton_meshes.Length();
+
+		uint8_t scene_visibility = entitySceneVisibility[i];
+		uint8_t shadow_visibility = entityShadowVisibility[i];
+		if (scene_visibility == Frustum::Outside
+				&& shadow_visibility == Frustum::Outside) {
+			continue;
+		}
+
+		for (int j = 0; j < skeleton_meshes.Length(); ++j) {
+			const Aabb& bounds = skeleton_meshes.mWorldBounds[j];
+			uint8_t passes = 0;
+
+			if (scene_visibility == Frustum::Inside
+					|| (scene_visibility == Frustum::Intersect
+						&& scene_frustum.Test(bounds) != Frustum::Outside)) {
+				passes |= EntityPassScene;
+				cullingStats.numVisibleScene++;
+			}
+
+			if (shadow_visibility == Frustum::Inside
+					|| (shadow_visibility == Frustum::Intersect
+						&& shadow_frustum.Test(bounds) != Frustum::Outside)) {
+				passes |= EntityPassShadowMap;
+				cullingStats.numVisibleShadowMap++;
+			}
+
+			if (passes != 0) {
+				MeshInstance instance = { skeleton_meshes.GetMesh(j), entities[i], j, passes };
+				meshInstances.push_back(instance);
+			}
+		}
+	}
+
+	cullingStats.cullTime = double(bx::getHPCounter() - cull_start) / double(bx::getHPFrequency());
+}
+
+// Returns the LOD of the mesh for the given view (LodViewIndex) based on
+// the projected size of the bounding sphere of its world bounds
+const Mesh* Renderer::selectLod(const Mesh* mesh, const Aabb& bounds, int view) const {
+	if (!useLods || mesh->mLods.size() == 0) {
+		return mesh;
+	}
+
+	const LodView& lod_view = lodViews[view];
+	const float radius = bounds.GetExtent().norm();
+	float pixels = radius * lod_view.pixelScale;
+
+	if (!lod_view.orthographic) {
+		const Vector3f center = bounds.GetCenter();
+		const float* m = lod_view.viewProj;
+		float w = center[0] * m[3] + center[1] * m[7] + center[2] * m[11] + m[15];
+
+		// the eye is within the sphere
+		if (w <= radius) {
+			return mesh;
+		}
+
+		pixels /= w;
+	}
+
+	if (pixels >= lodPixelSize) {
+		return mesh;
+	}
+
+	int level = pixels > 0.f
+		? static_cast<int>(2.f * log2f(lodPixelSize / pixels))
+		: mesh->GetNumLods();
+
+	return mesh->GetLod(level);
+}
+
+// Submits the shadow map and/or scene pass of a single bone mesh
+void Renderer::submitEntityMesh(const Entity* entity, int index, uint8_t passes) {
+	const Matrix44f bone_matrix = entity->mSkeletonMeshes.GetBoneMatrix(index);
+	const Mesh* full_mesh = entity->mSkeletonMeshes.GetMesh(index);
+	const Aabb& bounds = entity->mSkeletonMeshes.mWorldBounds[index];
+
+	float lightMtx[16];
+	bx::mtxMul(
+			lightMtx, 
+			bone_matrix.data(),
+			lights[0].mtxShadow
+			);
+
+	// sort front to back as seen from the light and the camera
+	const Vector3f center = bounds.GetCenter();
+
+	// shadow map pass
+	if (passes & EntityPassShadowMap) {
+		const Mesh* mesh = selectLod(full_mesh, bounds, LodViewShadowMap);
+		renderQueue.SetTransform(bone_matrix.data());
+		renderQueue.SetUniform(lights[0].u_lightMtx, lightMtx);
+		renderQueue.SetUniform(u_meshDecode, mesh->mDecode, 2);
+		mesh->Enqueue(
+				&renderQueue,
+				&s_renderStates[RenderState::ShadowMap],
+				(center - lights[0].pos).squaredNorm()
+				);
+		entityStats.numDrawCalls++;
+		entityStats.numTriangles += mesh->mBuildStats.numIndices / 3;
+	}
+
+	// scene pass
+	if (passes & EntityPassScene) {
+		// compute world position of the light
+		Vector4f light_pos4 (
+				lights[0].pos[0],
+				lights[0].pos[1],
+				lights[0].pos[2],
+				1.0f
+				);
+		Vector4f light_pos = bone_matrix * light_pos4;
+
+		const Mesh* mesh = selectLod(full_mesh, bounds, LodViewScene);
+		renderQueue.SetTransform(bone_matrix.data());
+		renderQueue.SetUniform(lights[0].u_lightPos, light_pos.data());
+		renderQueue.SetUniform(u_color, entity->mColor.data());
+		renderQueue.SetUniform(lights[0].u_lightMtx, lightMtx);
+		renderQueue.SetUniform(u_meshDecode, mesh->mDecode, 2);
+		mesh->Enqueue(
+				&renderQueue,
+				&s_renderStates[RenderState::Scene],
+				(center - cameras[activeCameraIndex].eye).squaredNorm()
+				);
+		entityStats.numDrawCalls++;
+		entityStats.numTriangles += mesh->mBuildStats.numIndices / 3;
+	}
+
+	entityStats.numInstances++;
+}
+
+void Renderer::submitEntities() {
+	for (size_t i = 0; i < meshInstances.size(); i++) {
+		const MeshInstance& instance = meshInstances[i];
+		submitEntityMesh(instance.entity, instance.index, instance.passes);
+	}
+}
+
+// Per instance data of the instanced entity shaders (i_data0 - i_data4)
+struct EntityInstanceData {
+	float mtx[16];
+	float color[4];
+};
+
+// Groups the visible bone meshes of every pass by their LOD mesh and
+// submits each group as one instanced draw call. The model matrix and the
+// color of the entity are passed as instance data.
+void Renderer::submitEntitiesInstanced() {
+	// the instanced shaders transform into world space using the
+	// instance data, hence the light uniforms are the same for all draws
+	const uint8_t passes[2] = { EntityPassShadowMap, EntityPassScene };
+	const int pass_lod_views[2] = { LodViewShadowMap, LodViewScene };
+	const RenderState* pass_states[2] = {
+		&s_renderStates[RenderState::ShadowMapInstanced],
+		&s_renderStates[RenderState::SceneInstanced]
+	};
+	const Vector3f pass_eyes[2] = { lights[0].pos, cameras[activeCameraIndex].eye };
+	const uint16_t stride = sizeof(EntityInstanceData);
+
+	entityStats.numInstances += meshInstances.size();
+
+	for (int pass = 0; pass < 2; pass++) {
+		passInstances.clear();
+		for (size_t k = 0; k < meshInstances.size(); k++) {
+			const MeshInstance& instance = meshInstances[k];
+			if (instance.passes & passes[pass]) {
+				const Aabb& bounds = instance.entity->mSkeletonMeshes.mWorldBounds[instance.index];
+				PassInstance pass_instance = {
+					selectLod(instance.mesh, bounds, pass_lod_views[pass]),
+					static_cast<uint32_t>(k)
+				};
+				passInstances.push_back(pass_instance);
+			}
+		}
+
+		std::sort(passInstances.begin(), passInstances.end(),
+				[](const PassInstance& a, const PassInstance& b) {
+					return a.mesh < b.mesh;
+				});
+
+		size_t begin = 0;
+		while (begin < passInstances.size()) {
+			const Mesh* mesh = passInstances[begin].mesh;
+			size_t end = begin + 1;
+			while (end < passInstances.size() && passInstances[end].mesh == mesh) {
+				end++;
+			}
+
+			size_t first = begin;
+			while (first < end) {
+				uint32_t num = bgfx::getAvailInstanceDataBuffer(end - first, stride);
+				if (num == 0) {
+					break;
+				}
+
+				const bgfx::InstanceDataBuffer* idb = bgfx::allocInstanceDataBuffer(num, stride);
+				EntityInstanceData* data = reinterpret_cast<EntityInstanceData*>(idb->data);
+				float depth = 1.0e30f;
+				for (uint32_t k = 0; k < num; k++) {
+					const MeshInstance& instance = meshInstances[passInstances[first + k].instance];
+					const Matrix44f bone_matrix = instance.entity->mSkeletonMeshes.GetBoneMatrix(instance.index);
+					memcpy(data[k].mtx, bone_matrix.data(), sizeof(data[k].mtx));
+					memcpy(data[k].color, instance.entity->mColor.data(), sizeof(data[k].color));
+
+					const Vector3f center = instance.entity->mSkeletonMeshes.mWorldBounds[instance.index].GetCenter();
+					depth = std::min(depth, (center - pass_eyes[pass]).squaredNorm());
+				}
+
+				renderQueue.SetInstanceDataBuffer(idb);
+				renderQueue.SetUniform(lights[0].u_lightMtx, lights[0].mtxShadow);
+				renderQueue.SetUniform(lights[0].u_lightPos, lights[0].pos.data());
+				renderQueue.SetUniform(u_meshDecode, mesh->mDecode, 2);
+				mesh->Enqueue(&renderQueue, pass_states[pass], depth);
+
+				entityStats.numDrawCalls++;
+				entityStats.numTriangles += num * (mesh->mBuildStats.numIndices / 3);
+				first += num;
+			}
+
+			// instance data buffer exhausted: draw the remaining meshes of
+			// this group one by one
+			for (; first < end; first++) {
+				const MeshInstance& instance = meshInstances[passInstances[first].instance];
+				submitEntityMesh(instance.entity, instance.index, passes[pass]);
+				entityStats.numInstances--;
+			}
+
+			begin = end;
+		}
+	}
+}
+
+// Submits the merged mesh of an entity with all bone matrices as
+// skinning matrices. Returns false if the entity has no skinned mesh.
+bool Renderer::submitEntitySkinned(const Entity* entity, uint8_t passes) {
+	static_assert (sizeof(Matrix44f) == 16 * sizeof(float),
+			"bone matrices have to be uploaded as one array");
+
+	const SkeletonMeshes& skeleton_meshes = entity->mSkeletonMeshes;
+	if (skeleton_meshes.mSkinnedMesh == nullptr) {
+		return false;
+	}
+
+	skinMatrices.resize(skeleton_meshes.mSkinnedBones.size());
+	for (size_t i = 0; i < skeleton_meshes.mSkinnedBones.size(); i++) {
+		skinMatrices[i] = entity->mSkeleton.mBoneMatrices[skeleton_meshes.mSkinnedBones[i]];
+	}
+	uint16_t num_matrices = skinMatrices.size();
+
+	// the skinned shaders transform into world space, hence the light
+	// uniforms do not depend on the bones
+	const Aabb& bounds = skeleton_meshes.mBounds;
+	const Vector3f center = bounds.GetCenter();
+
+	// shadow map pass
+	if (passes & EntityPassShadowMap) {
+		const Mesh* mesh = selectLod(skeleton_meshes.mSkinnedMesh, bounds, LodViewShadowMap);
+		renderQueue.SetTransform(skinMatrices[0].data(), num_matrices);
+		renderQueue.SetUniform(lights[0].u_lightMtx, lights[0].mtxShadow);
+		renderQueue.SetUniform(u_meshDecode, mesh->mDecode, 2);
+		mesh->Enqueue(
+				&renderQueue,
+				&s_renderStates[RenderState::ShadowMapSkinned],
+				(center - lights[0].pos).squaredNorm()
+				);
+		entityStats.numDrawCalls++;
+		entityStats.numTriangles += mesh->mBuildStats.numIndices / 3;
+	}
+
+	// scene pass
+	if (passes & EntityPassScene) {
+		const Mesh* mesh = selectLod(skeleton_meshes.mSkinnedMesh, bounds, LodViewScene);
+		renderQueue.SetTransform(skinMatrices[0].data(), num_matrices);
+		renderQueue.SetUniform(lights[0].u_lightPos, lights[0].pos.data());
+		renderQueue.SetUniform(u_color, entity->mColor.data());
+		renderQueue.SetUniform(lights[0].u_lightMtx, lights[0].mtxShadow);
+		renderQueue.SetUniform(u_meshDecode, mesh->mDecode, 2);
+		mesh->Enqueue(
+				&renderQueue,
+				&s_renderStates[RenderState::SceneSkinned],
+				(center - cameras[activeCameraIndex].eye).squaredNorm()
+				);
+		entityStats.numDrawCalls++;
+		entityStats.numTriangles += mesh->mBuildStats.numIndices / 3;
+	}
+
+	entityStats.numInstances++;
+	return true;
+}
+
+// Draws every entity that has a skinned mesh with one draw call per pass.
+// Culling happens per entity, the meshes of the remaining entities are
+// drawn instanced or one by one.
+void Renderer::submitEntitiesSkinned(bool instanced) {
+	for (size_t i = 0; i < entities.size(); i++) {
+		uint8_t passes = 0;
+		if (entitySceneVisibility[i] != Frustum::Outside) {
+			passes |= EntityPassScene;
+		}
+		if (entityShadowVisibility[i] != Frustum::Outside) {
+			passes |= EntityPassShadowMap;
+		}
+
+		if (passes != 0) {
+			submitEntitySkinned(entities[i], passes);
+		}
+	}
+
+	meshInstances.erase(
+			std::remove_if(meshInstances.begin(), meshInstances.end(),
+				[](const MeshInstance& instance) {
+					return instance.entity->mSkeletonMeshes.mSkinnedMesh != nullptr;
+				}),
+			meshInstances.end());
+
+	if (instanced) {
+		submitEntitiesInstanced();
+	} else {
+		submitEntities();
+	}
+}
+
+// Points of the debug circles: sin and cos of the angles, the last point
+// closes the circle
+struct DebugCircleTable {
+	static const int cNumSegments = 64;
+	float sin[cNumSegments];
+	float cos[cNumSegments];
+
+	DebugCircleTable() {
+		for (int j = 0; j < cNumSegments; j++) {
+			float angle = M_PI * 0.5f + 2. * M_PI * static_cast<float>(j) / static_cast<float>(cNumSegments - 1);
+			sin[j] = sinf(angle);
+			cos[j] = cosf(angle);
+		}
+	}
+};
+
+static const DebugCircleTable sDebugCircleTable;
+
+static uint32_t debugCommandNumPoints(const DebugCommand& command) {
+	switch (command.type) {
+		case DebugCommand::Line: return 2;
+		case DebugCommand::Circle: return DebugCircleTable::cNumSegments;
+		default: return 0;
+	}
+}
+
+// Writes the vertices of a line strip, every point is submitted twice and
+// gets extruded in the vertex shader
+static void appendDebugStrip(
+		const Vector3f* points,
+		uint32_t num_points,
+		const Vector4f& color,
+		PathVertex* vertices,
+		uint16_t* indices,
+		uint16_t base_vertex) {
+	float path_length = 0.f;
+
+	for (uint32_t i = 0; i < num_points; i++) {
+		const Vector3f& prev = points[i > 0 ? i - 1 : i];
+		const Vector3f& next = points[i + 1 < num_points ? i + 1 : i];
+
+		if (i > 0) {
+			path_length += (points[i] - points[i - 1]).norm();
+		}
+
+		PathVertex& vertex = vertices[2 * i];
+		memcpy (vertex.position, points[i].data(), sizeof(float) * 3);
+		memcpy (vertex.prev, prev.data(), sizeof(float) * 3);
+		memcpy (vertex.next, next.data(), sizeof(float) * 3);
+		memcpy (vertex.color, color.data(), sizeof(float) * 4);
+		vertex.info[0] = -1.0f;
+		vertex.info[1] = path_length;
+
+		vertices[2 * i + 1] = vertex;
+		vertices[2 * i + 1].info[0] = 1.0f;
+	}
+
+	for (uint32_t i = 0; i + 1 < num_points; i++) {
+		uint16_t j = base_vertex + 2 * i;
+		indices[6 * i + 0] = j + 0;
+		indices[6 * i + 1] = j + 1;
+		indices[6 * i + 2] = j + 2;
+		indices[6 * i + 3] = j + 2;
+		indices[6 * i + 4] = j + 1;
+		indices[6 * i + 5] = j + 3;
+	}
+}
+
+// Draws all debug commands of this frame with one draw call per line
+// state. The primitives are written into transient buffers, which are
+// split into batches as they are limited to 16 bit indices.
+void Renderer::submitDebugCommands() {
+	PROFILE_SCOPE("DebugCommands");
+
+	debugStats.numCommands = debugCommands.size();
+	debugStats.numVertices = 0;
+	debugStats.numDrawCalls = 0;
+	debugStats.numDropped = 0;
+
+	const float thickness = 0.05143f;
+	const float miter = 0.0f;
+	const float aspect = static_cast<float>(view_width) / static_cast<float>(view_height);
+	const Vector4f params (thickness, miter, aspect, 0.0f);
+
+	const RenderState& st = s_renderStates[RenderState::Lines];
+	const RenderState& st_occluded = s_renderStates[RenderState::LinesOccluded];
+
+	Vector3f points[DebugCircleTable::cNumSegments];
+
+	size_t begin = 0;
+	while (begin < debugCommands.size()) {
+		// commands that fit into one batch
+		uint32_t num_vertices = 0;
+		uint32_t num_indices = 0;
+		size_t end = begin;
+		for (; end < debugCommands.size(); end++) {
+			uint32_t num_points = debugCommandNumPoints(debugCommands[end]);
+			if (num_vertices + 2 * num_points > UINT16_MAX) {
+				break;
+			}
+			if (num_points > 1) {
+				num_vertices += 2 * num_points;
+				num_indices += 6 * (num_points - 1);
+			}
+		}
+
+		if (num_vertices == 0) {
+			break;
+		}
+
+		bgfx::TransientVertexBuffer tvb;
+		bgfx::TransientIndexBuffer tib;
+		if (!bgfx::allocTransientBuffers(&tvb, PathVertex::ms_decl, num_vertices, &tib, num_indices)) {
+			debugStats.numDropped = debugCommands.size() - begin;
+			break;
+		}
+
+		PathVertex* vertices = reinterpret_cast<PathVertex*>(tvb.data);
+		uint16_t* indices = reinterpret_cast<uint16_t*>(tib.data);
+		uint16_t base_vertex = 0;
+
+		for (size_t i = begin; i < end; i++) {
+			const DebugCommand& command = debugCommands[i];
+			uint32_t num_points = debugCommandNumPoints(command);
+			if (num_points < 2) {
+				continue;
+			}
+
+			if (command.type == DebugCommand::Line) {
+				points[0] = command.from;
+				points[1] = command.to;
+			} else if (command.type == DebugCommand::Circle) {
+				// construct an orthogonal vector from the normal.
+				Vector3f plane1 (
+						command.to[1] - command.to[2],
+						command.to[0],
+						-command.to[0]
+						);
+				plane1.normalize();
+				Vector3f plane2 = command.to.cross(plane1);
+
+				plane1 = plane1 * command.radius;
+				plane2 = plane2 * command.radius;
+				for (uint32_t j = 0; j < num_points; j++) {
+					points[j] = command.from
+						+ plane1 * sDebugCircleTable.sin[j]
+						+ plane2 * sDebugCircleTable.cos[j];
+				}
+			}
+
+			appendDebugStrip(points, num_points, command.color,
+					vertices, indices, base_vertex);
+
+			vertices += 2 * num_points;
+			indices += 6 * (num_points - 1);
+			base_vertex += 2 * num_points;
+		}
+
+		// submit the batch to the regular and the occluded lines state
+		bgfx::setUniform(u_line_params, params.data(), 1);
+		bgfx::setVertexBuffer(&tvb);
+		bgfx::setIndexBuffer(&tib);
+		bgfx::setState(st.m_state);
+		bgfx::submit(st.m_viewId, st.m_program.program);
+
+		bgfx::setVertexBuffer(&tvb);
+		bgfx::setIndexBuffer(&tib);
+		bgfx::setState(st_occluded.m_state);
+		bgfx::submit(st_occluded.m_viewId, st_occluded.m_program.program);
+
+		debugStats.numVertices += num_vertices;
+		debugStats.numDrawCalls += 2;
+		begin = end;
+	}
+}
+
+StreamingPath* Renderer::createStreamingPath(uint32_t capacity) {
+	StreamingPath* result = new StreamingPath(capacity);
+	streamingPaths.push_back(result);
+	return result;
+}
+
+bool Renderer::destroyStreamingPath(StreamingPath* path) {
+	for (size_t i = 0; i < streamingPaths.size(); i++) {
+		if (streamingPaths[i] == path) {
+			delete path;
+			streamingPaths.erase(streamingPaths.begin() + i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void Renderer::submitStreamingPaths() {
+	const float thickness = 0.05143f;
+	const float miter = 0.0f;
+	const float aspect = static_cast<float>(view_width) / static_cast<float>(view_height);
+	const Vector4f params (thickness, miter, aspect, 0.0f);
+
+	const RenderState* states[2] = {
+		&s_renderStates[RenderState::Lines],
+		&s_renderStates[RenderState::LinesOccluded]
+	};
+
+	for (size_t i = 0; i < streamingPaths.size(); i++) {
+		StreamingPath* path = streamingPaths[i];
+		path->UpdateBuffers();
+
+		uint32_t first[2];
+		uint32_t num[2];
+		int num_ranges = path->GetIndexRanges(first, num);
+
+		for (int s = 0; s < 2; s++) {
+			for (int r = 0; r < num_ranges; r++) {
+				bgfx::setUniform(u_line_params, params.data(), 1);
+				bgfx::setVertexBuffer(path->mVertexBufferHandle);
+				bgfx::setIndexBuffer(path->mIndexBufferHandle, first[r], num[r]);
+				bgfx::setState(states[s]->m_state);
+				bgfx::submit(states[s]->m_viewId, states[s]->m_program.program);
+			}
+		}
+	}
+}
+
 Entity* Renderer::createEntity() {
 	Entity* result = new Entity();
 	entities.push_back(result);
@@ -11,8 +11,11 @@
 
 #include "Globals.h"
 #include "RenderUtils.h"
+#include "RenderQueue.h"
+#include "Culling.h"
 
 struct Entity;
+struct PathVertex;
 
 struct Camera {
 	Vector3f eye;
@@ -276,19 +279,46 @@ struct SkeletonMeshes {
 	Skeleton& mSkeleton;
 	typedef std::pair<Mesh*, int> MeshBoneIndex;
 	std::vector<MeshBoneIndex> mMeshBoneIndices;
+	/// Meshes that get deleted with the skeleton meshes. Shared meshes are
+	/// owned by another entity.
+	std::vector<Mesh*> mOwnedMeshes;
+
+	/// World space bounds of the meshes and of all meshes together, see
+	/// UpdateBounds()
+	std::vector<Aabb> mWorldBounds;
+	Aabb mBounds;
+
+	/// All meshes merged into a single mesh that is drawn with rigid GPU
+	/// skinning, see UpdateSkinnedMesh(). Vertex bone index i refers to
+	/// the skeleton bone mSkinnedBones[i].
+	static const int cMaxSkinnedBones = 32;
+	Mesh* mSkinnedMesh = nullptr;
+	std::vector<int> mSkinnedBones;
+	bool mOwnsSkinnedMesh = false;
 
 	SkeletonMeshes(Skeleton &skeleton) :
 		mSkeleton(skeleton)
 	{}
 
 	~SkeletonMeshes() {
-		for(MeshBoneIndex& mesh_bone : mMeshBoneIndices) {
-			delete mesh_bone.first;
+		for(Mesh* mesh : mOwnedMeshes) {
+			delete mesh;
+		}
+
+		if (mOwnsSkinnedMesh) {
+			delete mSkinnedMesh;
 		}
 	}
 
 	void AddMesh (Mesh* mesh, int bone_index) {
 		mMeshBoneIndices.push_back (MeshBoneIndex (mesh, bone_index));
+		mOwnedMeshes.push_back (mesh);
+	}
+
+	/// Adds a mesh that is owned by another entity. Meshes that are shared
+	/// by several entities get drawn with a single instanced draw call.
+	void AddSharedMesh (Mesh* mesh, int bone_index) {
+		mMeshBoneIndices.push_back (MeshBoneIndex (mesh, bone_index));
 	}
 
 	const Matrix44f GetBoneMatrix(int index) const {
@@ -306,6 +336,22 @@ struct SkeletonMeshes {
 	int Length() const {
 		return mMeshBoneIndices.size();
 	}
+
+	/// Transforms the mesh bounds by the current bone matrices
+	void UpdateBounds();
+
+	/// Merges all meshes into mSkinnedMesh. Fails if the meshes are
+	/// attached to more than cMaxSkinnedBones bones or their vertex data
+	/// was released.
+	bool UpdateSkinnedMesh(bgfxutils::MeshVertexFormat format = bgfxutils::MeshVertexFloat);
+
+	/// Frees the vertex data in main memory of the owned meshes, see
+	/// Mesh::ReleaseCpuData(). Returns the number of freed bytes.
+	size_t ReleaseCpuData();
+
+	/// Uses the skinned mesh of other, e.g. for entities that share their
+	/// meshes.
+	void SetSharedSkinnedMesh(const SkeletonMeshes& other);
 };
 
 struct Entity {
@@ -354,6 +400,48 @@ struct Path {
 	void UpdateBuffers();
 };
 
+// Polyline that grows by appending points, e.g. for trajectories. The
+// points are kept in a ring buffer of fixed capacity; once it is full the
+// oldest points get overwritten. Appending a point only updates its own
+// vertices and the adjacency of its neighbours and UpdateBuffers() only
+// uploads these vertices, so the cost does not depend on the length of
+// the path. The index buffer connects consecutive ring buffer slots and
+// never changes.
+struct StreamingPath {
+	uint32_t mCapacity;
+	// ring buffer slot of the next point
+	uint32_t mHead = 0;
+	uint32_t mCount = 0;
+	float mLength = 0.f;
+	Vector3f mLastPoint = Vector3f (0.f, 0.f, 0.f);
+
+	// two vertices per point
+	PathVertex* mVertices = nullptr;
+	// slots that need to be uploaded. Once there are more than mCapacity
+	// of them (e.g. because the path is not drawn), mAllDirty gets set
+	// instead and the whole ring gets uploaded.
+	std::vector<uint32_t> mDirtySlots;
+	bool mAllDirty = false;
+
+	bgfx::DynamicVertexBufferHandle mVertexBufferHandle = BGFX_INVALID_HANDLE;
+	bgfx::IndexBufferHandle mIndexBufferHandle = BGFX_INVALID_HANDLE;
+
+	StreamingPath(uint32_t capacity);
+	~StreamingPath();
+	StreamingPath(const StreamingPath&) = delete;
+	StreamingPath& operator=(const StreamingPath&) = delete;
+
+	void Append(const Vector3f &point, const Vector4f &color);
+	void Clear();
+	void MarkDirty(uint32_t slot);
+	void UpdateBuffers();
+
+	/// Ranges of the index buffer that need to be drawn. Returns the number
+	/// of ranges (at most two as the path may wrap around the end of the
+	/// ring buffer).
+	int GetIndexRanges(uint32_t first[2], uint32_t num[2]) const;
+};
+
 struct DebugCommand {
 	enum CommandType {
 		Line,
@@ -379,6 +467,7 @@ struct Renderer {
 	uint32_t view_offset_y = 0;
 	uint32_t view_width = 1;
 	uint32_t view_height = 1;
+	uint32_t resetFlags = BGFX_RESET_VSYNC;
 
 	bgfx::UniformHandle sceneDefaultTextureSampler;
 	bgfx::TextureHandle sceneDefaultTexture;
@@ -388,10 +477,98 @@ struct Renderer {
 
 	std::vector<Entity*> entities;
 
+	// floor and entity draws of the shadow map and scene views
+	RenderQueue renderQueue;
+
+	// Visible bone meshes of all entities, sorted by their mesh such that
+	// meshes with the same geometry can be drawn as one instanced draw call
+	enum EntityPass {
+		EntityPassShadowMap = 1,
+		EntityPassScene = 2
+	};
+	struct MeshInstance {
+		const Mesh* mesh;
+		const Entity* entity;
+		int index;
+		// EntityPass flags of the views in which the mesh is visible
+		uint8_t passes;
+	};
+	std::vector<MeshInstance> meshInstances;
+	// visible meshes of a single pass with the selected LOD
+	struct PassInstance {
+		const Mesh* mesh;
+		uint32_t instance;
+	};
+	std::vector<PassInstance> passInstances;
+	bool drawInstanced = true;
+
+	// Level of detail selection. Every pass picks the LOD of a mesh from
+	// the projected size of its bounding sphere: meshes larger than
+	// lodPixelSize pixels use the full mesh, every halving of the size
+	// skips two levels as the covered area drops to a quarter.
+	struct LodView {
+		// clip = (x, y, z, 1) * viewProj
+		float viewProj[16];
+		// projected diameter in pixels of a sphere with radius 1 at w = 1
+		float pixelScale;
+		// w is constant and the projected size independent of the distance
+		bool orthographic;
+	};
+	enum LodViewIndex {
+		LodViewShadowMap = 0,
+		LodViewScene = 1
+	};
+	bool useLods = true;
+	float lodPixelSize = 256.f;
+	LodView lodViews[2];
+
+	// Entities with a skinned mesh are drawn with a single draw call per
+	// pass. Takes precedence over the instanced drawing, which is used for
+	// the entities without a skinned mesh.
+	bool drawSkinned = true;
+	std::vector<Matrix44f> skinMatrices;
+
+	// Culling of the entities against the camera frustum (scene pass) and
+	// the light frustum (shadow map pass). The hierarchy is rebuilt when
+	// entities get added or removed and refit otherwise.
+	bool cullEntities = true;
+	Bvh entityBvh;
+	std::vector<Entity*> entityBvhEntities;
+	std::vector<Aabb> entityBounds;
+	std::vector<uint8_t> entitySceneVisibility;
+	std::vector<uint8_t> entityShadowVisibility;
+
+	struct CullingStats {
+		uint32_t numMeshes = 0;
+		uint32_t numVisibleScene = 0;
+		uint32_t numVisibleShadowMap = 0;
+		uint32_t numNodesTested = 0;
+		double cullTime = 0.;
+	};
+	CullingStats cullingStats;
+
+	// Draw calls and CPU time of the submission of the entities in the
+	// last frame
+	struct EntityStats {
+		uint32_t numDrawCalls = 0;
+		uint32_t numInstances = 0;
+		uint32_t numTriangles = 0;
+		double submitTime = 0.;
+	};
+	EntityStats entityStats;
+
 	std::vector<Camera> cameras;
 	std::vector<Light> lights;
-	std::vector<Path> debugPaths;
 	std::vector<DebugCommand> debugCommands;
+	std::vector<StreamingPath*> streamingPaths;
+
+	struct DebugStats {
+		uint32_t numCommands = 0;
+		uint32_t numVertices = 0;
+		uint32_t numDrawCalls = 0;
+		uint32_t numDropped = 0;
+	};
+	DebugStats debugStats;
 
 	uint16_t activeCameraIndex;
 
@@ -421,7 +598,23 @@ struct Renderer {
 	Entity* createEntity();
 	bool destroyEntity (Entity* entity);
 
+	// shadow map and scene pass of the entities
+	void updateEntityVisibility();
+	const Mesh* selectLod (const Mesh* mesh, const Aabb& bounds, int view) const;
+	void submitEntities();
+	void submitEntitiesInstanced();
+	bool submitEntitySkinned (const Entity* entity, uint8_t passes);
+	void submitEntitiesSkinned(bool instanced);
+	void submitEntityMesh (const Entity* entity, int index, uint8_t passes);
+
 	// debug commands
+	void submitDebugCommands();
+
+	// streaming paths are drawn together with the debug commands
+	StreamingPath* createStreamingPath(uint32_t capacity);
+	bool destroyStreamingPath(StreamingPath* path);
+	void submitStreamingPaths();
+
 	void drawDebugLine (
 			const Vector3f &from,
 			const Vector3f &to,
@@ -489,6 +682,10 @@ struct RenderState {
 		Lines,
 		LinesOccluded,
 		Debug,
+		ShadowMapInstanced,
+		SceneInstanced,
+		ShadowMapSkinned,
+		SceneSkinned,
 		Count
 	};
 
@@ -0,0 +1,126 @@
+#include "RenderQueue.h"
+#include "RenderModule.h"
+
+#include <bx/timer.h>
+
+#include <cassert>
+
+#include "Profiler.h"
+
+void RenderQueue::SetTransform(const float* mtx, uint16_t num) {
+	mPending.transform = mTransforms.size();
+	mPending.numMatrices = num;
+	mTransforms.insert(mTransforms.end(), mtx, mtx + 16 * num);
+}
+
+uint16_t RenderQueue::GetUniformSize(bgfx::UniformHandle handle) {
+	if (handle.idx >= mUniformSizes.size()) {
+		mUniformSizes.resize(handle.idx + 1, 0);
+	}
+
+	uint16_t& size = mUniformSizes[handle.idx];
+	if (size == 0) {
+		bgfx::UniformInfo info;
+		bgfx::getUniformInfo(handle, info);
+
+		switch (info.type) {
+			case bgfx::UniformType::Vec4: size = 4; break;
+			case bgfx::UniformType::Mat3: size = 9; break;
+			case bgfx::UniformType::Mat4: size = 16; break;
+			default: size = 1; break;
+		}
+	}
+
+	return size;
+}
+
+void RenderQueue::SetUniform(bgfx::UniformHandle handle, const float* value, uint16_t num) {
+	UniformValue uniform;
+	uniform.handle = handle;
+	uniform.num = num;
+	uniform.offset = mUniformData.size();
+	mUniforms.push_back(uniform);
+	mPending.uniformsEnd = mUniforms.size();
+
+	uint32_t size = GetUniformSize(handle) * num;
+	mUniformData.insert(mUniformData.end(), value, value + size);
+}
+
+void RenderQueue::SetInstanceDataBuffer(const bgfx::InstanceDataBuffer* idb) {
+	mPending.instanceData = idb;
+}
+
+void RenderQueue::Submit(
+		const RenderState* state,
+		bgfx::VertexBufferHandle vertex_buffer,
+		bgfx::IndexBufferHandle index_buffer,
+		float depth,
+		bool preserve_state) {
+	DrawItem item = mPending;
+	item.state = state;
+	item.vertexBuffer = vertex_buffer;
+	item.indexBuffer = index_buffer;
+	item.depth = depth;
+	mItems.push_back(item);
+
+	if (!preserve_state) {
+		ResetPending();
+	}
+}
+
+void RenderQueue::Flush() {
+	PROFILE_SCOPE("RenderQueue::Flush");
+
+	int64_t flush_start = bx::getHPCounter();
+
+	Sort();
+	Plan();
+
+	// submit in sorted order
+	for (uint32_t i = 0; i < mCommands.size(); i++) {
+		const DrawCommand& command = mCommands[i];
+		const DrawItem& item = mItems[command.item];
+		const RenderState* state = item.state;
+
+		if (command.setState) {
+			bgfx::setState(state->m_state);
+		}
+
+		if (command.setTextures) {
+			for (uint8_t tex = 0; tex < state->m_numTextures; ++tex) {
+				const RenderState::Texture& texture = state->m_textures[tex];
+				bgfx::setTexture(texture.m_stage
+						, texture.m_sampler
+						, texture.m_texture
+						, texture.m_flags
+						);
+			}
+		}
+
+		for (uint32_t u = command.uniformsBegin; u < command.uniformsEnd; u++) {
+			const UniformValue& uniform = mUniforms[mCommandUniforms[u]];
+			bgfx::setUniform(uniform.handle, &mUniformData[uniform.offset], uniform.num);
+		}
+
+		if (item.transform >= 0) {
+			bgfx::setTransform(&mTransforms[item.transform], item.numMatrices);
+		}
+
+		bgfx::setIndexBuffer(item.indexBuffer);
+		bgfx::setVertexBuffer(item.vertexBuffer);
+		if (item.instanceData != nullptr) {
+			bgfx::setInstanceDataBuffer(item.instanceData);
+		}
+
+		bgfx::submit(state->m_viewId, state->m_program.program, 0, command.preserveState);
+	}
+
+	mItems.clear();
+	mTransforms.clear();
+	mUniforms.clear();
+	mUniformData.clear();
+	mUniformSizes.clear();
+	ResetPending();
+
+	mStats.flushTime = double(bx::getHPCounter() - flush_start) / double(bx::getHPFrequency());
+}
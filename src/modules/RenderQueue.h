@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <vector>
+
+#include <bgfx/bgfx.h>
+
+struct RenderState;
+
+// Deferred submission of draw calls. Draws are recorded like regular bgfx
+// draws (set transform, uniforms and instance data, then submit) and get
+// submitted in Flush() sorted by a 64 bit key:
+//
+//   view (8 bits) | program (12 bits) | texture set (12 bits) | depth (32 bits)
+//
+// such that draws with the same program and textures follow each other.
+// Consecutive draws then keep their bindings and render state
+// (preserveState) and uniforms only get set when their value changed.
+//
+// Views that receive queued draws have to be in sequential mode
+// (bgfx::setViewSeq()) as the skipped uniforms rely on the order of the
+// draws.
+struct RenderQueue {
+	struct DrawItem {
+		const RenderState* state;
+		bgfx::VertexBufferHandle vertexBuffer;
+		bgfx::IndexBufferHandle indexBuffer;
+		const bgfx::InstanceDataBuffer* instanceData;
+		// offset into mTransforms, -1 if none was set
+		int32_t transform;
+		uint16_t numMatrices;
+		// range in mUniforms
+		uint32_t uniformsBegin;
+		uint32_t uniformsEnd;
+		float depth;
+	};
+
+	struct UniformValue {
+		bgfx::UniformHandle handle;
+		uint16_t num;
+		// offset into mUniformData
+		uint32_t offset;
+	};
+
+	struct Stats {
+		uint32_t numDraws = 0;
+		uint32_t numStateChanges = 0;
+		uint32_t numTextureChanges = 0;
+		uint32_t numUniforms = 0;
+		uint32_t numSkippedUniforms = 0;
+		double flushTime = 0.;
+	};
+
+	// bgfx calls of a sorted draw as decided by Plan()
+	struct DrawCommand {
+		// index into mItems
+		uint32_t item;
+		bool setState;
+		bool setTextures;
+		bool preserveState;
+		// range in mCommandUniforms
+		uint32_t uniformsBegin;
+		uint32_t uniformsEnd;
+	};
+
+	std::vector<DrawItem> mItems;
+	std::vector<float> mTransforms;
+	std::vector<UniformValue> mUniforms;
+	std::vector<float> mUniformData;
+
+	// state of the next draw
+	DrawItem mPending;
+
+	// sort buffers, reused between frames
+	std::vector<uint64_t> mKeys;
+	std::vector<uint64_t> mTempKeys;
+	std::vector<uint32_t> mIndices;
+	std::vector<uint32_t> mTempIndices;
+	std::vector<const RenderState*> mTextureSets;
+
+	// draws in submission order and the indices into mUniforms of the
+	// uniforms they have to set
+	std::vector<DrawCommand> mCommands;
+	std::vector<uint32_t> mCommandUniforms;
+
+	// last value of every uniform during Flush(), indexed by handle
+	struct UniformCacheEntry {
+		uint32_t frame = 0;
+		uint16_t num = 0;
+		float value[16];
+	};
+	std::vector<UniformCacheEntry> mUniformCache;
+	uint32_t mFrame = 0;
+
+	// number of floats of a uniform value, queried once per frame as the
+	// type may change when shaders get (re)loaded
+	std::vector<uint16_t> mUniformSizes;
+
+	Stats mStats;
+
+	RenderQueue();
+
+	/// Maps the depth to an unsigned integer with the same order
+	static uint32_t DepthKey(float depth) {
+		uint32_t bits;
+		memcpy(&bits, &depth, sizeof(bits));
+		return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+	}
+
+	/// Packs the sort key of a draw, program and texture set are
+	/// truncated to 12 bits
+	static uint64_t SortKey(uint8_t view, uint16_t program, uint16_t texture_set, float depth) {
+		return (uint64_t(view) << 56)
+			| (uint64_t(program & 0xfff) << 44)
+			| (uint64_t(texture_set & 0xfff) << 32)
+			| DepthKey(depth);
+	}
+
+	void SetTransform(const float* mtx, uint16_t num = 1);
+	void SetUniform(bgfx::UniformHandle handle, const float* value, uint16_t num = 1);
+	void SetInstanceDataBuffer(const bgfx::InstanceDataBuffer* idb);
+
+	/// Records a draw. Like bgfx::submit() the transform, uniforms and
+	/// instance data are reset afterwards unless preserve_state is set.
+	void Submit(
+			const RenderState* state,
+			bgfx::VertexBufferHandle vertex_buffer,
+			bgfx::IndexBufferHandle index_buffer,
+			float depth = 0.f,
+			bool preserve_state = false);
+
+	/// Sorts and submits all recorded draws
+	void Flush();
+
+	/// Sorts the recorded draws into mIndices
+	void Sort();
+
+	/// Fills mCommands for the sorted draws such that state, textures and
+	/// uniforms that are still bound from the previous draw are skipped
+	/// and updates mStats. Uniform sizes have to be known already, so
+	/// unlike Flush() this does not call into bgfx.
+	void Plan();
+
+	uint16_t GetTextureSet(const RenderState* state);
+	uint16_t GetUniformSize(bgfx::UniformHandle handle);
+	void ResetPending();
+};
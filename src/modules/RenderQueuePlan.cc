@@ -0,0 +1,155 @@
+#include "RenderQueue.h"
+#include "RenderModule.h"
+
+#include <bx/sort.h>
+
+#include <cstring>
+
+// The parts of the render queue that do not call into bgfx: sorting of the
+// recorded draws and the decision which calls of a draw are redundant.
+
+static bool sameTextures(const RenderState* a, const RenderState* b) {
+	if (a->m_numTextures != b->m_numTextures) {
+		return false;
+	}
+
+	for (uint8_t i = 0; i < a->m_numTextures; i++) {
+		const RenderState::Texture& ta = a->m_textures[i];
+		const RenderState::Texture& tb = b->m_textures[i];
+		if (ta.m_stage != tb.m_stage
+				|| ta.m_flags != tb.m_flags
+				|| ta.m_sampler.idx != tb.m_sampler.idx
+				|| ta.m_texture.idx != tb.m_texture.idx) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+RenderQueue::RenderQueue() {
+	ResetPending();
+}
+
+void RenderQueue::ResetPending() {
+	mPending.state = nullptr;
+	mPending.vertexBuffer = BGFX_INVALID_HANDLE;
+	mPending.indexBuffer = BGFX_INVALID_HANDLE;
+	mPending.instanceData = nullptr;
+	mPending.transform = -1;
+	mPending.numMatrices = 0;
+	mPending.uniformsBegin = mUniforms.size();
+	mPending.uniformsEnd = mUniforms.size();
+	mPending.depth = 0.f;
+}
+
+uint16_t RenderQueue::GetTextureSet(const RenderState* state) {
+	for (size_t i = 0; i < mTextureSets.size(); i++) {
+		if (sameTextures(mTextureSets[i], state)) {
+			return i;
+		}
+	}
+
+	mTextureSets.push_back(state);
+	return mTextureSets.size() - 1;
+}
+
+void RenderQueue::Sort() {
+	uint32_t num_items = mItems.size();
+
+	mKeys.resize(num_items);
+	mTempKeys.resize(num_items);
+	mIndices.resize(num_items);
+	mTempIndices.resize(num_items);
+	mTextureSets.clear();
+
+	for (uint32_t i = 0; i < num_items; i++) {
+		const DrawItem& item = mItems[i];
+		mKeys[i] = SortKey(
+				item.state->m_viewId,
+				item.state->m_program.program.idx,
+				GetTextureSet(item.state),
+				item.depth);
+		mIndices[i] = i;
+	}
+
+	if (num_items > 0) {
+		bx::radixSort(mKeys.data(), mTempKeys.data(), mIndices.data(), mTempIndices.data(), num_items);
+	}
+}
+
+void RenderQueue::Plan() {
+	uint32_t num_items = mIndices.size();
+	mStats.numDraws = num_items;
+	mStats.numStateChanges = 0;
+	mStats.numTextureChanges = 0;
+	mStats.numUniforms = 0;
+	mStats.numSkippedUniforms = 0;
+
+	mCommands.resize(num_items);
+	mCommandUniforms.clear();
+
+	mFrame++;
+	const RenderState* bound_state = nullptr;
+
+	for (uint32_t i = 0; i < num_items; i++) {
+		const DrawItem& item = mItems[mIndices[i]];
+		const RenderState* state = item.state;
+		DrawCommand& command = mCommands[i];
+		command.item = mIndices[i];
+
+		// bindings and render state of the previous draw are only kept if
+		// it was submitted with preserveState
+		command.setState = bound_state == nullptr || bound_state->m_state != state->m_state;
+		if (command.setState) {
+			mStats.numStateChanges++;
+		}
+
+		command.setTextures = bound_state == nullptr || !sameTextures(bound_state, state);
+		if (command.setTextures) {
+			mStats.numTextureChanges++;
+		}
+
+		command.uniformsBegin = mCommandUniforms.size();
+		for (uint32_t u = item.uniformsBegin; u < item.uniformsEnd; u++) {
+			const UniformValue& uniform = mUniforms[u];
+			const float* value = &mUniformData[uniform.offset];
+			uint32_t size = mUniformSizes[uniform.handle.idx] * uniform.num;
+
+			if (uniform.handle.idx >= mUniformCache.size()) {
+				mUniformCache.resize(uniform.handle.idx + 1);
+			}
+
+			UniformCacheEntry& cached = mUniformCache[uniform.handle.idx];
+			if (cached.frame == mFrame
+					&& cached.num == uniform.num
+					&& size <= 16
+					&& memcmp(cached.value, value, size * sizeof(float)) == 0) {
+				mStats.numSkippedUniforms++;
+				continue;
+			}
+
+			mCommandUniforms.push_back(u);
+			mStats.numUniforms++;
+
+			if (size <= 16) {
+				cached.frame = mFrame;
+				cached.num = uniform.num;
+				memcpy(cached.value, value, size * sizeof(float));
+			} else {
+				cached.frame = 0;
+			}
+		}
+		command.uniformsEnd = mCommandUniforms.size();
+
+		// keep the state for the next draw unless it would inherit
+		// instance data that it does not set itself
+		command.preserveState = false;
+		if (i + 1 < num_items) {
+			const DrawItem& next = mItems[mIndices[i + 1]];
+			command.preserveState = item.instanceData == nullptr || next.instanceData != nullptr;
+		}
+
+		bound_state = command.preserveState ? state : nullptr;
+	}
+}
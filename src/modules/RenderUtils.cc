@@ -22,6 +22,7 @@ namespace stl = tinystl;
 
 #include "RenderModule.h"
 #include "RenderUtils.h"
+#include "MeshOptimizer.h"
 #include "Globals.h"
 
 using namespace SimpleMath;
@@ -621,6 +622,18 @@ struct Mesh
 		}
 	}
 
+	void enqueue(RenderQueue* _queue, const RenderState* _state, float _depth) const
+	{
+		for (GroupArray::const_iterator it = m_groups.begin(), itEnd = m_groups.end(); it != itEnd; ++it)
+		{
+			const Group& group = *it;
+
+			// all groups share the transform and uniforms
+			bool preserveState = it + 1 != itEnd;
+			_queue->Submit(_state, group.m_vbh, group.m_ibh, _depth, preserveState);
+		}
+	}
+
 	bgfx::VertexDecl m_decl;
 	typedef stl::vector<Group> GroupArray;
 	GroupArray m_groups;
@@ -658,6 +671,11 @@ void meshSubmit(const Mesh* _mesh, const RenderState* _state, uint8_t _numPasses
 	_mesh->submit(_state, _numPasses, _mtx, _numMatrices);
 }
 
+void meshEnqueue(const Mesh* _mesh, RenderQueue* _queue, const RenderState* _state, float _depth)
+{
+	_mesh->enqueue(_queue, _state, _depth);
+}
+
 uint32_t packUint32(uint8_t _x, uint8_t _y, uint8_t _z, uint8_t _w)
 {
 	union
@@ -704,6 +722,27 @@ struct PosNormalColorVertex {
 
 bgfx::VertexDecl PosNormalColorVertex::ms_decl;
 
+struct PosNormalIndexVertex {
+	float m_x;
+	float m_y;
+	float m_z;
+	uint32_t m_normal;
+	uint8_t m_indices[4];
+
+	static void init() {
+		ms_decl
+			.begin()
+			.add(bgfx::Attrib::Position,  3, bgfx::AttribType::Float)
+			.add(bgfx::Attrib::Normal,    4, bgfx::AttribType::Uint8, true, true)
+			.add(bgfx::Attrib::Indices,   4, bgfx::AttribType::Uint8, false, false)
+			.end();
+	}
+
+	static bgfx::VertexDecl ms_decl;
+};
+
+bgfx::VertexDecl PosNormalIndexVertex::ms_decl;
+
 struct PosNormalTexcoordVertex
 {
 	float    m_x;
@@ -840,47 +879,267 @@ void mesh_load(Mesh* mesh, const void* _vertices, uint32_t _numVertices, const b
 // 	return result;
 // }
 
-Mesh *createMeshFromStdVectors (
+// Welds identical vertices of the triangle list, reorders the triangles
+// for the post-transform vertex cache and the vertices in the order of
+// their first use. Uses 32 bit indices if the mesh has more vertices than
+// 16 bit indices can address.
+static Mesh *createIndexedMesh (
+		const void* vertices,
+		uint32_t num_vertices,
+		const bgfx::VertexDecl& decl,
+		MeshBuildStats* stats
+		) {
+	uint16_t stride = decl.getStride();
+
+	// the welded vertices of the unindexed triangle list are its indices
+	std::vector<uint32_t> indices(num_vertices);
+	uint32_t num_unique = MeshOptimizer::WeldVertices(vertices, num_vertices, stride, indices.data());
+	float acmr_welded = MeshOptimizer::ComputeACMR(indices.data(), indices.size(), num_unique);
+
+	// input vertex of every unique vertex
+	std::vector<uint32_t> first_occurrence(num_unique);
+	for (uint32_t i = num_vertices; i-- > 0; ) {
+		first_occurrence[indices[i]] = i;
+	}
+
+	MeshOptimizer::OptimizeVertexCache(indices.data(), indices.size(), num_unique);
+
+	std::vector<uint32_t> fetch_remap(num_unique);
+	num_unique = MeshOptimizer::OptimizeVertexFetch(indices.data(), indices.size(), num_unique, fetch_remap.data());
+	float acmr_optimized = MeshOptimizer::ComputeACMR(indices.data(), indices.size(), num_unique);
+
+	bool index32 = num_unique > UINT16_MAX;
+	if (index32 && 0 == (bgfx::getCaps()->supported & BGFX_CAPS_INDEX32)) {
+		gLog ("Error: mesh with %d vertices needs 32 bit indices", num_unique);
+		return nullptr;
+	}
+
+	const bgfx::Memory* vb_mem = bgfx::alloc (num_unique * stride);
+	for (uint32_t i = 0; i < fetch_remap.size(); i++) {
+		if (fetch_remap[i] != UINT32_MAX) {
+			memcpy (vb_mem->data + fetch_remap[i] * stride,
+					static_cast<const uint8_t*>(vertices) + first_occurrence[i] * stride,
+					stride);
+		}
+	}
+
+	const bgfx::Memory* ib_mem = nullptr;
+	if (index32) {
+		ib_mem = bgfx::copy (indices.data(), indices.size() * sizeof(uint32_t));
+	} else {
+		ib_mem = bgfx::alloc (indices.size() * sizeof(uint16_t));
+		uint16_t* mesh_ib = (uint16_t*) ib_mem->data;
+		for (uint32_t i = 0; i < indices.size(); i++) {
+			mesh_ib[i] = indices[i];
+		}
+	}
+
+	// the buffers take ownership of the memory
+	Group group;
+	group.m_vbh = bgfx::createVertexBuffer(vb_mem, decl);
+	group.m_ibh = bgfx::createIndexBuffer(ib_mem, index32 ? BGFX_BUFFER_INDEX32 : BGFX_BUFFER_NONE);
+
+	Mesh* result = new Mesh();
+	result->m_decl = decl;
+	result->m_groups.push_back(group);
+
+	if (stats != nullptr) {
+		stats->numInputVertices = num_vertices;
+		stats->numVertices = num_unique;
+		stats->numIndices = indices.size();
+		stats->acmrUnindexed = num_vertices > 0 ? 3.0f : 0.0f;
+		stats->acmrWelded = acmr_welded;
+		stats->acmrOptimized = acmr_optimized;
+		stats->vertexSize = num_unique * stride;
+	}
+
+	return result;
+}
+
+// Packed vertex formats: 16 bit or half float positions (6 bytes),
+// octahedral normals (2 bytes) and RGBA8 colors or bone indices (4 bytes)
+struct PackedVertex {
+	static void init() {
+		initDecl(ms_declHalf, bgfx::AttribType::Half, bgfx::Attrib::Color0);
+		initDecl(ms_declQuantized, bgfx::AttribType::Int16, bgfx::Attrib::Color0);
+		initDecl(ms_declHalfSkinned, bgfx::AttribType::Half, bgfx::Attrib::Indices);
+		initDecl(ms_declQuantizedSkinned, bgfx::AttribType::Int16, bgfx::Attrib::Indices);
+	}
+
+	static void initDecl(bgfx::VertexDecl& decl, bgfx::AttribType::Enum position_type, bgfx::Attrib::Enum attrib) {
+		decl
+			.begin()
+			.add(bgfx::Attrib::Position,  3, position_type, true, true)
+			.add(bgfx::Attrib::Normal,    2, bgfx::AttribType::Uint8, true, true);
+
+		if (attrib == bgfx::Attrib::Indices) {
+			decl.add(bgfx::Attrib::Indices,   4, bgfx::AttribType::Uint8, false, false);
+		} else {
+			decl.add(bgfx::Attrib::Color0,    4, bgfx::AttribType::Uint8, true, false);
+		}
+
+		decl.end();
+	}
+
+	static bgfx::VertexDecl ms_declHalf;
+	static bgfx::VertexDecl ms_declQuantized;
+	static bgfx::VertexDecl ms_declHalfSkinned;
+	static bgfx::VertexDecl ms_declQuantizedSkinned;
+};
+
+bgfx::VertexDecl PackedVertex::ms_declHalf;
+bgfx::VertexDecl PackedVertex::ms_declQuantized;
+bgfx::VertexDecl PackedVertex::ms_declHalfSkinned;
+bgfx::VertexDecl PackedVertex::ms_declQuantizedSkinned;
+
+// Octahedral normal encoding, both values are in [-1, 1]
+static void octEncode(const Vector3f& normal, float result[2]) {
+	float l1 = fabs(normal[0]) + fabs(normal[1]) + fabs(normal[2]);
+	if (l1 == 0.f) {
+		result[0] = 0.f;
+		result[1] = 0.f;
+		return;
+	}
+
+	float x = normal[0] / l1;
+	float y = normal[1] / l1;
+	if (normal[2] < 0.f) {
+		float folded_x = (1.f - fabs(y)) * (x >= 0.f ? 1.f : -1.f);
+		float folded_y = (1.f - fabs(x)) * (y >= 0.f ? 1.f : -1.f);
+		x = folded_x;
+		y = folded_y;
+	}
+
+	result[0] = x;
+	result[1] = y;
+}
+
+// Writes the vertices into the vertex format and creates the indexed mesh.
+// Either colors or bone_indices are used, depending on the format.
+static Mesh *createMeshFromStreams (
 		const std::vector<Vector4f> &vertices,
 		const std::vector<Vector3f> &normals,
-		const std::vector<Vector4f> &colors
+		const std::vector<Vector4f> &colors,
+		const std::vector<uint8_t> &bone_indices,
+		bool skinned,
+		MeshBuildStats* stats,
+		MeshVertexFormat format,
+		const float* bounds_min,
+		const float* bounds_max,
+		float* decode
 		) {
-	// create and copy the data into the actual mesh
- 	Mesh* result = new Mesh();
+	if (format == MeshVertexHalf
+			&& 0 == (bgfx::getCaps()->supported & BGFX_CAPS_VERTEX_ATTRIB_HALF)) {
+		format = MeshVertexQuantized;
+	}
+
 	PosNormalColorVertex::init();
+	PosNormalIndexVertex::init();
+	PackedVertex::init();
+
+	const bgfx::VertexDecl* decl = nullptr;
+	switch (format) {
+		case MeshVertexHalf:
+			decl = skinned ? &PackedVertex::ms_declHalfSkinned : &PackedVertex::ms_declHalf;
+			break;
+		case MeshVertexQuantized:
+			decl = skinned ? &PackedVertex::ms_declQuantizedSkinned : &PackedVertex::ms_declQuantized;
+			break;
+		default:
+			decl = skinned ? &PosNormalIndexVertex::ms_decl : &PosNormalColorVertex::ms_decl;
+			break;
+	}
+
+	// positions are stored as (position - offset) / scale
+	float scale[3] = { 1.f, 1.f, 1.f };
+	float offset[3] = { 0.f, 0.f, 0.f };
+	if (format != MeshVertexFloat && bounds_min != nullptr && bounds_max != nullptr) {
+		for (int j = 0; j < 3; j++) {
+			offset[j] = (bounds_min[j] + bounds_max[j]) * 0.5f;
+			if (format == MeshVertexQuantized) {
+				scale[j] = std::max((bounds_max[j] - bounds_min[j]) * 0.5f, 1.0e-6f);
+			}
+		}
+	}
+
 	bool have_normals = normals.size() > 0;
- 	bool have_colors = colors.size() > 0;
- 
- 	uint16_t stride = PosNormalColorVertex::ms_decl.getStride();
- 	const bgfx::Memory* vb_mem = bgfx::alloc (vertices.size() * stride);
- 	PosNormalColorVertex* mesh_vb = (PosNormalColorVertex*) vb_mem;
- 
- 	const bgfx::Memory* ib_mem = bgfx::alloc (sizeof(uint16_t) * vertices.size());
- 	uint16_t* mesh_ib = (uint16_t*) ib_mem;
- 
- 	for (unsigned int i = 0; i < vertices.size(); i++) {
- 		mesh_vb[i].m_x = vertices[i][0];
- 		mesh_vb[i].m_y = vertices[i][1];
- 		mesh_vb[i].m_z = vertices[i][2];
- 
- 		if (have_normals) {
- 			mesh_vb[i].m_normal = packF4u (normals[i][0], normals[i][1], normals[i][2]);
- 		} else {
- 			mesh_vb[i].m_normal = 0;
- 		}
- 
- 		if (have_colors) {
- 			mesh_vb[i].m_rgba = packF4u (colors[i][0], colors[i][1], colors[i][2], colors[i][3]);
- 		} else {
- 			mesh_vb[i].m_rgba = packF4u (1.f, 1.f, 1.f, 1.f);
- 		}
- 
- 		mesh_ib[i] = i;
- 	}
- 
- 	mesh_load(result, mesh_vb, vertices.size(), PosNormalColorVertex::ms_decl, mesh_ib, vertices.size());
- 
- 	return result;
+	bool have_colors = colors.size() > 0;
+	bool oct_normals = format != MeshVertexFloat;
+
+	std::vector<uint8_t> mesh_vb(vertices.size() * decl->getStride());
+	for (uint32_t i = 0; i < vertices.size(); i++) {
+		float position[4] = {
+			(vertices[i][0] - offset[0]) / scale[0],
+			(vertices[i][1] - offset[1]) / scale[1],
+			(vertices[i][2] - offset[2]) / scale[2],
+			0.f
+		};
+		bgfx::vertexPack(position, format == MeshVertexQuantized, bgfx::Attrib::Position, *decl, mesh_vb.data(), i);
+
+		float normal[4] = { 0.f, 0.f, 0.f, 0.f };
+		if (have_normals) {
+			if (oct_normals) {
+				octEncode(normals[i], normal);
+			} else {
+				memcpy(normal, normals[i].data(), sizeof(float) * 3);
+			}
+		}
+		bgfx::vertexPack(normal, true, bgfx::Attrib::Normal, *decl, mesh_vb.data(), i);
+
+		if (skinned) {
+			float indices[4] = { float(bone_indices[i]), 0.f, 0.f, 0.f };
+			bgfx::vertexPack(indices, false, bgfx::Attrib::Indices, *decl, mesh_vb.data(), i);
+		} else {
+			float color[4] = { 1.f, 1.f, 1.f, 1.f };
+			if (have_colors) {
+				memcpy(color, colors[i].data(), sizeof(float) * 4);
+			}
+			bgfx::vertexPack(color, true, bgfx::Attrib::Color0, *decl, mesh_vb.data(), i);
+		}
+	}
+
+	if (decode != nullptr) {
+		decode[0] = scale[0];
+		decode[1] = scale[1];
+		decode[2] = scale[2];
+		decode[3] = oct_normals ? 1.f : 0.f;
+		decode[4] = offset[0];
+		decode[5] = offset[1];
+		decode[6] = offset[2];
+		decode[7] = 0.f;
+	}
+
+	return createIndexedMesh(mesh_vb.data(), vertices.size(), *decl, stats);
+}
+
+Mesh *createMeshFromStdVectors (
+		const std::vector<Vector4f> &vertices,
+		const std::vector<Vector3f> &normals,
+		const std::vector<Vector4f> &colors,
+		MeshBuildStats* stats,
+		MeshVertexFormat format,
+		const float* bounds_min,
+		const float* bounds_max,
+		float* decode
+		) {
+	return createMeshFromStreams(vertices, normals, colors, std::vector<uint8_t>(),
+			false, stats, format, bounds_min, bounds_max, decode);
+}
+
+Mesh *createSkinnedMeshFromStdVectors (
+		const std::vector<Vector4f> &vertices,
+		const std::vector<Vector3f> &normals,
+		const std::vector<uint8_t> &bone_indices,
+		MeshBuildStats* stats,
+		MeshVertexFormat format,
+		const float* bounds_min,
+		const float* bounds_max,
+		float* decode
+		) {
+	assert (bone_indices.size() == vertices.size());
+
+	return createMeshFromStreams(vertices, normals, std::vector<Vector4f>(), bone_indices,
+			true, stats, format, bounds_min, bounds_max, decode);
 }
 
 void meshTransform (Mesh* mesh, const float *mtx) {
@@ -893,6 +1152,8 @@ void meshTransform (Mesh* mesh, const float *mtx) {
 }
 
 Mesh::~Mesh() {
+	ClearLods();
+
 	if (mBgfxMesh != nullptr) {
 		mBgfxMesh->unload();
 		delete mBgfxMesh;
@@ -901,13 +1162,194 @@ Mesh::~Mesh() {
 }
 
 void Mesh::Update() {
+	if (mCpuDataReleased) {
+		gLog ("Error: cannot update mesh, its vertex data was released");
+		return;
+	}
+
 	if (mBgfxMesh != nullptr) {
 		mBgfxMesh->unload();
 		delete mBgfxMesh;
 		mBgfxMesh = nullptr;
 	}
 
-	mBgfxMesh = bgfxutils::createMeshFromStdVectors (mVertices, mNormals, mColors);
+	// packed positions are encoded within the bounds of the vertices
+	Vector3f bounds_min = mBoundsMin;
+	Vector3f bounds_max = mBoundsMax;
+	if (mVertexFormat != bgfxutils::MeshVertexFloat && mVertices.size() > 0) {
+		UpdateBounds();
+		bounds_min = mBoundsMin;
+		bounds_max = mBoundsMax;
+	}
+
+	if (mBoneIndices.size() > 0) {
+		mBgfxMesh = bgfxutils::createSkinnedMeshFromStdVectors (mVertices, mNormals, mBoneIndices,
+				&mBuildStats, mVertexFormat, bounds_min.data(), bounds_max.data(), mDecode);
+	} else {
+		mBgfxMesh = bgfxutils::createMeshFromStdVectors (mVertices, mNormals, mColors,
+				&mBuildStats, mVertexFormat, bounds_min.data(), bounds_max.data(), mDecode);
+	}
+
+	gLog ("Mesh: %d -> %d vertices (%.1f%%, %d bytes), ACMR %.3f unindexed, %.3f welded, %.3f optimized",
+			mBuildStats.numInputVertices,
+			mBuildStats.numVertices,
+			mBuildStats.numInputVertices > 0
+				? 100.f * mBuildStats.numVertices / mBuildStats.numInputVertices
+				: 0.f,
+			mBuildStats.vertexSize,
+			mBuildStats.acmrUnindexed,
+			mBuildStats.acmrWelded,
+			mBuildStats.acmrOptimized);
+}
+
+void Mesh::ReleaseCpuData() {
+	if (mBgfxMesh == nullptr) {
+		gLog ("Warning: releasing the vertex data of a mesh without GPU buffers");
+	}
+
+	std::vector<Vector4f>().swap(mVertices);
+	std::vector<Vector3f>().swap(mNormals);
+	std::vector<Vector4f>().swap(mColors);
+	std::vector<uint8_t>().swap(mBoneIndices);
+	mCpuDataReleased = true;
+
+	for (Mesh* lod : mLods) {
+		lod->ReleaseCpuData();
+	}
+}
+
+void Mesh::ClearLods() {
+	for (Mesh* lod : mLods) {
+		delete lod;
+	}
+	mLods.clear();
+	mLodErrors.clear();
+}
+
+const Mesh* Mesh::GetLod(int level) const {
+	if (level <= 0 || mLods.size() == 0) {
+		return this;
+	}
+
+	if (level > (int) mLods.size()) {
+		level = (int) mLods.size();
+	}
+
+	return mLods[level - 1];
+}
+
+// meshes with fewer triangles are not simplified any further
+static const uint32_t cMinLodTriangles = 32;
+
+void Mesh::GenerateLods(int max_lods, float reduction) {
+	ClearLods();
+
+	if (mCpuDataReleased) {
+		gLog ("Error: cannot generate LODs, the vertex data of the mesh was released");
+		return;
+	}
+
+	uint32_t num_corners = mVertices.size();
+	if (num_corners < 3 || num_corners % 3 != 0) {
+		return;
+	}
+
+	bool has_colors = mColors.size() == num_corners;
+	bool has_bones = mBoneIndices.size() == num_corners;
+
+	// The topology only considers positions. Vertices of different bones
+	// stay separate as they move independently.
+	struct WeldKey {
+		float position[3];
+		uint32_t bone;
+	};
+
+	std::vector<WeldKey> keys(num_corners);
+	for (uint32_t i = 0; i < num_corners; i++) {
+		keys[i].position[0] = mVertices[i][0];
+		keys[i].position[1] = mVertices[i][1];
+		keys[i].position[2] = mVertices[i][2];
+		keys[i].bone = has_bones ? mBoneIndices[i] : 0;
+	}
+
+	std::vector<uint32_t> base_indices(num_corners);
+	uint32_t num_positions = MeshOptimizer::WeldVertices(
+			keys.data(), num_corners, sizeof(WeldKey), base_indices.data());
+
+	std::vector<float> positions(3 * num_positions);
+	for (uint32_t i = 0; i < num_corners; i++) {
+		memcpy(&positions[3 * base_indices[i]], keys[i].position, 3 * sizeof(float));
+	}
+
+	std::vector<uint32_t> indices;
+	std::vector<uint32_t> source_triangles(num_corners / 3);
+	uint32_t num_indices = num_corners;
+
+	for (int level = 1; level <= max_lods; level++) {
+		uint32_t target = uint32_t(num_indices * reduction) / 3 * 3;
+		if (target < 3 * cMinLodTriangles) {
+			break;
+		}
+
+		// every level is simplified from the full mesh to not accumulate
+		// the errors of the previous levels
+		indices = base_indices;
+		float error = 0.f;
+		uint32_t num_lod_indices = MeshOptimizer::SimplifyMesh(
+				indices.data(),
+				num_corners,
+				positions.data(),
+				num_positions,
+				target,
+				source_triangles.data(),
+				&error);
+
+		// stop once the mesh cannot be reduced noticeably
+		if (num_lod_indices == 0 || num_lod_indices > num_indices * 0.9f) {
+			break;
+		}
+
+		// Surviving corners keep the attributes of their original vertex
+		// and take the position of the vertex they were collapsed onto.
+		Mesh* lod = new Mesh();
+		lod->mVertices.resize(num_lod_indices);
+		lod->mNormals.resize(num_lod_indices);
+		if (has_colors) {
+			lod->mColors.resize(num_lod_indices);
+		}
+		if (has_bones) {
+			lod->mBoneIndices.resize(num_lod_indices);
+		}
+
+		for (uint32_t i = 0; i < num_lod_indices; i++) {
+			uint32_t corner = 3 * source_triangles[i / 3] + i % 3;
+			const float* p = &positions[3 * indices[i]];
+			lod->mVertices[i] = Vector4f(p[0], p[1], p[2], 1.f);
+			lod->mNormals[i] = mNormals[corner];
+			if (has_colors) {
+				lod->mColors[i] = mColors[corner];
+			}
+			if (has_bones) {
+				lod->mBoneIndices[i] = mBoneIndices[corner];
+			}
+		}
+
+		lod->mVertexFormat = mVertexFormat;
+		lod->UpdateBounds();
+		lod->Update();
+
+		if (lod->mBgfxMesh == nullptr) {
+			delete lod;
+			break;
+		}
+
+		gLog ("Mesh LOD %d: %d -> %d triangles, error %.6f", level,
+				num_corners / 3, num_lod_indices / 3, error);
+
+		mLods.push_back(lod);
+		mLodErrors.push_back(error);
+		num_indices = num_lod_indices;
+	}
 }
 
 void Mesh::UpdateBounds() {
@@ -950,6 +1392,14 @@ void Mesh::Submit (const RenderState *state, const float* matrix) const {
 			matrix);
 }
 
+void Mesh::Enqueue (RenderQueue *queue, const RenderState *state, float depth) const {
+	bgfxutils::meshEnqueue (
+			mBgfxMesh,
+			queue,
+			state,
+			depth);
+}
+
 void Mesh::Transform(const Matrix44f &transform) {
 	for (int i = 0; i < mVertices.size(); ++i) {
 		mVertices[i] = (transform.transpose() * mVertices[i]);
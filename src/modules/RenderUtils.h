@@ -8,9 +8,35 @@
 
 // Forward declarations
 struct RenderState;
+struct RenderQueue;
 
 namespace bgfxutils {
 struct Mesh;
+
+// Result of the welding and vertex cache optimization of a mesh. The ACMR
+// (average cache miss ratio) is the number of transformed vertices per
+// triangle for a 16 entry FIFO cache.
+struct MeshBuildStats {
+	uint32_t numInputVertices = 0;
+	uint32_t numVertices = 0;
+	uint32_t numIndices = 0;
+	float acmrUnindexed = 0.f;
+	float acmrWelded = 0.f;
+	float acmrOptimized = 0.f;
+	uint32_t vertexSize = 0;
+};
+
+// Vertex formats of the GPU buffers of a Mesh. The packed formats use 12
+// instead of 20 bytes per vertex: the positions are stored as half floats
+// relative to the center of the bounds or as 16 bit integers quantized
+// within the bounds, normals are octahedral encoded into two bytes and
+// colors are stored as RGBA8. The shaders decode them using u_meshDecode,
+// see Mesh::mDecode.
+enum MeshVertexFormat {
+	MeshVertexFloat,
+	MeshVertexHalf,
+	MeshVertexQuantized
+};
 }
 
 struct Mesh {
@@ -18,15 +44,48 @@ struct Mesh {
  	std::vector<Vector4f> mVertices;
  	std::vector<Vector3f> mNormals;
  	std::vector<Vector4f> mColors;
+	/// Skinning matrix of every vertex (rigid skinning). If set, Update()
+	/// creates a mesh for the skinned shaders.
+	std::vector<uint8_t> mBoneIndices;
+	bgfxutils::MeshBuildStats mBuildStats;
 	Vector3f mBoundsMin = Vector3f(0.f, 0.f, 0.f);
 	Vector3f mBoundsMax = Vector3f(0.f, 0.f, 0.f);
 
+	/// Format of the vertex buffer created by Update()
+	bgfxutils::MeshVertexFormat mVertexFormat = bgfxutils::MeshVertexFloat;
+	/// Scale (xyz) and offset (xyz) that decode the stored positions, w of
+	/// the scale is 1 for octahedral encoded normals
+	float mDecode[8] = { 1.f, 1.f, 1.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+	/// Set by ReleaseCpuData(), the mesh can no longer be updated
+	bool mCpuDataReleased = false;
+
+	/// Simplified versions of this mesh, mLods[i] is level i + 1 and has
+	/// about half the triangles of the previous level. Owned by this mesh.
+	std::vector<Mesh*> mLods;
+	/// Largest quadric error (squared distance) of every level in mLods
+	std::vector<float> mLodErrors;
+
 	~Mesh();
 	void Update();
+	/// Frees the vertex data in main memory once the GPU buffers exist.
+	/// Bounds and build statistics are kept. Also releases the data of the
+	/// LODs.
+	void ReleaseCpuData();
+	/// Builds up to max_lods simplified meshes using quadric edge collapses.
+	/// Every level keeps reduction times the triangles of the previous one.
+	/// Vertices with the same position (and bone) are treated as one such
+	/// that seams of normals or colors do not tear open.
+	void GenerateLods(int max_lods = 4, float reduction = 0.5f);
+	void ClearLods();
+	/// Returns the mesh of the given level, 0 is the mesh itself. Levels
+	/// beyond the coarsest one return the coarsest one.
+	const Mesh* GetLod(int level) const;
+	int GetNumLods() const { return 1 + (int) mLods.size(); }
 	void UpdateBounds ();
 	void Merge (const Mesh& other, 
 			const Matrix44f &transform = Matrix44f::Identity());
 	void Submit (const RenderState *state, const float* matrix) const;
+	void Enqueue (RenderQueue *queue, const RenderState *state, float depth) const;
 	void Transform (const Matrix44f &mat);
 
 	static Mesh *sCreateCuboid (float width, float height, float depth);
@@ -58,6 +117,37 @@ namespace bgfxutils {
 	void meshSubmit(const Mesh *_mesh, const RenderState*_state, uint8_t _numPasses, const float *_mtx,
 					uint16_t _numMatrices = 1);
 
+	// Records the draws of the mesh with the transform, uniforms and
+	// instance data that were set in the queue
+	void meshEnqueue(const Mesh *_mesh, RenderQueue *_queue, const RenderState *_state, float _depth);
+
+	// Creates an indexed mesh from a triangle list: identical vertices get
+	// welded and the triangles are reordered for the vertex cache. Returns
+	// nullptr if the mesh needs 32 bit indices and these are not supported.
+	// The positions of the packed formats are encoded within the given
+	// bounds and decode is set to the values of u_meshDecode.
+	Mesh *createMeshFromStdVectors(
+			const std::vector<Vector4f> &vertices,
+			const std::vector<Vector3f> &normals,
+			const std::vector<Vector4f> &colors,
+			MeshBuildStats* stats = nullptr,
+			MeshVertexFormat format = MeshVertexFloat,
+			const float* bounds_min = nullptr,
+			const float* bounds_max = nullptr,
+			float* decode = nullptr);
+
+	// Same as createMeshFromStdVectors() with a skinning matrix index per
+	// vertex instead of a color.
+	Mesh *createSkinnedMeshFromStdVectors(
+			const std::vector<Vector4f> &vertices,
+			const std::vector<Vector3f> &normals,
+			const std::vector<uint8_t> &bone_indices,
+			MeshBuildStats* stats = nullptr,
+			MeshVertexFormat format = MeshVertexFloat,
+			const float* bounds_min = nullptr,
+			const float* bounds_max = nullptr,
+			float* decode = nullptr);
+
 	// Loads the mesh data from a VBO into a bgfx Mesh
 //	Mesh *createMeshFromVBO (const MeshVBO& mesh_buffer);
 
@@ -3,6 +3,7 @@
 #include "3rdparty/ocornut-imgui/imgui.h"
 #include "imgui/imgui.h"
 #include <bx/fpumath.h>
+#include <bx/timer.h>
 #include <GLFW/glfw3.h>
 #include "SimpleMath/SimpleMath.h"
 #include "SimpleMath/SimpleMathMap.h"
@@ -11,6 +12,8 @@
 #include "RuntimeModuleManager.h"
 #include "Serializer.h"
 #include "Timer.h"
+#include "Profiler.h"
+#include "RewindBuffer.h"
 
 #include "modules/RenderModule.h"
 #include "modules/CharacterModule.h"
@@ -22,29 +25,266 @@ using namespace std;
 
 bool fps_camera = true;
 
+// Draws a crowd of copies of the character to compare the submission of
+// the entity meshes one by one, instanced and as skinned meshes, and the
+// triangles submitted with and without LODs for crowds at different
+// distances. The copies share the meshes of the character and follow its
+// animation.
+struct RenderBenchmark {
+	static const int cNumWarmupFrames = 10;
+	static const int cNumFrames = 120;
+	static const int cNumModes = 3;
+
+	enum Mode {
+		ModeMeshes,
+		ModeInstanced,
+		ModeSkinned
+	};
+	static const char* sModeNames[cNumModes];
+
+	std::vector<Entity*> crowd;
+	int crowd_size = 1;
+	// distance between the characters of the crowd
+	float spacing = 1.5f;
+
+	struct Run {
+		int crowd_size;
+		int mode;
+		float spacing;
+		bool lods;
+	};
+	std::vector<Run> runs;
+	// settings before the benchmark, restored once all runs are done
+	Run saved;
+
+	bool running = false;
+	int run_index = 0;
+	int frame = 0;
+	uint64_t num_draw_calls = 0;
+	uint64_t num_triangles = 0;
+	double submit_time = 0.;
+
+	struct Result {
+		Run run;
+		double draw_calls;
+		double triangles;
+		double submit_time;
+	};
+	std::vector<Result> results;
+
+	void CreateCrowd(CharacterEntity* character, int size);
+	void DestroyCrowd();
+	void UpdateCrowd(CharacterEntity* character);
+	// crowd sizes 1, 100 and 1000 in every mode
+	void StartModes();
+	// a crowd of 256 characters at increasing distances with and without
+	// LODs in the current mode
+	void StartLods();
+	void Start();
+	void Step(CharacterEntity* character);
+	static int GetMode();
+	static void SetMode(int mode);
+};
+
+const char* RenderBenchmark::sModeNames[cNumModes] = {
+	"meshes",
+	"instanced",
+	"skinned"
+};
+
+void RenderBenchmark::CreateCrowd(CharacterEntity* character, int size) {
+	DestroyCrowd();
+
+	crowd_size = size;
+	const Entity* source = character->mEntity;
+	for (int i = 1; i < size; i++) {
+		Entity* entity = gRenderer->createEntity();
+		entity->mSkeleton = source->mSkeleton;
+		entity->mColor = Vector4f (
+				0.4f + 0.6f * float(i % 7) / 6.f,
+				0.4f + 0.6f * float(i % 5) / 4.f,
+				0.4f + 0.6f * float(i % 3) / 2.f,
+				1.f);
+
+		for (int j = 0; j < source->mSkeletonMeshes.Length(); j++) {
+			entity->mSkeletonMeshes.AddSharedMesh(
+					source->mSkeletonMeshes.mMeshBoneIndices[j].first,
+					source->mSkeletonMeshes.mMeshBoneIndices[j].second);
+		}
+		entity->mSkeletonMeshes.SetSharedSkinnedMesh(source->mSkeletonMeshes);
+
+		crowd.push_back(entity);
+	}
+}
+
+void RenderBenchmark::DestroyCrowd() {
+	for (Entity* entity : crowd) {
+		gRenderer->destroyEntity(entity);
+	}
+	crowd.clear();
+	crowd_size = 1;
+}
+
+// places the copies on a grid around the character
+void RenderBenchmark::UpdateCrowd(CharacterEntity* character) {
+	const Skeleton& skeleton = character->mEntity->mSkeleton;
+	const int cGridSize = 32;
+
+	for (size_t i = 0; i < crowd.size(); i++) {
+		int index = int(i) + 1;
+		Vector3f offset (
+				spacing * float(index % cGridSize - cGridSize / 2),
+				0.f,
+				-spacing * float(index / cGridSize + 1));
+
+		std::vector<Matrix44f>& bone_matrices = crowd[i]->mSkeleton.mBoneMatrices;
+		bone_matrices = skeleton.mBoneMatrices;
+		for (Matrix44f& matrix : bone_matrices) {
+			matrix(3,0) += offset[0];
+			matrix(3,1) += offset[1];
+			matrix(3,2) += offset[2];
+		}
+	}
+}
+
+int RenderBenchmark::GetMode() {
+	if (gRenderer->drawSkinned) {
+		return ModeSkinned;
+	}
+
+	return gRenderer->drawInstanced ? ModeInstanced : ModeMeshes;
+}
+
+void RenderBenchmark::SetMode(int mode) {
+	gRenderer->drawSkinned = mode == ModeSkinned;
+	// entities without a skinned mesh fall back to the instanced drawing
+	gRenderer->drawInstanced = mode != ModeMeshes;
+}
+
+void RenderBenchmark::StartModes() {
+	static const int cCrowdSizes[] = { 1, 100, 1000 };
+
+	runs.clear();
+	for (int crowd_size : cCrowdSizes) {
+		for (int mode = 0; mode < cNumModes; mode++) {
+			Run run = { crowd_size, mode, 1.5f, gRenderer->useLods };
+			runs.push_back(run);
+		}
+	}
+
+	Start();
+}
+
+void RenderBenchmark::StartLods() {
+	static const float cSpacings[] = { 1.5f, 4.f, 10.f, 25.f };
+
+	runs.clear();
+	for (float spacing : cSpacings) {
+		for (int lods = 0; lods < 2; lods++) {
+			Run run = { 256, GetMode(), spacing, lods != 0 };
+			runs.push_back(run);
+		}
+	}
+
+	Start();
+}
+
+void RenderBenchmark::Start() {
+	saved.crowd_size = crowd_size;
+	saved.mode = GetMode();
+	saved.spacing = spacing;
+	saved.lods = gRenderer->useLods;
+
+	running = true;
+	run_index = -1;
+	frame = cNumWarmupFrames + cNumFrames;
+	results.clear();
+}
+
+// Called once per frame. The renderer statistics are those of the last
+// frame, the first frames of every run are skipped.
+void RenderBenchmark::Step(CharacterEntity* character) {
+	if (frame >= cNumWarmupFrames) {
+		num_draw_calls += gRenderer->entityStats.numDrawCalls;
+		num_triangles += gRenderer->entityStats.numTriangles;
+		submit_time += gRenderer->entityStats.submitTime;
+	}
+	frame++;
+
+	if (frame < cNumWarmupFrames + cNumFrames) {
+		return;
+	}
+
+	if (run_index >= 0) {
+		Result result;
+		result.run = runs[run_index];
+		result.draw_calls = double(num_draw_calls) / cNumFrames;
+		result.triangles = double(num_triangles) / cNumFrames;
+		result.submit_time = submit_time / cNumFrames;
+		results.push_back(result);
+
+		gLog ("Render benchmark: %4d characters, spacing %4.1f, %-9s, LODs %-3s: %8.1f draw calls, %10.0f triangles, submit %7.3f ms",
+				result.run.crowd_size,
+				result.run.spacing,
+				sModeNames[result.run.mode],
+				result.run.lods ? "on" : "off",
+				result.draw_calls,
+				result.triangles,
+				result.submit_time * 1000.);
+	}
+
+	run_index++;
+	if (run_index == (int) runs.size()) {
+		running = false;
+		CreateCrowd(character, saved.crowd_size);
+		spacing = saved.spacing;
+		SetMode(saved.mode);
+		gRenderer->useLods = saved.lods;
+		return;
+	}
+
+	const Run& run = runs[run_index];
+	CreateCrowd(character, run.crowd_size);
+	spacing = run.spacing;
+	SetMode(run.mode);
+	gRenderer->useLods = run.lods;
+	frame = 0;
+	num_draw_calls = 0;
+	num_triangles = 0;
+	submit_time = 0.;
+}
+
 // Boilerplate for the module reload stuff
 
-struct module_state {
+MODULE_STATE_DEPENDS(CharacterEntity, RenderBenchmark, StreamingPath);
+MODULE_STATE({
 	bool fps_camera;
 	float camera_theta;
 	float camera_phi;
 	bool modules_window_visible = false;
 	bool imgui_demo_window_visible = false;
 	bool character_properties_window_visible = false;
+	bool profiler_window_visible = false;
+	bool rewind_window_visible = false;
+	bool render_benchmark_window_visible = false;
 	int modules_window_selected_index = -1;
 
 	CharacterEntity* character = nullptr;
-};
+	RenderBenchmark* render_benchmark = nullptr;
+	StreamingPath* trajectory = nullptr;
+});
 
 void handle_mouse (struct module_state *state) {
-	if (!glfwGetWindowAttrib(gWindow, GLFW_FOCUSED)) {
+	if (!gGuiInputState->focused) {
 		return;
 	}
 
-	if (glfwGetMouseButton(gWindow, 1)) {
-		glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-	} else {
-		glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+	if (gWindow != nullptr) {
+		if (gGuiInputState->mouseButton & 2) {
+			glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		} else {
+			glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+		}
 	}
 
 	Camera *active_camera = &gRenderer->cameras[gRenderer->activeCameraIndex];
@@ -55,7 +295,7 @@ void handle_mouse (struct module_state *state) {
 	Vector3f eye = active_camera->eye;
 	Vector3f poi = active_camera->poi;
 
-	if (glfwGetMouseButton(gWindow, 1)) {
+	if (gGuiInputState->mouseButton & 2) {
 		Vector3f view_dir;
 
 		view_dir = (poi - eye).normalized();
@@ -76,14 +316,16 @@ void handle_mouse (struct module_state *state) {
 }
 
 void handle_keyboard (struct module_state *state, float dt) {
-	if (!glfwGetWindowAttrib(gWindow, GLFW_FOCUSED)) {
+	if (!gGuiInputState->focused) {
 		return;
 	}
 
-	if (glfwGetMouseButton(gWindow, 1)) {
-		glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-	} else {
-		glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+	if (gWindow != nullptr) {
+		if (gGuiInputState->mouseButton & 2) {
+			glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		} else {
+			glfwSetInputMode(gWindow, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+		}
 	}
 
 	Camera *active_camera = &gRenderer->cameras[gRenderer->activeCameraIndex];
@@ -94,34 +336,34 @@ void handle_keyboard (struct module_state *state, float dt) {
 	Vector3f forward = camera_rot_inv.transpose() * Vector3f (0.f, 0.f, 1.f);
 	Vector3f right = camera_rot_inv.transpose() * Vector3f (1.f, 0.f, 0.f);
 
-	if (glfwGetMouseButton(gWindow, 1)) {
+	if (gGuiInputState->mouseButton & 2) {
 		// Right mouse button pressed, move the camera
 		Vector3f eye = active_camera->eye;
 		Vector3f poi = active_camera->poi;
 
 		Vector3f direction (0.f, 0.f, 0.f);
 
-		if (glfwGetKey(gWindow, GLFW_KEY_W) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_W)) {
 			direction -= forward;
 		} 
 
-		if (glfwGetKey(gWindow, GLFW_KEY_S) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_S)) {
 			direction += forward;
 		}
 
-		if (glfwGetKey(gWindow, GLFW_KEY_D) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_D)) {
 			direction += right;
 		} 
 
-		if (glfwGetKey(gWindow, GLFW_KEY_A) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_A)) {
 			direction -= right;
 		}
 
-		if (glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_SPACE)) {
 			direction += Vector3f (0.f, 1.f, 0.f);
 		}
 
-		if (glfwGetKey(gWindow, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_LEFT_CONTROL)) {
 			direction += Vector3f (0.f, -1.f, 0.f);
 		}
 
@@ -139,36 +381,36 @@ void handle_keyboard (struct module_state *state, float dt) {
 		Vector3f forward_plane = Vector3f (0.0f, 1.0f, 0.0f).cross(right);
 
 		// Reset the character control state:
-		if (glfwGetKey(gWindow, GLFW_KEY_W) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_W)) {
 			controller.mDirection += forward_plane;
 		} 
 
-		if (glfwGetKey(gWindow, GLFW_KEY_S) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_S)) {
 			controller.mDirection -= forward_plane;
 		}
 
-		if (glfwGetKey(gWindow, GLFW_KEY_D) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_D)) {
 			controller.mDirection += right;
 		} 
 
-		if (glfwGetKey(gWindow, GLFW_KEY_A) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_A)) {
 			controller.mDirection -= right;
 		}
 
-		if (glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_PRESS) {
+		if (gGuiInputState->IsKeyPressed(GLFW_KEY_SPACE)) {
 			controller.mState[CharacterController::ControlStateJump] = true;	
 		}
 	}
 
 	// handle pause
-	if (glfwGetKey(gWindow, GLFW_KEY_P) == GLFW_PRESS) {
+	if (gGuiInputState->IsKeyPressed(GLFW_KEY_P)) {
 		gTimer->mPaused = !gTimer->mPaused;	
 	} 
 }
 
 void update_character(module_state* state, float dt) {
 	if (state->character != nullptr) {
-		state->character->Update(dt);
+		state->character->Update(gTimer->mSimulationAlpha);
 	}
 }
 
@@ -182,16 +424,34 @@ static struct module_state *module_init() {
 	return state;
 }
 
+// State that is advanced by the simulation, also used by the rewind buffer
+template <typename Serializer>
+static void module_serialize_simulation (
+		struct module_state *state,
+		Serializer* serializer) {
+	CharacterEntity* character = state->character;
+	SerializeVec3(*serializer, SERIALIZER_KEY("protot.TestModule.entity.mPosition"), character->mPosition);
+	SerializeVec3(*serializer, SERIALIZER_KEY("protot.TestModule.entity.mVelocity"), character->mVelocity);
+	SerializeArray(*serializer, SERIALIZER_KEY("protot.TestModule.entity.mRotation"), character->mRotation.data(), 4);
+	// only restored if the rig still has the same number of DOFs
+	SerializeArray(*serializer, SERIALIZER_KEY("protot.TestModule.entity.mRigState.q"), character->mRigState.q.data(), character->mRigState.q.size());
+	SerializeArray(*serializer, SERIALIZER_KEY("protot.TestModule.entity.mAnimTime"), &character->mAnimTime, 1);
+	SerializeArray(*serializer, SERIALIZER_KEY("protot.TestModule.entity.mController.mState"), character->mController.mState, CharacterController::ControlStateLast);
+	SerializeVec3(*serializer, SERIALIZER_KEY("protot.TestModule.entity.mController.mDirection"), character->mController.mDirection);
+}
+
 template <typename Serializer>
 static void module_serialize (
 		struct module_state *state,
 		Serializer* serializer) {
-	SerializeVec3(*serializer, "protot.TestModule.entity.mPosition", state->character->mPosition);
-	SerializeVec3(*serializer, "protot.TestModule.entity.mVelocity", state->character->mVelocity);
-	SerializeBool(*serializer, "protot.TestModule.character_window.visible", state->character_properties_window_visible);
-	SerializeBool(*serializer, "protot.TestModule.modules_window.visible", state->modules_window_visible);
-	SerializeBool(*serializer, "protot.TestModule.imgui_demo_window_visible", state->imgui_demo_window_visible);
-	SerializeInt(*serializer, "protot.TestModule.modules_window.selection_index", state->modules_window_selected_index);
+	module_serialize_simulation(state, serializer);
+	SerializeBool(*serializer, SERIALIZER_KEY("protot.TestModule.character_window.visible"), state->character_properties_window_visible);
+	SerializeBool(*serializer, SERIALIZER_KEY("protot.TestModule.modules_window.visible"), state->modules_window_visible);
+	SerializeBool(*serializer, SERIALIZER_KEY("protot.TestModule.imgui_demo_window_visible"), state->imgui_demo_window_visible);
+	SerializeBool(*serializer, SERIALIZER_KEY("protot.TestModule.profiler_window.visible"), state->profiler_window_visible);
+	SerializeBool(*serializer, SERIALIZER_KEY("protot.TestModule.rewind_window.visible"), state->rewind_window_visible);
+	SerializeBool(*serializer, SERIALIZER_KEY("protot.TestModule.render_benchmark_window.visible"), state->render_benchmark_window_visible);
+	SerializeInt(*serializer, SERIALIZER_KEY("protot.TestModule.modules_window.selection_index"), state->modules_window_selected_index);
 }
 
 static void module_finalize(struct module_state *state) {
@@ -206,11 +466,20 @@ static void module_reload(struct module_state *state, void* read_serializer) {
 
 	state->character = new CharacterEntity;
 	state->character->mPosition = Vector3f (0.f, 0.f, 0.f);
+	state->render_benchmark = new RenderBenchmark;
+
+	state->trajectory = nullptr;
+	if (gRenderer != nullptr) {
+		state->trajectory = gRenderer->createStreamingPath(100000);
+	}
 
 	// load the state of the entity
 	if (read_serializer != nullptr) {
 		module_serialize(state, static_cast<ReadSerializer*>(read_serializer));
 	}
+	state->character->mPrevPosition = state->character->mPosition;
+	state->character->mPrevRotation = state->character->mRotation;
+	state->character->mPrevRigState = state->character->mRigState;
 }
 
 static void module_unload(struct module_state *state, void* write_serializer) {
@@ -219,13 +488,56 @@ static void module_unload(struct module_state *state, void* write_serializer) {
 		module_serialize(state, static_cast<WriteSerializer*>(write_serializer));
 	}
 
-	// clean up
+	// clean up, the crowd shares the meshes of the character
+	state->render_benchmark->DestroyCrowd();
+	delete state->render_benchmark;
+	state->render_benchmark = nullptr;
+
+	if (state->trajectory != nullptr && gRenderer != nullptr) {
+		gRenderer->destroyStreamingPath(state->trajectory);
+	}
+	state->trajectory = nullptr;
+
 	state->character->mEntity = nullptr;
 	delete state->character;
 
 	std::cout << "TestModule unloaded. State: " << state << std::endl;
 }
 
+// The character stays alive when the state is handed over to the new
+// version of the module, so neither the rig nor the animation get
+// reloaded.
+static void module_suspend(struct module_state *state) {
+	state->fps_camera = fps_camera;
+
+	std::cout << "TestModule suspended. State: " << state << std::endl;
+}
+
+static void module_resume(struct module_state *state) {
+	fps_camera = state->fps_camera;
+
+	std::cout << "TestModule resumed. State: " << state << std::endl;
+}
+
+static void module_capture(struct module_state *state, void* write_serializer) {
+	if (state->character != nullptr) {
+		module_serialize_simulation(state, static_cast<WriteSerializer*>(write_serializer));
+	}
+}
+
+static void module_restore(struct module_state *state, void* read_serializer) {
+	if (state->character == nullptr) {
+		return;
+	}
+
+	module_serialize_simulation(state, static_cast<ReadSerializer*>(read_serializer));
+
+	// do not interpolate towards the restored state
+	state->character->mPrevPosition = state->character->mPosition;
+	state->character->mPrevRotation = state->character->mRotation;
+	state->character->mPrevRigState = state->character->mRigState;
+}
+
 void ShowModulesWindow(struct module_state *state) {
 //	ImGui::PushStyleColor(ImGuiCol_WindowBg, ImVec4 (0.5f, 0.5f, 0.5f, 0.8f));
 	if (ImGui::BeginDock("Modules")) {
@@ -267,13 +579,18 @@ void ShowModulesWindow(struct module_state *state) {
 			ImGui::LabelText("id", "%ld", selected_module->id);
 			ImGui::LabelText("mtime", "%ld", selected_module->mtime);
 			ImGui::LabelText("mtimensec", "%ld", selected_module->mtimensec);
+			ImGui::LabelText("path", "%s", selected_module->path.c_str());
+
+			for (int i = 0; i < selected_module->dependencies.size(); i++) {
+				ImGui::LabelText("Depends on", "%s",
+						selected_module->dependencies[i]->name.c_str());
+			}
 
 			//		ImGui::LabelText("mtime", "%s", ctime((time_t*)&selected_module->mtime));
 			//		cout << "time_buf = " << ctime((time_t*)&selected_module->mtime) << endl;
 
 			if (ImGui::Button ("Force Reload")) {
-				selected_module->mtime = 0;
-				selected_module->id = 0;
+				selected_module->changed = true;
 			}
 		}
 	}
@@ -284,6 +601,229 @@ void ShowModulesWindow(struct module_state *state) {
 
 }
 
+// Flame graph of the last frame: one block of rows per thread, one row
+// per nesting depth.
+void ShowProfilerWindow(struct module_state *state) {
+	if (ImGui::BeginDock("Profiler")) {
+		Profiler* profiler = gProfiler;
+
+		if (profiler != nullptr && profiler->mFrames.size() > 0) {
+			const Profiler::Frame& frame = profiler->mFrames.back();
+			const double frame_duration = double(frame.end - frame.start);
+			const double to_ms = 1000.0 / double(bx::getHPFrequency());
+
+			ImGui::Text("Frame: %.3f ms", frame_duration * to_ms);
+			ImGui::SameLine();
+			if (ImGui::Button("Export Chrome Trace")) {
+				profiler->WriteChromeTrace("profile.json");
+			}
+
+			// number of rows needed for each thread
+			std::vector<int> thread_depths;
+			for (int i = 0; i < profiler->mZones.size(); i++) {
+				const Profiler::Zone& zone = profiler->mZones[i];
+				if (zone.end < frame.start || zone.start > frame.end) {
+					continue;
+				}
+
+				if (zone.threadIndex >= thread_depths.size()) {
+					thread_depths.resize(zone.threadIndex + 1, 0);
+				}
+				thread_depths[zone.threadIndex] = 
+					std::max(thread_depths[zone.threadIndex], zone.depth + 1);
+			}
+
+			std::vector<int> thread_rows(thread_depths.size(), 0);
+			int num_rows = 0;
+			for (int i = 0; i < thread_depths.size(); i++) {
+				thread_rows[i] = num_rows;
+				if (thread_depths[i] > 0) {
+					num_rows += thread_depths[i] + 1;
+				}
+			}
+
+			const float row_height = 18.0f;
+			ImDrawList* draw_list = ImGui::GetWindowDrawList();
+			ImVec2 origin = ImGui::GetCursorScreenPos();
+			float width = std::max(ImGui::GetContentRegionAvail().x, 1.0f);
+
+			for (int i = 0; i < thread_depths.size(); i++) {
+				if (thread_depths[i] == 0) {
+					continue;
+				}
+
+				draw_list->AddText(
+						ImVec2(origin.x, origin.y + thread_rows[i] * row_height), 
+						0xffffffff,
+						profiler->GetThreadName(i).c_str());
+			}
+
+			for (int i = 0; i < profiler->mZones.size(); i++) {
+				const Profiler::Zone& zone = profiler->mZones[i];
+				if (zone.end < frame.start || zone.start > frame.end) {
+					continue;
+				}
+
+				float x0 = origin.x + width * 
+					std::max(zone.start - frame.start, int64_t(0)) / frame_duration;
+				float x1 = origin.x + width * 
+					std::min(zone.end - frame.start, frame.end - frame.start) / frame_duration;
+				float y0 = origin.y 
+					+ (thread_rows[zone.threadIndex] + zone.depth + 1) * row_height;
+				float y1 = y0 + row_height - 1.0f;
+				x1 = std::max(x1, x0 + 1.0f);
+
+				// color by marker
+				uint32_t hash = (zone.marker + 1) * 2654435761u;
+				ImU32 color = 0xff000000 | (hash & 0x007f7f7f) | 0x00404040;
+
+				ImVec2 zone_min (x0, y0);
+				ImVec2 zone_max (x1, y1);
+				const char* name = profiler->GetMarkerName(zone.marker);
+				draw_list->AddRectFilled(zone_min, zone_max, color);
+
+				draw_list->PushClipRect(zone_min, zone_max, true);
+				draw_list->AddText(ImVec2(x0 + 2.0f, y0 + 2.0f), 0xff000000, name);
+				draw_list->PopClipRect();
+
+				if (ImGui::IsMouseHoveringRect(zone_min, zone_max)) {
+					ImGui::SetTooltip("%s: %.3f ms", name, (zone.end - zone.start) * to_ms);
+				}
+			}
+
+			ImGui::Dummy(ImVec2(width, num_rows * row_height));
+		}
+	}
+
+	ImGui::EndDock();
+}
+
+// Timeline of the frames in the rewind buffer. Dragging the slider pauses
+// the simulation and restores the selected frame.
+void ShowRewindWindow(struct module_state *state) {
+	if (ImGui::BeginDock("Rewind")) {
+		RewindBuffer* rewind_buffer = gRewindBuffer;
+
+		if (rewind_buffer != nullptr) {
+			static int selected_frame = -1;
+			int first_frame = rewind_buffer->GetFirstFrame();
+			int last_frame = rewind_buffer->GetLastFrame();
+
+			ImGui::Checkbox("Paused", &gTimer->mPaused);
+
+			if (!gTimer->mPaused || selected_frame < first_frame || selected_frame > last_frame) {
+				selected_frame = last_frame;
+			}
+
+			if (last_frame >= first_frame) {
+				ImGui::PushItemWidth(-1.0f);
+				if (ImGui::SliderInt("##Frame", &selected_frame, first_frame, last_frame)) {
+					gTimer->mPaused = true;
+					rewind_buffer->RequestRestore(selected_frame);
+				}
+				ImGui::PopItemWidth();
+
+				if (ImGui::Button("<")) {
+					gTimer->mPaused = true;
+					selected_frame = std::max(selected_frame - 1, first_frame);
+					rewind_buffer->RequestRestore(selected_frame);
+				}
+				ImGui::SameLine();
+				if (ImGui::Button(">")) {
+					gTimer->mPaused = true;
+					selected_frame = std::min(selected_frame + 1, last_frame);
+					rewind_buffer->RequestRestore(selected_frame);
+				}
+			}
+
+			int num_frames = rewind_buffer->mNumRecords;
+			ImGui::Text("Frames: %d (%d - %d)", num_frames, first_frame, last_frame);
+			ImGui::Text("Memory: %.2f / %.2f MB, %.1f bytes/frame (last %d bytes)",
+					rewind_buffer->mUsedBytes / (1024. * 1024.),
+					rewind_buffer->GetCapacity() / (1024. * 1024.),
+					num_frames > 0 ? double(rewind_buffer->mUsedBytes) / num_frames : 0.,
+					int(rewind_buffer->mLastFrameSize));
+			ImGui::Text("Capture: %.3f ms (average %.3f ms)",
+					rewind_buffer->mLastCaptureTime * 1000.,
+					rewind_buffer->mAverageCaptureTime * 1000.);
+		}
+	}
+
+	ImGui::EndDock();
+}
+
+void ShowRenderBenchmarkWindow(struct module_state *state) {
+	if (ImGui::BeginDock("Render Benchmark")) {
+		RenderBenchmark* benchmark = state->render_benchmark;
+
+		int crowd_size = benchmark->crowd_size;
+		if (!benchmark->running) {
+			if (ImGui::SliderInt("Characters", &crowd_size, 1, 1000)) {
+				benchmark->CreateCrowd(state->character, crowd_size);
+			}
+			ImGui::SliderFloat("Spacing", &benchmark->spacing, 1.f, 25.f);
+			int mode = RenderBenchmark::GetMode();
+			if (ImGui::Combo("Mode", &mode, RenderBenchmark::sModeNames, RenderBenchmark::cNumModes)) {
+				RenderBenchmark::SetMode(mode);
+			}
+			ImGui::Checkbox("Use LODs", &gRenderer->useLods);
+
+			if (ImGui::Button("Run Benchmark")) {
+				benchmark->StartModes();
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Run LOD Benchmark")) {
+				benchmark->StartLods();
+			}
+		} else {
+			ImGui::Text("Running %d / %d ...",
+					benchmark->run_index + 1,
+					(int) benchmark->runs.size());
+		}
+
+		ImGui::Text("Draw calls: %d, triangles: %d, submit: %.3f ms",
+				gRenderer->entityStats.numDrawCalls,
+				gRenderer->entityStats.numTriangles,
+				gRenderer->entityStats.submitTime * 1000.);
+
+		ImGui::Columns(7);
+		ImGui::Text("Characters"); ImGui::NextColumn();
+		ImGui::Text("Spacing"); ImGui::NextColumn();
+		ImGui::Text("Mode"); ImGui::NextColumn();
+		ImGui::Text("LODs"); ImGui::NextColumn();
+		ImGui::Text("Draw calls"); ImGui::NextColumn();
+		ImGui::Text("Triangles"); ImGui::NextColumn();
+		ImGui::Text("Submit [ms]"); ImGui::NextColumn();
+		for (const RenderBenchmark::Result& result : benchmark->results) {
+			ImGui::Text("%d", result.run.crowd_size); ImGui::NextColumn();
+			ImGui::Text("%.1f", result.run.spacing); ImGui::NextColumn();
+			ImGui::Text("%s", RenderBenchmark::sModeNames[result.run.mode]); ImGui::NextColumn();
+			ImGui::Text("%s", result.run.lods ? "on" : "off"); ImGui::NextColumn();
+			ImGui::Text("%.1f", result.draw_calls); ImGui::NextColumn();
+			ImGui::Text("%.0f", result.triangles); ImGui::NextColumn();
+			ImGui::Text("%.3f", result.submit_time * 1000.); ImGui::NextColumn();
+		}
+		ImGui::Columns(1);
+	}
+
+	ImGui::EndDock();
+}
+
+static void module_simulate(struct module_state *state, float dt) {
+	if (state->character != nullptr) {
+		state->character->Simulate(dt);
+
+		// record the trajectory of the character
+		StreamingPath* trajectory = state->trajectory;
+		Vector3f point = state->character->mPosition + Vector3f (0.f, 0.02f, 0.f);
+		if (trajectory != nullptr
+				&& (trajectory->mCount == 0
+					|| (point - trajectory->mLastPoint).squaredNorm() > 1.0e-4f)) {
+			trajectory->Append(point, Vector4f (1.f, 0.8f, 0.f, 1.f));
+		}
+	}
+}
+
 static bool module_step(struct module_state *state, float dt) {
 	if (gRenderer == nullptr)
 		return false;
@@ -298,6 +838,9 @@ static bool module_step(struct module_state *state, float dt) {
 		ImGui::Checkbox("Modules", &state->modules_window_visible);
 		ImGui::Checkbox("ImGui Demo", &state->imgui_demo_window_visible);
 		ImGui::Checkbox("Character", &state->character_properties_window_visible);
+		ImGui::Checkbox("Profiler", &state->profiler_window_visible);
+		ImGui::Checkbox("Rewind", &state->rewind_window_visible);
+		ImGui::Checkbox("Render Benchmark", &state->render_benchmark_window_visible);
 		
 		ImGui::EndMenu();
 	}
@@ -308,6 +851,18 @@ static bool module_step(struct module_state *state, float dt) {
 		ShowModulesWindow(state);
 	}
 
+	if (state->profiler_window_visible) {
+		ShowProfilerWindow(state);
+	}
+
+	if (state->rewind_window_visible) {
+		ShowRewindWindow(state);
+	}
+
+	if (state->render_benchmark_window_visible) {
+		ShowRenderBenchmarkWindow(state);
+	}
+
 	if (state->character_properties_window_visible && state->character != nullptr) {
 		ShowCharacterPropertiesWindow(state->character);
 	}
@@ -320,6 +875,11 @@ static bool module_step(struct module_state *state, float dt) {
 	handle_keyboard(state, dt);
 	update_character(state, dt);
 
+	if (state->render_benchmark->running) {
+		state->render_benchmark->Step(state->character);
+	}
+	state->render_benchmark->UpdateCrowd(state->character);
+
 	gRenderer->drawDebugAxes (
 			Vector3f (0.f, 0.f, 0.f),
 			Matrix33f::Identity(),
@@ -335,6 +895,18 @@ const struct module_api MODULE_API = {
 	.reload = module_reload,
 	.step = module_step,
 	.unload = module_unload,
-	.finalize = module_finalize
+	.finalize = module_finalize,
+	.state_size = sizeof(struct module_state),
+	.state_layout_hash = module_state_layout_hash,
+	.suspend = module_suspend,
+	.resume = module_resume,
+	.simulate = module_simulate,
+	.step_reads = MODULE_RESOURCE_INPUT | MODULE_RESOURCE_TIMER,
+	.step_writes = MODULE_RESOURCE_ENTITIES | MODULE_RESOURCE_CAMERAS
+		| MODULE_RESOURCE_DEBUG_COMMANDS | MODULE_RESOURCE_GUI
+		| MODULE_RESOURCE_TIMER,
+	.step_flags = MODULE_STEP_CONCURRENT | MODULE_STEP_MAIN_THREAD,
+	.capture = module_capture,
+	.restore = module_restore
 };
 }
@@ -0,0 +1,121 @@
+#include <atomic>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "src/JobSystem.h"
+
+using namespace std;
+
+struct JobSystemFixture : public ::testing::Test {
+	JobSystem job_system;
+
+	JobSystemFixture() {
+		job_system.Init(3);
+	}
+
+	~JobSystemFixture() {
+		job_system.Shutdown();
+	}
+};
+
+TEST_F(JobSystemFixture, ParallelForVisitsAllIndices) {
+	const int num_indices = 1000;
+	vector<atomic<int> > counts(num_indices);
+	for (int i = 0; i < num_indices; i++) {
+		counts[i] = 0;
+	}
+
+	job_system.ParallelFor(0, num_indices, 7, [&counts](int i) {
+		counts[i]++;
+	});
+
+	for (int i = 0; i < num_indices; i++) {
+		EXPECT_EQ(1, counts[i]) << "index " << i;
+	}
+}
+
+TEST_F(JobSystemFixture, ParallelForMoreChunksThanJobs) {
+	// one chunk per index would need more jobs than the ring buffer holds
+	const int num_indices = 3 * JobSystem::cMaxJobsPerThread;
+	vector<atomic<int> > counts(num_indices);
+	for (int i = 0; i < num_indices; i++) {
+		counts[i] = 0;
+	}
+
+	job_system.ParallelFor(0, num_indices, 1, [&counts](int i) {
+		counts[i]++;
+	});
+
+	for (int i = 0; i < num_indices; i++) {
+		ASSERT_EQ(1, counts[i]) << "index " << i;
+	}
+}
+
+TEST_F(JobSystemFixture, NestedParallelFor) {
+	const int num_outer = 16;
+	const int num_inner = 500;
+	atomic<int> count (0);
+
+	job_system.ParallelFor(0, num_outer, 1, [this, &count](int i) {
+		job_system.ParallelFor(0, num_inner, 1, [&count](int j) {
+			count++;
+		});
+	});
+
+	EXPECT_EQ(num_outer * num_inner, count);
+}
+
+static void IncrementJob(Job* job, void* data) {
+	static_cast<atomic<int>*>(data)->fetch_add(1);
+}
+
+TEST_F(JobSystemFixture, MorePendingJobsThanSlots) {
+	const int num_jobs = 3 * JobSystem::cMaxJobsPerThread;
+	atomic<int> count (0);
+
+	for (int i = 0; i < num_jobs; i++) {
+		Job* job = job_system.CreateJob(IncrementJob, &count);
+		job_system.Run(job);
+	}
+	job_system.WaitIdle();
+
+	EXPECT_EQ(num_jobs, count);
+}
+
+struct OrderData {
+	atomic<int>* counter;
+	int order;
+};
+
+static void RecordOrderJob(Job* job, void* data) {
+	OrderData* order_data = static_cast<OrderData*>(data);
+	order_data->order = order_data->counter->fetch_add(1);
+}
+
+TEST_F(JobSystemFixture, Dependencies) {
+	for (int run = 0; run < 100; run++) {
+		atomic<int> counter (0);
+		OrderData a = { &counter, -1 };
+		OrderData b = { &counter, -1 };
+		OrderData c = { &counter, -1 };
+
+		Job* root = job_system.CreateJob(nullptr, nullptr);
+		Job* job_a = job_system.CreateJob(RecordOrderJob, &a, root);
+		Job* job_b = job_system.CreateJob(RecordOrderJob, &b, root);
+		Job* job_c = job_system.CreateJob(RecordOrderJob, &c, root);
+
+		// c runs after b, b runs after a
+		job_system.AddDependency(job_c, job_b);
+		job_system.AddDependency(job_b, job_a);
+
+		job_system.Run(job_c);
+		job_system.Run(job_b);
+		job_system.Run(job_a);
+		job_system.Run(root);
+		job_system.Wait(root);
+
+		EXPECT_EQ(0, a.order);
+		EXPECT_EQ(1, b.order);
+		EXPECT_EQ(2, c.order);
+	}
+}
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <set>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "src/modules/MeshOptimizer.h"
+
+using namespace std;
+
+struct TestMesh {
+	vector<float> positions;
+	vector<uint32_t> indices;
+
+	uint32_t NumVertices() const {
+		return uint32_t(positions.size() / 3);
+	}
+
+	uint32_t AddVertex(float x, float y, float z) {
+		positions.push_back(x);
+		positions.push_back(y);
+		positions.push_back(z);
+		return NumVertices() - 1;
+	}
+
+	void AddTriangle(uint32_t a, uint32_t b, uint32_t c) {
+		indices.push_back(a);
+		indices.push_back(b);
+		indices.push_back(c);
+	}
+};
+
+// Closed unit sphere with counter clockwise triangles seen from outside
+static TestMesh CreateSphere(int num_stacks, int num_slices) {
+	TestMesh mesh;
+	uint32_t top = mesh.AddVertex(0.f, 0.f, 1.f);
+	for (int i = 1; i < num_stacks; i++) {
+		float theta = float(M_PI) * float(i) / float(num_stacks);
+		for (int j = 0; j < num_slices; j++) {
+			float phi = 2.f * float(M_PI) * float(j) / float(num_slices);
+			mesh.AddVertex(
+					sinf(theta) * cosf(phi),
+					sinf(theta) * sinf(phi),
+					cosf(theta));
+		}
+	}
+	uint32_t bottom = mesh.AddVertex(0.f, 0.f, -1.f);
+
+	auto ring = [num_slices](int i, int j) {
+		return uint32_t(1 + (i - 1) * num_slices + j % num_slices);
+	};
+
+	for (int j = 0; j < num_slices; j++) {
+		mesh.AddTriangle(top, ring(1, j), ring(1, j + 1));
+		for (int i = 1; i < num_stacks - 1; i++) {
+			mesh.AddTriangle(ring(i, j), ring(i + 1, j), ring(i + 1, j + 1));
+			mesh.AddTriangle(ring(i, j), ring(i + 1, j + 1), ring(i, j + 1));
+		}
+		mesh.AddTriangle(ring(num_stacks - 1, j), bottom, ring(num_stacks - 1, j + 1));
+	}
+
+	return mesh;
+}
+
+// Grid of size x size quads in the z = 0 plane from (0, 0) to (size, size)
+// with counter clockwise triangles seen from +z
+static TestMesh CreateGrid(int size) {
+	TestMesh mesh;
+	for (int y = 0; y <= size; y++) {
+		for (int x = 0; x <= size; x++) {
+			mesh.AddVertex(float(x), float(y), 0.f);
+		}
+	}
+
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			uint32_t v = uint32_t(y * (size + 1) + x);
+			mesh.AddTriangle(v, v + 1, v + size + 2);
+			mesh.AddTriangle(v, v + size + 2, v + size + 1);
+		}
+	}
+
+	return mesh;
+}
+
+static void TriangleNormal(const TestMesh& mesh, const uint32_t* triangle, float n[3]) {
+	const float* a = &mesh.positions[3 * triangle[0]];
+	const float* b = &mesh.positions[3 * triangle[1]];
+	const float* c = &mesh.positions[3 * triangle[2]];
+	float e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	float e1[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+	n[0] = e0[1] * e1[2] - e0[2] * e1[1];
+	n[1] = e0[2] * e1[0] - e0[0] * e1[2];
+	n[2] = e0[0] * e1[1] - e0[1] * e1[0];
+}
+
+// Triangles as sorted (rotated such that the smallest index comes first)
+// list to compare meshes independent of the triangle order
+static vector<vector<uint32_t> > SortedTriangles(const vector<uint32_t>& indices) {
+	vector<vector<uint32_t> > result;
+	for (size_t i = 0; i < indices.size(); i += 3) {
+		vector<uint32_t> triangle(&indices[i], &indices[i] + 3);
+		rotate(triangle.begin(), min_element(triangle.begin(), triangle.end()), triangle.end());
+		result.push_back(triangle);
+	}
+	sort(result.begin(), result.end());
+	return result;
+}
+
+static void ShuffleTriangles(vector<uint32_t>& indices) {
+	mt19937 random(1234);
+	for (size_t i = indices.size() / 3 - 1; i > 0; i--) {
+		size_t j = random() % (i + 1);
+		for (int k = 0; k < 3; k++) {
+			swap(indices[3 * i + k], indices[3 * j + k]);
+		}
+	}
+}
+
+TEST(MeshOptimizer, WeldVertices) {
+	const float vertices[][2] = {
+		{ 0.f, 0.f },
+		{ 1.f, 0.f },
+		{ 0.f, 0.f },
+		{ 1.f, 1.f },
+		{ 1.f, 0.f },
+		{ 0.f, -0.f },
+	};
+	const uint32_t num_vertices = 6;
+	vector<uint32_t> remap(num_vertices);
+
+	uint32_t num_unique = MeshOptimizer::WeldVertices(
+			vertices, num_vertices, sizeof(vertices[0]), remap.data());
+
+	// -0.f differs bytewise from 0.f
+	EXPECT_EQ(4u, num_unique);
+	EXPECT_EQ(0u, remap[0]);
+	EXPECT_EQ(1u, remap[1]);
+	EXPECT_EQ(0u, remap[2]);
+	EXPECT_EQ(2u, remap[3]);
+	EXPECT_EQ(1u, remap[4]);
+	EXPECT_EQ(3u, remap[5]);
+}
+
+TEST(MeshOptimizer, WeldUnindexedGrid) {
+	TestMesh grid = CreateGrid(8);
+
+	// one vertex per index as in an unindexed triangle list
+	vector<float> vertices;
+	for (uint32_t index : grid.indices) {
+		vertices.insert(vertices.end(),
+				&grid.positions[3 * index],
+				&grid.positions[3 * index] + 3);
+	}
+
+	uint32_t num_vertices = uint32_t(grid.indices.size());
+	vector<uint32_t> remap(num_vertices);
+	uint32_t num_unique = MeshOptimizer::WeldVertices(
+			vertices.data(), num_vertices, 3 * sizeof(float), remap.data());
+
+	EXPECT_EQ(grid.NumVertices(), num_unique);
+	for (uint32_t i = 0; i < num_vertices; i++) {
+		ASSERT_LT(remap[i], num_unique);
+		for (uint32_t j = 0; j < i; j++) {
+			bool same = memcmp(&vertices[3 * i], &vertices[3 * j], 3 * sizeof(float)) == 0;
+			ASSERT_EQ(same, remap[i] == remap[j]);
+		}
+	}
+}
+
+TEST(MeshOptimizer, OptimizeVertexCache) {
+	TestMesh grid = CreateGrid(32);
+	ShuffleTriangles(grid.indices);
+
+	vector<uint32_t> indices = grid.indices;
+	uint32_t num_indices = uint32_t(indices.size());
+	MeshOptimizer::OptimizeVertexCache(indices.data(), num_indices, grid.NumVertices());
+
+	// same triangles with the same winding
+	EXPECT_EQ(SortedTriangles(grid.indices), SortedTriangles(indices));
+
+	float acmr_before = MeshOptimizer::ComputeACMR(grid.indices.data(), num_indices, grid.NumVertices());
+	float acmr_after = MeshOptimizer::ComputeACMR(indices.data(), num_indices, grid.NumVertices());
+	EXPECT_LT(acmr_after, acmr_before);
+	EXPECT_LT(acmr_after, 1.f);
+
+	// optimizing again must not make it worse
+	vector<uint32_t> optimized = indices;
+	MeshOptimizer::OptimizeVertexCache(indices.data(), num_indices, grid.NumVertices());
+	EXPECT_LE(MeshOptimizer::ComputeACMR(indices.data(), num_indices, grid.NumVertices()),
+			MeshOptimizer::ComputeACMR(optimized.data(), num_indices, grid.NumVertices()));
+}
+
+TEST(MeshOptimizer, OptimizeVertexFetch) {
+	TestMesh grid = CreateGrid(16);
+	ShuffleTriangles(grid.indices);
+
+	// one vertex that is not referenced by any triangle
+	uint32_t num_vertices = grid.NumVertices() + 1;
+
+	vector<uint32_t> indices = grid.indices;
+	uint32_t num_indices = uint32_t(indices.size());
+	vector<uint32_t> remap(num_vertices);
+	uint32_t num_used = MeshOptimizer::OptimizeVertexFetch(
+			indices.data(), num_indices, num_vertices, remap.data());
+
+	EXPECT_EQ(grid.NumVertices(), num_used);
+	EXPECT_EQ(UINT32_MAX, remap[num_vertices - 1]);
+
+	uint32_t next_vertex = 0;
+	for (uint32_t i = 0; i < num_indices; i++) {
+		ASSERT_LT(indices[i], num_used);
+		ASSERT_EQ(remap[grid.indices[i]], indices[i]);
+
+		// vertices are numbered in the order of their first reference
+		ASSERT_LE(indices[i], next_vertex);
+		if (indices[i] == next_vertex) {
+			next_vertex++;
+		}
+	}
+
+	// the triangle order and hence the cache behaviour is unchanged
+	EXPECT_FLOAT_EQ(
+			MeshOptimizer::ComputeACMR(grid.indices.data(), num_indices, num_vertices),
+			MeshOptimizer::ComputeACMR(indices.data(), num_indices, num_vertices));
+}
+
+TEST(MeshOptimizer, SimplifyClosedMesh) {
+	TestMesh sphere = CreateSphere(8, 16);
+	uint32_t num_indices = uint32_t(sphere.indices.size());
+	uint32_t target_num_indices = (num_indices / 4) - (num_indices / 4) % 3;
+
+	vector<uint32_t> indices = sphere.indices;
+	vector<uint32_t> source_triangles(num_indices / 3);
+	float error = -1.f;
+	uint32_t result = MeshOptimizer::SimplifyMesh(
+			indices.data(),
+			num_indices,
+			sphere.positions.data(),
+			sphere.NumVertices(),
+			target_num_indices,
+			source_triangles.data(),
+			&error);
+
+	EXPECT_LE(result, target_num_indices);
+	EXPECT_GT(result, 0u);
+	EXPECT_EQ(0u, result % 3);
+	EXPECT_GE(error, 0.f);
+
+	for (uint32_t i = 0; i < result; i += 3) {
+		const uint32_t* triangle = &indices[i];
+		for (int k = 0; k < 3; k++) {
+			ASSERT_LT(triangle[k], sphere.NumVertices());
+		}
+		EXPECT_NE(triangle[0], triangle[1]);
+		EXPECT_NE(triangle[1], triangle[2]);
+		EXPECT_NE(triangle[0], triangle[2]);
+		EXPECT_LT(source_triangles[i / 3], num_indices / 3);
+
+		// no normal points inwards. Triangles along a meridian may end up
+		// with a normal perpendicular to the center, hence the tolerance.
+		float n[3];
+		TriangleNormal(sphere, triangle, n);
+		float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		float center[3] = { 0.f, 0.f, 0.f };
+		for (int k = 0; k < 3; k++) {
+			for (int c = 0; c < 3; c++) {
+				center[c] += sphere.positions[3 * triangle[k] + c] / 3.f;
+			}
+		}
+		EXPECT_GT(n[0] * center[0] + n[1] * center[1] + n[2] * center[2], -1.0e-4f * length)
+			<< "triangle " << i / 3;
+	}
+
+	// the mesh stays closed: every edge is shared by exactly two triangles
+	// with opposite directions
+	set<pair<uint32_t, uint32_t> > edges;
+	for (uint32_t i = 0; i < result; i++) {
+		uint32_t a = indices[i];
+		uint32_t b = indices[i - i % 3 + (i + 1) % 3];
+		EXPECT_TRUE(edges.insert(make_pair(a, b)).second);
+	}
+	for (const pair<uint32_t, uint32_t>& edge : edges) {
+		EXPECT_EQ(1u, edges.count(make_pair(edge.second, edge.first)));
+	}
+}
+
+TEST(MeshOptimizer, SimplifyPreservesBorder) {
+	const int size = 8;
+	TestMesh grid = CreateGrid(size);
+	uint32_t num_indices = uint32_t(grid.indices.size());
+	uint32_t target_num_indices = 3 * 16;
+
+	vector<uint32_t> indices = grid.indices;
+	float error = -1.f;
+	uint32_t result = MeshOptimizer::SimplifyMesh(
+			indices.data(),
+			num_indices,
+			grid.positions.data(),
+			grid.NumVertices(),
+			target_num_indices,
+			nullptr,
+			&error);
+
+	EXPECT_LE(result, target_num_indices);
+	EXPECT_GT(result, 0u);
+
+	// all collapses within the plane and along the straight borders are free
+	EXPECT_NEAR(0.f, error, 1.0e-5f);
+
+	// no triangle is flipped and the covered area is unchanged, hence the
+	// border was not moved
+	float area = 0.f;
+	set<uint32_t> used_vertices;
+	for (uint32_t i = 0; i < result; i += 3) {
+		float n[3];
+		TriangleNormal(grid, &indices[i], n);
+		EXPECT_GT(n[2], 0.f) << "triangle " << i / 3;
+		area += 0.5f * n[2];
+		used_vertices.insert(&indices[i], &indices[i] + 3);
+	}
+	EXPECT_FLOAT_EQ(float(size * size), area);
+
+	// the corners cannot be collapsed without changing the border
+	EXPECT_EQ(1u, used_vertices.count(0));
+	EXPECT_EQ(1u, used_vertices.count(size));
+	EXPECT_EQ(1u, used_vertices.count(size * (size + 1)));
+	EXPECT_EQ(1u, used_vertices.count((size + 1) * (size + 1) - 1));
+}
+
+TEST(MeshOptimizer, SimplifyDegenerateTriangles) {
+	TestMesh grid = CreateGrid(4);
+	uint32_t num_grid_triangles = uint32_t(grid.indices.size() / 3);
+
+	// triangles that reference a vertex twice
+	grid.AddTriangle(0, 0, 1);
+	grid.AddTriangle(2, 3, 3);
+	grid.AddTriangle(7, 6, 7);
+	// triangles with zero area: collinear and with coincident vertices
+	uint32_t a = grid.AddVertex(10.f, 0.f, 0.f);
+	uint32_t b = grid.AddVertex(11.f, 0.f, 0.f);
+	uint32_t c = grid.AddVertex(12.f, 0.f, 0.f);
+	grid.AddTriangle(a, b, c);
+	uint32_t d = grid.AddVertex(10.f, 1.f, 0.f);
+	grid.AddTriangle(d, d, a);
+	uint32_t e = grid.AddVertex(10.f, 1.f, 0.f);
+	grid.AddTriangle(d, e, a);
+
+	uint32_t num_indices = uint32_t(grid.indices.size());
+
+	// without a reduction only the triangles with repeated indices go away
+	vector<uint32_t> indices = grid.indices;
+	vector<uint32_t> source_triangles(num_indices / 3);
+	uint32_t result = MeshOptimizer::SimplifyMesh(
+			indices.data(),
+			num_indices,
+			grid.positions.data(),
+			grid.NumVertices(),
+			num_indices,
+			source_triangles.data());
+
+	EXPECT_EQ(num_indices - 4 * 3, result);
+	for (uint32_t i = 0; i < result; i += 3) {
+		uint32_t t = source_triangles[i / 3];
+		ASSERT_LT(t, num_indices / 3);
+		EXPECT_TRUE(t < num_grid_triangles || t == num_grid_triangles + 3
+				|| t == num_grid_triangles + 5) << "triangle " << t;
+		for (int k = 0; k < 3; k++) {
+			EXPECT_EQ(grid.indices[3 * t + k], indices[i + k]);
+		}
+	}
+
+	// simplifying as far as possible keeps the indices valid
+	indices = grid.indices;
+	result = MeshOptimizer::SimplifyMesh(
+			indices.data(),
+			num_indices,
+			grid.positions.data(),
+			grid.NumVertices(),
+			0);
+
+	EXPECT_LT(result, num_indices);
+	for (uint32_t i = 0; i < result; i += 3) {
+		for (int k = 0; k < 3; k++) {
+			ASSERT_LT(indices[i + k], grid.NumVertices());
+		}
+		EXPECT_NE(indices[i], indices[i + 1]);
+		EXPECT_NE(indices[i + 1], indices[i + 2]);
+		EXPECT_NE(indices[i], indices[i + 2]);
+	}
+}
@@ -0,0 +1,105 @@
+#include <memory>
+#include "gtest/gtest.h"
+
+#include "src/Profiler.h"
+
+using namespace std;
+
+// Feeds events directly into a thread buffer that is not registered at
+// the profiler such that the tests do not depend on the thread local
+// buffer of the calling thread.
+struct ProfilerFixture : public ::testing::Test {
+	Profiler profiler;
+	unique_ptr<Profiler::ThreadBuffer> buffer;
+	int64_t time = 0;
+
+	ProfilerFixture() : buffer(new Profiler::ThreadBuffer()) {
+		buffer->threadIndex = 0;
+	}
+
+	void Push(uint32_t marker, bool begin) {
+		uint32_t head = buffer->head.load();
+		Profiler::Event& event = buffer->events[head & (Profiler::cRingBufferSize - 1)];
+		event.time = ++time;
+		event.marker = marker;
+		event.begin = begin ? 1 : 0;
+		buffer->head.store(head + 1);
+	}
+
+	void ExpectZone(size_t index, uint32_t marker, int depth, int64_t start, int64_t end) {
+		ASSERT_LT(index, profiler.mZones.size());
+		const Profiler::Zone& zone = profiler.mZones[index];
+		EXPECT_EQ(marker, zone.marker) << "zone " << index;
+		EXPECT_EQ(depth, zone.depth) << "zone " << index;
+		EXPECT_EQ(start, zone.start) << "zone " << index;
+		EXPECT_EQ(end, zone.end) << "zone " << index;
+	}
+};
+
+TEST_F(ProfilerFixture, NestedZones) {
+	Push(1, true);
+	Push(2, true);
+	Push(2, false);
+	Push(3, true);
+	Push(3, false);
+	Push(1, false);
+	profiler.Collect(buffer.get());
+
+	ASSERT_EQ(3u, profiler.mZones.size());
+	ExpectZone(0, 2, 1, 2, 3);
+	ExpectZone(1, 3, 1, 4, 5);
+	ExpectZone(2, 1, 0, 1, 6);
+	EXPECT_EQ(0u, buffer->stack.size());
+	EXPECT_EQ(buffer->head.load(), buffer->tail.load());
+}
+
+TEST_F(ProfilerFixture, ZonesAcrossCollects) {
+	Push(1, true);
+	Push(2, true);
+	profiler.Collect(buffer.get());
+	EXPECT_EQ(0u, profiler.mZones.size());
+	EXPECT_EQ(2u, buffer->stack.size());
+
+	Push(2, false);
+	Push(1, false);
+	profiler.Collect(buffer.get());
+	ASSERT_EQ(2u, profiler.mZones.size());
+	ExpectZone(0, 2, 1, 2, 3);
+	ExpectZone(1, 1, 0, 1, 4);
+}
+
+TEST_F(ProfilerFixture, UnmatchedEndIsIgnored) {
+	Push(1, true);
+	// the begin event of marker 2 was dropped
+	Push(2, false);
+	Push(3, true);
+	Push(3, false);
+	Push(1, false);
+	profiler.Collect(buffer.get());
+
+	// zone 1 stays the parent of zone 3
+	ASSERT_EQ(2u, profiler.mZones.size());
+	ExpectZone(0, 3, 1, 3, 4);
+	ExpectZone(1, 1, 0, 1, 5);
+	EXPECT_EQ(0u, buffer->stack.size());
+
+	// and without any open zone
+	Push(4, false);
+	profiler.Collect(buffer.get());
+	EXPECT_EQ(2u, profiler.mZones.size());
+}
+
+TEST_F(ProfilerFixture, DroppedEndClosesInnerZones) {
+	Push(1, true);
+	Push(2, true);
+	// the end event of marker 2 was dropped
+	Push(1, false);
+	Push(3, true);
+	Push(3, false);
+	profiler.Collect(buffer.get());
+
+	ASSERT_EQ(2u, profiler.mZones.size());
+	ExpectZone(0, 1, 0, 1, 3);
+	ExpectZone(1, 3, 0, 4, 5);
+	EXPECT_EQ(0u, buffer->stack.size());
+}
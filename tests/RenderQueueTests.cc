@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "src/modules/RenderQueue.h"
+#include "src/modules/RenderModule.h"
+
+using namespace std;
+
+TEST(RenderQueue, DepthKeyOrder) {
+	const float inf = numeric_limits<float>::infinity();
+	const float depths[] = {
+		-inf,
+		-1.0e30f,
+		-2.f,
+		-1.f,
+		-numeric_limits<float>::min(),
+		-0.f,
+		0.f,
+		numeric_limits<float>::min(),
+		0.5f,
+		1.f,
+		1.0e30f,
+		inf
+	};
+	const int num_depths = sizeof(depths) / sizeof(depths[0]);
+
+	for (int i = 1; i < num_depths; i++) {
+		EXPECT_LE(RenderQueue::DepthKey(depths[i - 1]), RenderQueue::DepthKey(depths[i]))
+			<< depths[i - 1] << " " << depths[i];
+		if (depths[i - 1] != depths[i]) {
+			EXPECT_LT(RenderQueue::DepthKey(depths[i - 1]), RenderQueue::DepthKey(depths[i]));
+		}
+	}
+
+	mt19937 random(1234);
+	uniform_real_distribution<float> distribution(-1000.f, 1000.f);
+	for (int i = 0; i < 10000; i++) {
+		float a = distribution(random);
+		float b = distribution(random);
+		EXPECT_EQ(a < b, RenderQueue::DepthKey(a) < RenderQueue::DepthKey(b)) << a << " " << b;
+	}
+}
+
+TEST(RenderQueue, SortKeyPacking) {
+	uint64_t key = RenderQueue::SortKey(0xab, 0x123, 0x456, 1.f);
+	EXPECT_EQ(0xabu, key >> 56);
+	EXPECT_EQ(0x123u, (key >> 44) & 0xfff);
+	EXPECT_EQ(0x456u, (key >> 32) & 0xfff);
+	EXPECT_EQ(RenderQueue::DepthKey(1.f), uint32_t(key));
+
+	// larger values must not spill into the view
+	key = RenderQueue::SortKey(1, 0xffff, 0xffff, -numeric_limits<float>::infinity());
+	EXPECT_EQ(1u, key >> 56);
+	EXPECT_EQ(0xfffu, (key >> 44) & 0xfff);
+	EXPECT_EQ(0xfffu, (key >> 32) & 0xfff);
+}
+
+TEST(RenderQueue, SortKeyOrder) {
+	// the view dominates the program, the program the texture set and the
+	// texture set the depth
+	EXPECT_LT(RenderQueue::SortKey(0, 0xfff, 0xfff, 1.0e30f), RenderQueue::SortKey(1, 0, 0, -1.0e30f));
+	EXPECT_LT(RenderQueue::SortKey(1, 2, 0xfff, 1.0e30f), RenderQueue::SortKey(1, 3, 0, -1.0e30f));
+	EXPECT_LT(RenderQueue::SortKey(1, 2, 3, 1.0e30f), RenderQueue::SortKey(1, 2, 4, -1.0e30f));
+	EXPECT_LT(RenderQueue::SortKey(1, 2, 3, -1.f), RenderQueue::SortKey(1, 2, 3, 1.f));
+}
+
+// Records draws directly into the queue and only runs Sort() and Plan()
+// such that no bgfx calls are needed.
+struct RenderQueueFixture : public ::testing::Test {
+	RenderQueue queue;
+	RenderState states[4];
+	bgfx::InstanceDataBuffer instanceData;
+
+	RenderQueueFixture() {
+		for (int i = 0; i < 4; i++) {
+			RenderState& state = states[i];
+			state.m_state = 1;
+			state.m_numTextures = 1;
+			state.m_viewId = 0;
+			state.m_program.program.idx = 0;
+			state.m_textures[0].m_flags = 0;
+			state.m_textures[0].m_sampler.idx = 0;
+			state.m_textures[0].m_texture.idx = 0;
+			state.m_textures[0].m_stage = 0;
+		}
+
+		// all uniforms are vec4
+		queue.mUniformSizes.resize(4, 4);
+	}
+
+	void SetUniform(uint16_t handle, float value) {
+		RenderQueue::UniformValue uniform;
+		uniform.handle.idx = handle;
+		uniform.num = 1;
+		uniform.offset = queue.mUniformData.size();
+		queue.mUniforms.push_back(uniform);
+		queue.mUniformData.insert(queue.mUniformData.end(), 4, value);
+		queue.mPending.uniformsEnd = queue.mUniforms.size();
+	}
+
+	void Submit(const RenderState* state, float depth, bool instanced = false) {
+		RenderQueue::DrawItem item = queue.mPending;
+		item.state = state;
+		item.instanceData = instanced ? &instanceData : nullptr;
+		item.depth = depth;
+		queue.mItems.push_back(item);
+		queue.ResetPending();
+	}
+
+	void Plan() {
+		queue.Sort();
+		queue.Plan();
+		ASSERT_EQ(queue.mItems.size(), queue.mCommands.size());
+	}
+
+	const RenderQueue::DrawCommand& Command(size_t index) {
+		return queue.mCommands[index];
+	}
+
+	uint32_t NumSetUniforms(size_t index) {
+		return Command(index).uniformsEnd - Command(index).uniformsBegin;
+	}
+};
+
+TEST_F(RenderQueueFixture, EqualStatesAreSkipped) {
+	states[2].m_state = 2;
+
+	Submit(&states[0], 1.f);
+	Submit(&states[1], 2.f);
+	Submit(&states[2], 3.f);
+	Plan();
+
+	EXPECT_EQ(3u, queue.mStats.numDraws);
+	EXPECT_EQ(2u, queue.mStats.numStateChanges);
+	EXPECT_TRUE(Command(0).setState);
+	EXPECT_FALSE(Command(1).setState);
+	EXPECT_TRUE(Command(2).setState);
+
+	// the textures are the same for all draws
+	EXPECT_EQ(1u, queue.mStats.numTextureChanges);
+	EXPECT_FALSE(Command(2).setTextures);
+}
+
+TEST_F(RenderQueueFixture, EqualTexturesAreSkipped) {
+	states[1].m_textures[0].m_texture.idx = 1;
+	states[3].m_textures[0].m_flags = 1;
+
+	// draws with the same textures get sorted next to each other
+	Submit(&states[0], 1.f);
+	Submit(&states[1], 2.f);
+	Submit(&states[2], 3.f);
+	Submit(&states[3], 4.f);
+	Plan();
+
+	EXPECT_EQ(0u, Command(0).item);
+	EXPECT_EQ(2u, Command(1).item);
+	EXPECT_EQ(3u, queue.mStats.numTextureChanges);
+	EXPECT_TRUE(Command(0).setTextures);
+	EXPECT_FALSE(Command(1).setTextures);
+	EXPECT_TRUE(Command(2).setTextures);
+	EXPECT_TRUE(Command(3).setTextures);
+	EXPECT_EQ(1u, queue.mStats.numStateChanges);
+}
+
+TEST_F(RenderQueueFixture, EqualUniformValuesAreSkipped) {
+	SetUniform(0, 1.f);
+	SetUniform(1, 1.f);
+	Submit(&states[0], 1.f);
+
+	SetUniform(0, 1.f);
+	SetUniform(1, 2.f);
+	Submit(&states[0], 2.f);
+
+	SetUniform(0, 3.f);
+	SetUniform(1, 2.f);
+	Submit(&states[0], 3.f);
+	Plan();
+
+	EXPECT_EQ(4u, queue.mStats.numUniforms);
+	EXPECT_EQ(2u, queue.mStats.numSkippedUniforms);
+	EXPECT_EQ(2u, NumSetUniforms(0));
+	ASSERT_EQ(1u, NumSetUniforms(1));
+	EXPECT_EQ(3u, queue.mCommandUniforms[Command(1).uniformsBegin]);
+	ASSERT_EQ(1u, NumSetUniforms(2));
+	EXPECT_EQ(4u, queue.mCommandUniforms[Command(2).uniformsBegin]);
+
+	// cached values do not carry over to the next flush
+	Plan();
+	EXPECT_EQ(4u, queue.mStats.numUniforms);
+	EXPECT_EQ(2u, NumSetUniforms(0));
+}
+
+TEST_F(RenderQueueFixture, InstanceDataIsNotInherited) {
+	Submit(&states[0], 1.f);
+	Submit(&states[0], 2.f, true);
+	Submit(&states[0], 3.f, true);
+	Submit(&states[0], 4.f);
+	Submit(&states[0], 5.f);
+	Plan();
+
+	// instanced draws may follow any draw
+	EXPECT_TRUE(Command(0).preserveState);
+	EXPECT_TRUE(Command(1).preserveState);
+
+	// but a non-instanced draw has to start from a reset state
+	EXPECT_FALSE(Command(2).preserveState);
+	EXPECT_TRUE(Command(3).setState);
+	EXPECT_TRUE(Command(3).setTextures);
+	EXPECT_TRUE(Command(3).preserveState);
+	EXPECT_FALSE(Command(4).setState);
+
+	// nothing is kept after the last draw
+	EXPECT_FALSE(Command(4).preserveState);
+	EXPECT_EQ(2u, queue.mStats.numStateChanges);
+	EXPECT_EQ(2u, queue.mStats.numTextureChanges);
+}
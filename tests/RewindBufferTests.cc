@@ -0,0 +1,221 @@
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "src/RewindBuffer.h"
+#include "src/RuntimeModuleManager.h"
+
+using namespace std;
+
+struct RewindTestState {
+	int frame;
+	float values[64];
+	char name[32];
+};
+
+static void CaptureTestState(struct module_state* state, void* write_serializer) {
+	WriteSerializer* serializer = static_cast<WriteSerializer*>(write_serializer);
+	RewindTestState* test_state = reinterpret_cast<RewindTestState*>(state);
+	SerializeArray(*serializer, SERIALIZER_KEY("test.RewindTestState"), test_state, 1);
+}
+
+static void RestoreTestState(struct module_state* state, void* read_serializer) {
+	ReadSerializer* serializer = static_cast<ReadSerializer*>(read_serializer);
+	RewindTestState* test_state = reinterpret_cast<RewindTestState*>(state);
+	SerializeArray(*serializer, SERIALIZER_KEY("test.RewindTestState"), test_state, 1);
+}
+
+struct RewindBufferFixture : public ::testing::Test {
+	RuntimeModuleManager module_manager;
+	RuntimeModule module;
+	RewindTestState state;
+	// copy of the state of every captured frame
+	vector<RewindTestState> history;
+
+	RewindBufferFixture() {
+		memset(&state, 0, sizeof(state));
+		strcpy(state.name, "rewind");
+
+		module.api = module_api();
+		module.api.capture = CaptureTestState;
+		module.api.restore = RestoreTestState;
+		module.handle = &module;
+		module.state = reinterpret_cast<struct module_state*>(&state);
+		module_manager.mModules.push_back(&module);
+	}
+
+	~RewindBufferFixture() {
+		module_manager.mModules.clear();
+	}
+
+	// changes a few values per frame such that the deltas stay small
+	void Simulate() {
+		state.frame++;
+		state.values[state.frame % 64] += 1.f;
+		state.values[(state.frame * 7) % 64] *= 0.5f;
+	}
+
+	void CaptureFrames(RewindBuffer& buffer, int num_frames) {
+		for (int i = 0; i < num_frames; i++) {
+			Simulate();
+			buffer.Capture(module_manager);
+			history.push_back(state);
+		}
+	}
+};
+
+static bool RecordsOverlap(const RewindBuffer& buffer) {
+	for (int i = 0; i < buffer.mNumRecords; i++) {
+		const RewindBuffer::FrameRecord& a = buffer.GetRecord(i);
+		for (int j = i + 1; j < buffer.mNumRecords; j++) {
+			const RewindBuffer::FrameRecord& b = buffer.GetRecord(j);
+			if (a.offset < b.offset + b.size && b.offset < a.offset + a.size) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+TEST_F(RewindBufferFixture, RoundTrip) {
+	RewindBuffer buffer;
+	buffer.Init(1 << 20, 1024);
+
+	CaptureFrames(buffer, 200);
+
+	EXPECT_EQ(0, buffer.GetFirstFrame());
+	EXPECT_EQ(199, buffer.GetLastFrame());
+
+	Snapshot snapshot;
+	for (int frame = buffer.GetFirstFrame(); frame <= buffer.GetLastFrame(); frame++) {
+		ASSERT_TRUE(buffer.Decode(frame, snapshot));
+
+		ReadSerializer serializer;
+		serializer.Open(snapshot);
+		RewindTestState decoded;
+		ASSERT_TRUE(SerializeArray(serializer, SERIALIZER_KEY("test.RewindTestState"), &decoded, 1));
+		EXPECT_EQ(0, memcmp(&history[frame], &decoded, sizeof(decoded))) << "frame " << frame;
+	}
+
+	EXPECT_FALSE(buffer.Decode(200, snapshot));
+}
+
+TEST_F(RewindBufferFixture, KeyframeInterval) {
+	RewindBuffer buffer;
+	buffer.Init(1 << 20, 1024);
+
+	CaptureFrames(buffer, 3 * RewindBuffer::cKeyframeInterval);
+
+	for (int i = 0; i < buffer.mNumRecords; i++) {
+		EXPECT_EQ(i % RewindBuffer::cKeyframeInterval == 0, buffer.GetRecord(i).keyframe)
+			<< "frame " << buffer.GetRecord(i).frame;
+	}
+
+	// deltas only contain the few changed bytes
+	EXPECT_LT(buffer.GetRecord(1).size, buffer.GetRecord(0).size);
+}
+
+TEST_F(RewindBufferFixture, Restore) {
+	RewindBuffer buffer;
+	buffer.Init(1 << 20, 1024);
+
+	CaptureFrames(buffer, 100);
+
+	buffer.RequestRestore(42);
+	ASSERT_TRUE(buffer.ApplyRequestedRestore(module_manager));
+	EXPECT_EQ(0, memcmp(&history[42], &state, sizeof(state)));
+	EXPECT_EQ(42, buffer.GetLastFrame());
+
+	// recording continues from the restored frame
+	history.resize(43);
+	CaptureFrames(buffer, 10);
+	EXPECT_EQ(52, buffer.GetLastFrame());
+
+	Snapshot snapshot;
+	ASSERT_TRUE(buffer.Decode(50, snapshot));
+	ReadSerializer serializer;
+	serializer.Open(snapshot);
+	RewindTestState decoded;
+	ASSERT_TRUE(SerializeArray(serializer, SERIALIZER_KEY("test.RewindTestState"), &decoded, 1));
+	EXPECT_EQ(0, memcmp(&history[50], &decoded, sizeof(decoded)));
+}
+
+TEST_F(RewindBufferFixture, Eviction) {
+	RewindBuffer buffer;
+	// room for a few keyframes only
+	buffer.Init(4 * sizeof(RewindTestState), 64);
+
+	CaptureFrames(buffer, 1000);
+
+	EXPECT_GT(buffer.GetFirstFrame(), 0);
+	EXPECT_EQ(999, buffer.GetLastFrame());
+	EXPECT_TRUE(buffer.GetRecord(0).keyframe);
+	EXPECT_FALSE(RecordsOverlap(buffer));
+	EXPECT_LE(buffer.mUsedBytes, buffer.GetCapacity());
+
+	Snapshot snapshot;
+	for (int frame = buffer.GetFirstFrame(); frame <= buffer.GetLastFrame(); frame++) {
+		ASSERT_TRUE(buffer.Decode(frame, snapshot));
+
+		ReadSerializer serializer;
+		serializer.Open(snapshot);
+		RewindTestState decoded;
+		ASSERT_TRUE(SerializeArray(serializer, SERIALIZER_KEY("test.RewindTestState"), &decoded, 1));
+		EXPECT_EQ(0, memcmp(&history[frame], &decoded, sizeof(decoded))) << "frame " << frame;
+	}
+}
+
+// Stores records of the given sizes and fills the data of every record
+// with its frame number
+static void StoreRecord(RewindBuffer& buffer, int frame, uint64_t size, bool keyframe) {
+	buffer.mEncoded.assign(size, char(frame));
+
+	RewindBuffer::FrameRecord record;
+	record.frame = frame;
+	record.keyframe = keyframe;
+	record.offset = 0;
+	record.size = size;
+	record.payloadSize = size;
+	buffer.Store(record);
+}
+
+TEST(RewindBuffer, WrapDropsOverwrittenRecords) {
+	RewindBuffer buffer;
+	buffer.Init(100, 16);
+
+	StoreRecord(buffer, 0, 30, true);
+	StoreRecord(buffer, 1, 30, false);
+	StoreRecord(buffer, 2, 30, true);
+	// wraps and overwrites frames 0 and 1
+	StoreRecord(buffer, 3, 20, false);
+	StoreRecord(buffer, 4, 30, false);
+	EXPECT_EQ(2, buffer.GetFirstFrame());
+	EXPECT_EQ(3, buffer.mNumRecords);
+
+	// wraps again and overwrites frames 3 and 4 but not 2, which cannot be
+	// kept as it is older than the overwritten frames
+	StoreRecord(buffer, 5, 55, true);
+	EXPECT_EQ(5, buffer.GetFirstFrame());
+	EXPECT_EQ(1, buffer.mNumRecords);
+	EXPECT_EQ(55u, buffer.mUsedBytes);
+
+	EXPECT_FALSE(RecordsOverlap(buffer));
+	for (int i = 0; i < buffer.mNumRecords; i++) {
+		const RewindBuffer::FrameRecord& record = buffer.GetRecord(i);
+		for (uint64_t j = 0; j < record.size; j++) {
+			ASSERT_EQ(char(record.frame), buffer.mData[record.offset + j]);
+		}
+	}
+}
+
+TEST(RewindBuffer, MaxFrames) {
+	RewindBuffer buffer;
+	buffer.Init(1000, 4);
+
+	for (int i = 0; i < 10; i++) {
+		StoreRecord(buffer, i, 10, true);
+	}
+
+	EXPECT_EQ(4, buffer.mNumRecords);
+	EXPECT_EQ(6, buffer.GetFirstFrame());
+	EXPECT_EQ(9, buffer.GetLastFrame());
+}
@@ -0,0 +1,220 @@
+#include <cstdio>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "src/Serializer.h"
+
+using namespace std;
+
+static const char* cTestFilename = "SerializerTests.ptss";
+
+struct TestStruct {
+	int a;
+	float b;
+	// not serialized
+	double c;
+	char d[3];
+	bool e;
+
+	TestStruct() : a(1), b(2.f), c(3.), d{'x', 'y', 'z'}, e(false) {}
+};
+
+static const SerializerField cTestStructFields[] = {
+	SERIALIZER_FIELD(TestStruct, a),
+	SERIALIZER_FIELD(TestStruct, b),
+	SERIALIZER_FIELD(TestStruct, d),
+	SERIALIZER_FIELD(TestStruct, e)
+};
+
+static const SerializerField cChangedTestStructFields[] = {
+	SERIALIZER_FIELD(TestStruct, a),
+	SERIALIZER_FIELD(TestStruct, b),
+	SERIALIZER_FIELD(TestStruct, c)
+};
+
+template <typename Serializer>
+static void SerializeTestValues (
+		Serializer& serializer,
+		bool& flag,
+		int& number,
+		vector<float>& values,
+		vector<TestStruct>& structs) {
+	SerializeBool (serializer, SERIALIZER_KEY("test.flag"), flag);
+	SerializeInt (serializer, SERIALIZER_KEY("test.number"), number);
+	SerializeVector (serializer, SERIALIZER_KEY("test.values"), values);
+	SerializeStructs (serializer, SERIALIZER_KEY("test.structs"), structs, cTestStructFields);
+}
+
+struct SerializerFixture : public ::testing::Test {
+	bool flag = true;
+	int number = 42;
+	vector<float> values;
+	vector<TestStruct> structs;
+
+	SerializerFixture() {
+		for (int i = 0; i < 5; i++) {
+			values.push_back(float(i) * 0.5f);
+		}
+
+		structs.resize(3);
+		for (size_t i = 0; i < structs.size(); i++) {
+			structs[i].a = int(i) * 10;
+			structs[i].b = float(i) + 0.25f;
+			structs[i].c = -1.;
+			structs[i].d[1] = char('a' + i);
+			structs[i].e = i % 2 == 1;
+		}
+	}
+
+	~SerializerFixture() {
+		remove(cTestFilename);
+	}
+
+	void Write(Snapshot& snapshot) {
+		WriteSerializer serializer;
+		serializer.Open(&snapshot);
+		SerializeTestValues(serializer, flag, number, values, structs);
+		serializer.Close();
+	}
+
+	void ExpectRestored(ReadSerializer& serializer) {
+		bool read_flag = false;
+		int read_number = 0;
+		vector<float> read_values;
+		vector<TestStruct> read_structs(1);
+		SerializeTestValues(serializer, read_flag, read_number, read_values, read_structs);
+
+		EXPECT_EQ(flag, read_flag);
+		EXPECT_EQ(number, read_number);
+		EXPECT_EQ(values, read_values);
+
+		ASSERT_EQ(structs.size(), read_structs.size());
+		for (size_t i = 0; i < structs.size(); i++) {
+			EXPECT_EQ(structs[i].a, read_structs[i].a);
+			EXPECT_EQ(structs[i].b, read_structs[i].b);
+			EXPECT_EQ(3., read_structs[i].c);
+			EXPECT_EQ(0, memcmp(structs[i].d, read_structs[i].d, sizeof(structs[i].d)));
+			EXPECT_EQ(structs[i].e, read_structs[i].e);
+		}
+	}
+};
+
+TEST_F(SerializerFixture, SnapshotRoundTrip) {
+	Snapshot snapshot;
+	Write(snapshot);
+
+	for (size_t i = 0; i < snapshot.index.size(); i++) {
+		EXPECT_EQ(0u, snapshot.index[i].offset % cSnapshotAlignment);
+		if (i > 0) {
+			EXPECT_LT(snapshot.index[i - 1].hash, snapshot.index[i].hash);
+		}
+	}
+
+	ReadSerializer serializer;
+	serializer.Open(snapshot);
+	ExpectRestored(serializer);
+}
+
+TEST_F(SerializerFixture, FileRoundTrip) {
+	Snapshot snapshot;
+	Write(snapshot);
+	ASSERT_TRUE(snapshot.Write(cTestFilename));
+
+	ReadSerializer serializer;
+	serializer.Open(cTestFilename);
+	ASSERT_NE(nullptr, serializer.mapped_data);
+	EXPECT_EQ(snapshot.index.size(), serializer.num_entries);
+	ExpectRestored(serializer);
+
+	// copying the mapped values gives the same snapshot
+	Snapshot copy;
+	serializer.CopyTo(copy);
+	ReadSerializer copy_serializer;
+	copy_serializer.Open(copy);
+	ExpectRestored(copy_serializer);
+}
+
+TEST_F(SerializerFixture, VersionMismatch) {
+	Snapshot snapshot;
+	Write(snapshot);
+	ASSERT_TRUE(snapshot.Write(cTestFilename));
+
+	// patch the version in the header
+	FILE* file = fopen(cTestFilename, "r+b");
+	ASSERT_NE(nullptr, file);
+	uint32_t version = cSnapshotVersion + 1;
+	fseek(file, offsetof(SnapshotHeader, version), SEEK_SET);
+	fwrite(&version, sizeof(version), 1, file);
+	fclose(file);
+
+	ReadSerializer serializer;
+	serializer.Open(cTestFilename);
+	EXPECT_EQ(nullptr, serializer.mapped_data);
+	EXPECT_EQ(0u, serializer.num_entries);
+
+	int read_number = 0;
+	EXPECT_FALSE(SerializeInt(serializer, SERIALIZER_KEY("test.number"), read_number));
+	EXPECT_EQ(0, read_number);
+}
+
+TEST_F(SerializerFixture, InvalidFile) {
+	FILE* file = fopen(cTestFilename, "wb");
+	ASSERT_NE(nullptr, file);
+	fputs("not a snapshot", file);
+	fclose(file);
+
+	ReadSerializer serializer;
+	serializer.Open(cTestFilename);
+	EXPECT_EQ(nullptr, serializer.mapped_data);
+
+	// missing files are no error
+	remove(cTestFilename);
+	serializer.Open(cTestFilename);
+	EXPECT_EQ(nullptr, serializer.mapped_data);
+}
+
+TEST_F(SerializerFixture, ChangedValues) {
+	Snapshot snapshot;
+	Write(snapshot);
+
+	ReadSerializer serializer;
+	serializer.Open(snapshot);
+
+	// values of a different size are ignored
+	uint16_t small_number = 7;
+	EXPECT_FALSE(SerializedUint16(serializer, SERIALIZER_KEY("test.number"), small_number));
+	EXPECT_EQ(7, small_number);
+
+	// as are structs that were written with different fields
+	vector<TestStruct> read_structs(2);
+	EXPECT_FALSE(SerializeStructs(serializer, SERIALIZER_KEY("test.structs"),
+				read_structs, cChangedTestStructFields));
+	EXPECT_EQ(2u, read_structs.size());
+	EXPECT_EQ(1, read_structs[0].a);
+}
+
+TEST_F(SerializerFixture, StructArrays) {
+	Snapshot snapshot;
+	Write(snapshot);
+
+	// a, b, then d and e are adjacent and get copied as one run each
+	size_t size = 0;
+	EXPECT_EQ(2u, SerializerFieldsRun(cTestStructFields, 0, &size));
+	EXPECT_EQ(sizeof(int) + sizeof(float), size);
+	EXPECT_EQ(2u, SerializerFieldsRun(cTestStructFields, 2, &size));
+	EXPECT_EQ(3u + sizeof(bool), size);
+
+	size_t stride = SerializerFieldsStride(cTestStructFields);
+	EXPECT_EQ(sizeof(int) + sizeof(float) + 3u + sizeof(bool), stride);
+
+	ReadSerializer serializer;
+	serializer.Open(snapshot);
+
+	// arrays only restore as many values as they can hold
+	TestStruct read_structs[2];
+	EXPECT_TRUE(SerializeStructs(serializer, SERIALIZER_KEY("test.structs"),
+				read_structs, 2, cTestStructFields));
+	EXPECT_EQ(structs[1].a, read_structs[1].a);
+	EXPECT_EQ(structs[1].d[1], read_structs[1].d[1]);
+	EXPECT_EQ(3., read_structs[1].c);
+}
@@ -0,0 +1,7 @@
+// Globals of the host executable (see src/main.cc) that are referenced by
+// the code under test
+#include "src/Globals.h"
+
+Profiler* gProfiler = nullptr;
+JobSystem* gJobSystem = nullptr;
+double gTimeAtStart = 0;